@@ -1,60 +1,602 @@
 #include "myfs.h"
 #include "buffer_cache.h"
-int balloc(buffer_t *buffer)
+#include "journal.h"
+#include "disk.h"
+
+/* most threads counting free blocks in the bitmap when its summary cannot be trusted. each takes at least
+ * DISK_MAX_IOV bitmap blocks */
+#ifndef BITMAP_SCAN_THREADS
+#define BITMAP_SCAN_THREADS 4
+#endif
+
+/* free space is a bitmap on disk: bit set if block is in use. one bitmap block covers BITS_PER_BITMAP_BLOCK blocks.
+ * bitmap_free keeps the number of free blocks each bitmap block covers, so full ones are skipped without reading them. */
+u_int32_t *bitmap_free = NULL;
+u_int32_t bitmap_blocks = 0;
+/* the volume is split into allocation groups of super_block.group_blocks blocks. each has its own part of the
+ * bitmap and its summary, guarded by its own lock, so threads allocating in different groups do not wait for
+ * each other. see group_lock */
+typedef struct
+{
+	pthread_mutex_t lock; /* recursive: reading a bitmap block can flush the cache, which allocates again */
+	u_int32_t free;		  /* free blocks of the group */
+	block_no_t cursor;	  /* allocations in the group without a goal search from here */
+	block_no_t *pending;  /* runs (first block, count) freed while the lock could not be waited for. see group_defer */
+	u_int32_t pending_count, pending_size;
+} bgroup_t;
+bgroup_t *bgroups = NULL;
+u_int32_t num_bgroups = 0, group_bitmap_blocks = 0;
+/* group allocations without a goal are made in by the calling thread. spreads threads over the groups */
+__thread int home_group = -1;
+u_int32_t next_home_group = 0;
+/* highest group whose lock the calling thread holds. -1 if none */
+__thread int group_held = -1;
+/* free blocks promised to delayed allocations. other allocations cannot take them */
+u_int32_t breserved = 0;
+/* guards super_block.bfreecount, breserved and the pending frees of the groups. never held while taking another lock */
+pthread_mutex_t count_lock = PTHREAD_MUTEX_INITIALIZER;
+/* guards loading and dropping the bitmap summary and the groups */
+pthread_mutex_t alloc_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static u_int64_t bitmap_word(buffer_t *buffer, int w)
 {
-	if (super_block.bfreeptr == 0)
+	u_int64_t word;
+	memcpy(&word, buffer->data->b + w * sizeof(u_int64_t), sizeof(u_int64_t));
+	return word;
+}
+
+/* first bit in [from, to) that is set (value 1) or clear (value 0). to if there is none */
+static int bitmap_find(buffer_t *buffer, int from, int to, int value)
+{
+	while (from < to)
 	{
-		perror("balloc: no free blocks\n");
-		return -1;
+		u_int64_t word = bitmap_word(buffer, from / 64);
+		if (!value)
+			word = ~word;
+		word &= ~(u_int64_t)0 << (from % 64);
+		if (word != 0)
+		{
+			int bit = from - from % 64 + __builtin_ctzll(word);
+			return bit < to ? bit : to;
+		}
+		from = from - from % 64 + 64;
+	}
+	return to;
+}
+
+static void bitmap_set(buffer_t *buffer, int from, int count, int value)
+{
+	for (int bit = from; bit < from + count; bit++)
+	{
+		if (value)
+			buffer->data->b[bit / 8] |= 1 << (bit % 8);
+		else
+			buffer->data->b[bit / 8] &= ~(1 << (bit % 8));
+	}
+	BUFF_SET_FIELD(*buffer, BUFF_MODIFIED | BUFF_JOURNAL);
+}
+
+/* bitmap blocks [from, to) counted by one thread of bitmap_scan */
+typedef struct
+{
+	u_int32_t from, to;
+	int ret;
+} bitmap_part_t;
+
+/* counts the free blocks of a part of the bitmap into bitmap_free. the bitmap is read past the cache: no bitmap
+ * block has been changed before the summary exists, so the disk has them as they are */
+static void *bitmap_count(void *arg)
+{
+	bitmap_part_t *part = arg;
+	block_t *blocks = malloc(DISK_MAX_IOV * sizeof(block_t)), *blockp[DISK_MAX_IOV];
+	part->ret = blocks == NULL ? -1 : 0;
+	for (int i = 0; i < DISK_MAX_IOV && blocks != NULL; i++)
+		blockp[i] = blocks + i;
+	for (u_int32_t i = part->from, n; part->ret == 0 && i < part->to; i += n)
+	{
+		n = part->to - i < DISK_MAX_IOV ? part->to - i : DISK_MAX_IOV;
+		if (disk_read(disk_fd, super_block.bitmap_start + i, blockp, n) != (int)n)
+		{
+			part->ret = -1;
+			break;
+		}
+		for (u_int32_t j = 0; j < n; j++)
+		{
+			buffer_t buffer = {.data = blocks + j};
+			bitmap_free[i + j] = BITS_PER_BITMAP_BLOCK;
+			for (int w = 0; w < (int)(MY_BLK_SIZE / sizeof(u_int64_t)); w++)
+				bitmap_free[i + j] -= __builtin_popcountll(bitmap_word(&buffer, w));
+		}
+	}
+	free(blocks);
+	return NULL;
+}
+
+/* builds the summary from the bitmap. every bitmap block is read once. large bitmaps are split between threads */
+static int bitmap_scan()
+{
+	bitmap_part_t part[BITMAP_SCAN_THREADS];
+	pthread_t thread[BITMAP_SCAN_THREADS];
+	int started[BITMAP_SCAN_THREADS] = {0};
+	u_int32_t threads = (bitmap_blocks + DISK_MAX_IOV - 1) / DISK_MAX_IOV;
+	if (threads > BITMAP_SCAN_THREADS)
+		threads = BITMAP_SCAN_THREADS;
+	if (threads == 0)
+		threads = 1;
+	for (u_int32_t t = 0; t < threads; t++)
+	{
+		part[t].from = (u_int64_t)bitmap_blocks * t / threads;
+		part[t].to = (u_int64_t)bitmap_blocks * (t + 1) / threads;
+		/* the caller counts the first part itself, and any part a thread could not be started for */
+		started[t] = t > 0 && pthread_create(thread + t, NULL, bitmap_count, part + t) == 0;
+	}
+	int ret = 0;
+	for (u_int32_t t = 0; t < threads; t++)
+	{
+		if (started[t])
+			pthread_join(thread[t], NULL);
+		else
+			bitmap_count(part + t);
+		if (part[t].ret != 0)
+			ret = -1;
 	}
-	buffer_t buff;
-	if (bread(super_block.bfreeptr, &buff))
+	return ret;
+}
+
+/* reads the summary saved by bumount */
+static int summary_read()
+{
+	u_int32_t n = SUMMARY_BLOCKS(super_block.num_blocks);
+	block_t *blocks = malloc(n * sizeof(block_t)), **blockp = malloc(n * sizeof(block_t *));
+	int ret = blocks != NULL && blockp != NULL ? 0 : -1;
+	for (u_int32_t i = 0; ret == 0 && i < n; i++)
+		blockp[i] = blocks + i;
+	if (ret == 0 && disk_read(disk_fd, super_block.summary_start, blockp, n) != (int)n)
+		ret = -1;
+	if (ret == 0)
+		memcpy(bitmap_free, blocks, bitmap_blocks * sizeof(u_int32_t));
+	free(blocks);
+	free(blockp);
+	return ret;
+}
+
+/* builds the in-memory summary of the bitmap and the groups. with saved set it is read from the summary blocks,
+ * else every bitmap block is counted */
+static int bitmap_load(int saved)
+{
+	bitmap_blocks = BITMAP_BLOCKS(super_block.num_blocks);
+	group_bitmap_blocks = super_block.group_blocks / BITS_PER_BITMAP_BLOCK;
+	if (group_bitmap_blocks == 0)
+		group_bitmap_blocks = bitmap_blocks; /* one group */
+	num_bgroups = (bitmap_blocks + group_bitmap_blocks - 1) / group_bitmap_blocks;
+	bitmap_free = malloc(bitmap_blocks * sizeof(u_int32_t));
+	bgroup_t *groups = calloc(num_bgroups, sizeof(bgroup_t));
+	if (bitmap_free == NULL || groups == NULL || (saved ? summary_read() : bitmap_scan()) != 0)
 	{
-		// ! free list is corrupted
-		perror("balloc: freelist pointer is invalid\n");
+		free(bitmap_free);
+		free(groups);
+		bitmap_free = NULL;
 		return -1;
 	}
-	block_no_t freeb_no;
-	memcpy(&freeb_no, buff.data->b + MY_BLK_SIZE - sizeof(block_no_t) * super_block.bfreecount, sizeof(block_no_t));
-	if (super_block.bfreecount == 1)
+	pthread_mutexattr_t attr;
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	super_block.bfreecount = 0;
+	for (u_int32_t g = 0; g < num_bgroups; g++)
 	{
-		/* last block in list. that is free block. replace super_block.bfreeptr */
-		block_no_t t = freeb_no;
-		freeb_no = super_block.bfreeptr;
-		super_block.bfreeptr = t;
-		memset(buff.data->b, 0, MY_BLK_SIZE);
-		BUFF_SET_FIELD(buff, BUFF_MODIFIED);
-		super_block.bfreecount = INDEX_SIZE;
-		return 0;
+		pthread_mutex_init(&groups[g].lock, &attr);
+		groups[g].cursor = g * group_bitmap_blocks * BITS_PER_BITMAP_BLOCK;
+		for (u_int32_t i = g * group_bitmap_blocks; i < (g + 1) * group_bitmap_blocks && i < bitmap_blocks; i++)
+			groups[g].free += bitmap_free[i];
+		super_block.bfreecount += groups[g].free;
 	}
-	brelse(&buff);
-	bread(freeb_no, buffer);
+	pthread_mutexattr_destroy(&attr);
+	/* last: alloc_enter looks at it without the lock */
+	__atomic_store_n(&bgroups, groups, __ATOMIC_RELEASE);
 	return 0;
 }
-int bfree(block_no_t block_no)
+
+/* forgets the summary and the groups. alloc_lock is held and no allocation is running */
+static void bitmap_drop()
 {
-	buffer_t buffer;
-	if (super_block.bfreecount == INDEX_SIZE)
+	bgroup_t *groups = bgroups;
+	__atomic_store_n(&bgroups, NULL, __ATOMIC_RELEASE);
+	for (u_int32_t g = 0; groups != NULL && g < num_bgroups; g++)
 	{
-		/* first block is full, add new block */
-		super_block.bfreecount = 1;
-		if (bread(block_no, &buffer) != 0)
+		pthread_mutex_destroy(&groups[g].lock);
+		free(groups[g].pending);
+	}
+	free(bitmap_free);
+	free(groups);
+	bitmap_free = NULL;
+	breserved = 0;
+}
+
+/* reads the bitmap summary the first time */
+static int alloc_enter()
+{
+	if (__atomic_load_n(&bgroups, __ATOMIC_ACQUIRE) != NULL)
+		return 0;
+	pthread_mutex_lock(&alloc_lock);
+	int ret = bgroups == NULL ? bitmap_load(0) : 0;
+	pthread_mutex_unlock(&alloc_lock);
+	return ret;
+}
+
+#define GROUP_OF(block_no) ((block_no) / BITS_PER_BITMAP_BLOCK / group_bitmap_blocks)
+
+static int group_free(u_int32_t, block_no_t, int);
+
+/* frees the runs left for a group by frees that could not wait for its lock. the group lock is held */
+static void group_pending(u_int32_t g)
+{
+	for (;;)
+	{
+		pthread_mutex_lock(&count_lock);
+		block_no_t *runs = bgroups[g].pending;
+		u_int32_t count = bgroups[g].pending_count;
+		bgroups[g].pending = NULL;
+		bgroups[g].pending_count = bgroups[g].pending_size = 0;
+		pthread_mutex_unlock(&count_lock);
+		if (count == 0)
+			return;
+		for (u_int32_t i = 0; i < count; i++)
+			group_free(g, runs[2 * i], runs[2 * i + 1]);
+		free(runs);
+	}
+}
+
+/* leaves a run for whoever locks its group next. used by a free that cannot wait for the group lock */
+static int group_defer(u_int32_t g, block_no_t block_no, int n)
+{
+	int ret = 0;
+	pthread_mutex_lock(&count_lock);
+	bgroup_t *group = bgroups + g;
+	if (group->pending_count == group->pending_size)
+	{
+		u_int32_t size = group->pending_size == 0 ? 16 : group->pending_size * 2;
+		block_no_t *runs = realloc(group->pending, 2 * size * sizeof(block_no_t));
+		if (runs == NULL)
+			ret = -1; /* the blocks stay in use */
+		else
 		{
-			perror("bfree: cannot access free block\n");
+			group->pending = runs;
+			group->pending_size = size;
+		}
+	}
+	if (ret == 0)
+	{
+		group->pending[2 * group->pending_count] = block_no;
+		group->pending[2 * group->pending_count + 1] = n;
+		group->pending_count++;
+	}
+	pthread_mutex_unlock(&count_lock);
+	return ret;
+}
+
+/* locks a group. a thread already holding a group lock waits only for groups after it, for the others it only
+ * tries: locks are waited for in ascending order, so an allocation made by a cache flush during another one cannot
+ * deadlock. with wait 0 it only tries. gives what group_unlock needs, or -2 if the lock was not taken */
+static int group_lock(u_int32_t g, int wait)
+{
+	int prev = group_held;
+	if ((wait && (int)g > prev ? pthread_mutex_lock(&bgroups[g].lock) : pthread_mutex_trylock(&bgroups[g].lock)) != 0)
+		return -2;
+	if ((int)g > group_held)
+		group_held = g;
+	if (__atomic_load_n(&bgroups[g].pending_count, __ATOMIC_RELAXED) != 0)
+		group_pending(g);
+	return prev;
+}
+
+static void group_unlock(u_int32_t g, int prev)
+{
+	group_held = prev;
+	pthread_mutex_unlock(&bgroups[g].lock);
+}
+
+/* searches the bitmap blocks of a group for a run, from goal on and then from the start of the group.
+ * the group lock is held */
+static int group_alloc(u_int32_t g, block_no_t goal, u_int32_t min, u_int32_t max, block_no_t *first)
+{
+	u_int32_t from_block = g * group_bitmap_blocks, n = bitmap_blocks - from_block;
+	if (n > group_bitmap_blocks)
+		n = group_bitmap_blocks;
+	if (GROUP_OF(goal) != g || goal >= super_block.num_blocks)
+		goal = bgroups[g].cursor;
+	u_int32_t start = goal / BITS_PER_BITMAP_BLOCK - from_block;
+	buffer_t buffer;
+	/* bitmap block of the goal is searched from the goal, the others from their start. at last the part before the goal is searched. */
+	for (u_int32_t k = 0; k <= n; k++)
+	{
+		u_int32_t i = from_block + (start + k) % n;
+		if (bitmap_free[i] < min)
+			continue;
+		int from = k == 0 ? goal % BITS_PER_BITMAP_BLOCK : 0;
+		int to = k == n ? goal % BITS_PER_BITMAP_BLOCK : BITS_PER_BITMAP_BLOCK;
+		if (bread(super_block.bitmap_start + i, &buffer) != 0)
 			return -1;
+		for (int bit = bitmap_find(&buffer, from, to, 0), end; bit < to; bit = bitmap_find(&buffer, end, to, 0))
+		{
+			int lim = max > (u_int32_t)(BITS_PER_BITMAP_BLOCK - bit) ? BITS_PER_BITMAP_BLOCK : bit + max;
+			end = bitmap_find(&buffer, bit, lim, 1);
+			if ((u_int32_t)(end - bit) < min)
+				continue;
+			bitmap_set(&buffer, bit, end - bit, 1);
+			brelse(&buffer);
+			bitmap_free[i] -= end - bit;
+			__atomic_fetch_sub(&bgroups[g].free, end - bit, __ATOMIC_RELAXED);
+			*first = i * BITS_PER_BITMAP_BLOCK + bit;
+			__atomic_store_n(&bgroups[g].cursor, *first + (end - bit), __ATOMIC_RELAXED);
+			return end - bit;
 		}
-		memset(buffer.data->b, 0, MY_BLK_SIZE);
-		memcpy(buffer.data->b + MY_BLK_SIZE - sizeof(block_no_t) * super_block.bfreecount, &(super_block.bfreeptr), sizeof(block_no_t));
-		super_block.bfreeptr = block_no;
-		BUFF_SET_FIELD(buffer, BUFF_MODIFIED);
 		brelse(&buffer);
-		return 0;
 	}
-	/* first block has space */
-	bread(super_block.bfreeptr, &buffer);
-	super_block.bfreecount++;
-	memcpy(buffer.data->b + MY_BLK_SIZE - sizeof(block_no_t) * super_block.bfreecount, &block_no, sizeof(block_no_t));
-	BUFF_SET_FIELD(buffer, BUFF_MODIFIED);
+	return -1;
+}
+
+/* searches the groups for a run, from the group of goal on. the first pass waits only for the group of goal and skips
+ * busy ones, so threads spread over the groups. the second waits for the groups it skipped */
+static int groups_alloc(block_no_t goal, u_int32_t min, u_int32_t max, block_no_t *first)
+{
+	if (goal >= super_block.num_blocks)
+	{
+		if (home_group < 0)
+			home_group = __atomic_fetch_add(&next_home_group, 1, __ATOMIC_RELAXED) % num_bgroups;
+		goal = __atomic_load_n(&bgroups[home_group % num_bgroups].cursor, __ATOMIC_RELAXED);
+	}
+	u_int32_t start = GROUP_OF(goal);
+	char tried[num_bgroups];
+	memset(tried, 0, num_bgroups);
+	for (int pass = 0; pass < 2; pass++)
+	{
+		for (u_int32_t k = 0; k < num_bgroups; k++)
+		{
+			u_int32_t g = (start + k) % num_bgroups;
+			if (tried[g] || __atomic_load_n(&bgroups[g].free, __ATOMIC_RELAXED) < min)
+				continue;
+			int prev = group_lock(g, pass == 1 || k == 0);
+			if (prev == -2)
+				continue;
+			tried[g] = 1;
+			int got = group_alloc(g, goal, min, max, first);
+			group_unlock(g, prev);
+			if (got > 0)
+				return got;
+		}
+	}
+	return -1;
+}
+
+/* allocates a run of at least min and at most max physically contiguous free blocks, starting as close after goal as possible.
+ * a goal out of the volume means no preference: search starts at the cursor of the thread's group.
+ * gives the first block of the run in *first. returns length of the run, or -1 if there is no such run. */
+int balloc_range(block_no_t goal, u_int32_t min, u_int32_t max, block_no_t *first)
+{
+	if (alloc_enter() != 0)
+	{
+		perror("balloc: cannot read free space bitmap\n");
+		return -1;
+	}
+	if (min == 0 || max < min || min > BITS_PER_BITMAP_BLOCK)
+		return -1;
+	/* the blocks that may be taken are reserved while the groups are searched, so reservations stay good */
+	pthread_mutex_lock(&count_lock);
+	u_int32_t avail = super_block.bfreecount - breserved;
+	if (avail < min)
+	{
+		pthread_mutex_unlock(&count_lock);
+		return -1;
+	}
+	if (max > avail)
+		max = avail;
+	breserved += max;
+	pthread_mutex_unlock(&count_lock);
+	int got = groups_alloc(goal, min, max, first);
+	pthread_mutex_lock(&count_lock);
+	breserved -= max;
+	if (got > 0)
+		super_block.bfreecount -= got;
+	pthread_mutex_unlock(&count_lock);
+	return got;
+}
+
+/* like balloc_range, but takes the blocks out of max blocks the caller reserved with breserve.
+ * the reservation of the blocks it gets is used up */
+int balloc_reserved(block_no_t goal, u_int32_t min, u_int32_t max, block_no_t *first)
+{
+	if (alloc_enter() != 0 || min == 0 || max < min || min > BITS_PER_BITMAP_BLOCK)
+		return -1;
+	int got = groups_alloc(goal, min, max, first);
+	if (got > 0)
+	{
+		pthread_mutex_lock(&count_lock);
+		breserved -= got;
+		super_block.bfreecount -= got;
+		pthread_mutex_unlock(&count_lock);
+	}
+	return got;
+}
+
+/* clears the bits of [block_no, block_no + n), which are in one bitmap block of group g. the group lock is held */
+static int group_free(u_int32_t g, block_no_t block_no, int n)
+{
+	u_int32_t i = block_no / BITS_PER_BITMAP_BLOCK;
+	int bit = block_no % BITS_PER_BITMAP_BLOCK;
+	buffer_t buffer;
+	if (bread(super_block.bitmap_start + i, &buffer) != 0)
+	{
+		perror("bfree: cannot access free space bitmap\n");
+		return -1;
+	}
+	if (bitmap_find(&buffer, bit, bit + n, 0) != bit + n)
+	{
+		// ! block is freed twice
+		brelse(&buffer);
+		perror("bfree: block is already free\n");
+		return -1;
+	}
+	/* a block the journal has an image of stays in use until its release is committed. see jrevoke */
+	int freed = 0;
+	for (int k = 0; k < n; k++)
+	{
+		if (jrevoke(block_no + k))
+			continue;
+		bitmap_set(&buffer, bit + k, 1, 0);
+		freed++;
+	}
 	brelse(&buffer);
+	bitmap_free[i] += freed;
+	__atomic_fetch_add(&bgroups[g].free, freed, __ATOMIC_RELAXED);
+	pthread_mutex_lock(&count_lock);
+	super_block.bfreecount += freed;
+	pthread_mutex_unlock(&count_lock);
+	return 0;
+}
+
+/* clears the bits of a range, a bitmap block at a time */
+static int bitmap_free_range(block_no_t block_no, u_int32_t count)
+{
+	if (block_no >= super_block.num_blocks || count > super_block.num_blocks - block_no)
+	{
+		perror("bfree: block out of range\n");
+		return -1;
+	}
+	while (count > 0)
+	{
+		u_int32_t g = GROUP_OF(block_no);
+		int bit = block_no % BITS_PER_BITMAP_BLOCK;
+		int n = count < (u_int32_t)(BITS_PER_BITMAP_BLOCK - bit) ? (int)count : BITS_PER_BITMAP_BLOCK - bit;
+		/* a free made during an allocation in a later group cannot wait for the lock. the run is freed later */
+		int prev = group_lock(g, 1);
+		if (prev == -2)
+		{
+			if (group_defer(g, block_no, n) != 0)
+				return -1;
+		}
+		else
+		{
+			int ret = group_free(g, block_no, n);
+			group_unlock(g, prev);
+			if (ret != 0)
+				return -1;
+		}
+		block_no += n;
+		count -= n;
+	}
 	return 0;
 }
+
+/* frees blocks [block_no, block_no + count) */
+int bfree_range(block_no_t block_no, u_int32_t count)
+{
+	if (alloc_enter() != 0)
+		return -1;
+	return bitmap_free_range(block_no, count);
+}
+
+/* reserves count free blocks for blocks that will be allocated later */
+int breserve(u_int32_t count)
+{
+	if (alloc_enter() != 0)
+		return -1;
+	int ret = -1;
+	pthread_mutex_lock(&count_lock);
+	if (super_block.bfreecount - breserved >= count)
+	{
+		breserved += count;
+		ret = 0;
+	}
+	pthread_mutex_unlock(&count_lock);
+	return ret;
+}
+
+void bunreserve(u_int32_t count)
+{
+	pthread_mutex_lock(&count_lock);
+	breserved -= count;
+	pthread_mutex_unlock(&count_lock);
+}
+
+/* allocates one block as close after goal as possible and gives a zero filled buffer for it */
+int balloc_near(block_no_t goal, buffer_t *buffer)
+{
+	block_no_t block_no;
+	if (balloc_range(goal, 1, 1, &block_no) != 1)
+	{
+		perror("balloc: no free blocks\n");
+		return -1;
+	}
+	if (bnew(block_no, buffer) != 0)
+	{
+		bfree_range(block_no, 1);
+		return -1;
+	}
+	BUFF_SET_FIELD(*buffer, BUFF_JOURNAL); /* single blocks hold metadata. the zeroed block is logged too */
+	return 0;
+}
+
+/* allocates one block in the group of the calling thread */
+int balloc(buffer_t *buffer)
+{
+	return balloc_near(super_block.num_blocks, buffer);
+}
+
+int bfree(block_no_t block_no)
+{
+	return bfree_range(block_no, 1);
+}
+
+/* where blocks of a file with nothing to follow go: the cursor of the group its inode is in, so data is near it */
+block_no_t bgroup_goal(inode_no_t inode_no)
+{
+	if (alloc_enter() != 0 || super_block.group_inodes == 0)
+		return super_block.num_blocks;
+	u_int32_t g = (inode_no - 1) / super_block.group_inodes;
+	return g < num_bgroups ? __atomic_load_n(&bgroups[g].cursor, __ATOMIC_RELAXED) : super_block.num_blocks;
+}
+
+/* free blocks of a group. 0 for a group that does not exist */
+u_int32_t bgroup_free(u_int32_t g)
+{
+	if (alloc_enter() != 0 || g >= num_bgroups)
+		return 0;
+	return __atomic_load_n(&bgroups[g].free, __ATOMIC_RELAXED);
+}
+
+/* loads the summary of a volume being mounted. after a clean unmount the saved one is read, else the bitmap is counted */
+int bmount(int clean)
+{
+	pthread_mutex_lock(&alloc_lock);
+	bitmap_drop();
+	int ret = bitmap_load(clean && super_block.summary_start != 0);
+	pthread_mutex_unlock(&alloc_lock);
+	return ret;
+}
+
+/* saves the summary of a volume being unmounted, which is flushed, and forgets it */
+int bumount()
+{
+	pthread_mutex_lock(&alloc_lock);
+	/* locking a group frees what was left for it */
+	for (u_int32_t g = 0; bgroups != NULL && g < num_bgroups; g++)
+		group_unlock(g, group_lock(g, 1));
+	int ret = 0;
+	if (bitmap_free != NULL && super_block.summary_start != 0)
+	{
+		u_int32_t n = SUMMARY_BLOCKS(super_block.num_blocks);
+		block_t *blocks = calloc(n, sizeof(block_t)), **blockp = malloc(n * sizeof(block_t *));
+		ret = blocks != NULL && blockp != NULL ? 0 : -1;
+		for (u_int32_t i = 0; ret == 0 && i < n; i++)
+			blockp[i] = blocks + i;
+		if (ret == 0)
+			memcpy(blocks, bitmap_free, bitmap_blocks * sizeof(u_int32_t));
+		if (ret == 0 && disk_write(disk_fd, super_block.summary_start, blockp, n) != (int)n)
+			ret = -1;
+		free(blocks);
+		free(blockp);
+	}
+	bitmap_drop();
+	pthread_mutex_unlock(&alloc_lock);
+	return ret;
+}
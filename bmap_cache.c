@@ -0,0 +1,187 @@
+#include "myfs.h"
+#include "inode.h"
+#include "buffer_cache.h"
+
+/* a chunk holds the physical block numbers of BMAP_CHUNK_SIZE consecutive logical blocks of one inode. 0 is a hole. */
+typedef struct bmap_chunk
+{
+	inode_t *inode; /* owner. NULL if unused */
+	block_no_t base; /* first logical block covered */
+	struct bmap_chunk *inode_next;
+	struct bmap_chunk *lru_next, *lru_prev;
+	block_no_t map[BMAP_CHUNK_SIZE];
+} bmap_chunk_t;
+
+bmap_chunk_t bmap_chunk[BMAP_CACHE_CHUNKS];
+/* lru list of all chunks. least recently used (or unused) at head */
+bmap_chunk_t bmap_lru = {.lru_next = &bmap_lru, .lru_prev = &bmap_lru};
+int bmcache_ready = 0;
+/* guards all chunks and the bmap_gen of inodes. never held across i/o */
+pthread_mutex_t bmcache_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_once_t bmcache_once = PTHREAD_ONCE_INIT;
+
+static void lru_remove(bmap_chunk_t *chunk)
+{
+	chunk->lru_prev->lru_next = chunk->lru_next;
+	chunk->lru_next->lru_prev = chunk->lru_prev;
+}
+
+static void lru_insert(bmap_chunk_t *chunk, int at_tail)
+{
+	if (at_tail)
+	{
+		chunk->lru_prev = bmap_lru.lru_prev;
+		chunk->lru_next = &bmap_lru;
+	}
+	else
+	{
+		chunk->lru_prev = &bmap_lru;
+		chunk->lru_next = bmap_lru.lru_next;
+	}
+	chunk->lru_prev->lru_next = chunk;
+	chunk->lru_next->lru_prev = chunk;
+}
+
+static void bmcache_init()
+{
+	for (int i = 0; i < BMAP_CACHE_CHUNKS; i++)
+	{
+		bmap_chunk[i].inode = NULL;
+		bmap_chunk[i].inode_next = NULL;
+		lru_insert(bmap_chunk + i, 1);
+	}
+	__atomic_store_n(&bmcache_ready, 1, __ATOMIC_RELEASE);
+}
+
+/* takes a chunk away from its owner and puts it at the head of the lru list */
+static void chunk_drop(bmap_chunk_t *chunk)
+{
+	bmap_chunk_t **link = &(chunk->inode->bmap_cache);
+	while (*link != chunk)
+		link = &((*link)->inode_next);
+	*link = chunk->inode_next;
+	chunk->inode = NULL;
+	chunk->inode_next = NULL;
+	lru_remove(chunk);
+	lru_insert(chunk, 0);
+}
+
+/* reads the mapping of BMAP_CHUNK_SIZE logical blocks from base on into map. one index block or extent block is
+ * read at most. it is called without bmcache_lock: reading can flush the buffer cache, which maps delayed blocks
+ * through the cache */
+static int chunk_fill(inode_t *inode, block_no_t base, block_no_t *map)
+{
+	memset(map, 0, BMAP_CHUNK_SIZE * sizeof(block_no_t));
+	if (INO_USES_EXTENTS(inode))
+	{
+		extent_t ext[EXTENTS_PER_BLOCK];
+		int count = extent_load(inode, ext);
+		if (count < 0)
+			return -1;
+		for (int i = 0; i < count; i++)
+		{
+			/* unwritten blocks are holes for reading */
+			if (EXTENT_IS_UNWRITTEN(ext[i]) || ext[i].logical >= base + BMAP_CHUNK_SIZE || ext[i].logical + EXTENT_LEN(ext[i]) <= base)
+				continue;
+			block_no_t from = ext[i].logical > base ? ext[i].logical : base;
+			block_no_t to = ext[i].logical + EXTENT_LEN(ext[i]) < base + BMAP_CHUNK_SIZE ? ext[i].logical + EXTENT_LEN(ext[i]) : base + BMAP_CHUNK_SIZE;
+			for (block_no_t b = from; b < to; b++)
+				map[b - base] = ext[i].physical + (b - ext[i].logical);
+		}
+		return 0;
+	}
+	/* a chunk covers exactly one deg1 index block */
+	block_no_t index_block = inode->disk_inode.index.deg1[base / INDEX_SIZE];
+	if (index_block == 0)
+		return 0;
+	buffer_t buffer;
+	if (bread(index_block, &buffer) != 0)
+		return -1;
+	for (int i = 0; i < BMAP_CHUNK_SIZE; i++)
+	{
+		int loc_of_index = inode->disk_inode.type == FT_FIL ? encode(i, inode->key) : i;
+		memcpy(map + i, buffer.data->b + (loc_of_index * sizeof(block_no_t)), sizeof(block_no_t));
+	}
+	brelse(&buffer);
+	return 0;
+}
+
+static bmap_chunk_t *chunk_find(inode_t *inode, block_no_t base)
+{
+	bmap_chunk_t *chunk = inode->bmap_cache;
+	while (chunk != NULL && chunk->base != base)
+		chunk = chunk->inode_next;
+	return chunk;
+}
+
+/* translates a logical block through the inode's cache, filling it from disk on a miss.
+ * if run is not NULL, it tells how many blocks from logical on are mapped contiguously (or are all holes) within the chunk. */
+int bmcache_lookup(inode_t *inode, block_no_t logical_block_no, block_no_t *physical, u_int32_t *run)
+{
+	if (!__atomic_load_n(&bmcache_ready, __ATOMIC_ACQUIRE))
+		pthread_once(&bmcache_once, bmcache_init);
+	block_no_t base = logical_block_no - logical_block_no % BMAP_CHUNK_SIZE;
+	block_no_t map[BMAP_CHUNK_SIZE];
+	pthread_mutex_lock(&bmcache_lock);
+	bmap_chunk_t *chunk;
+	while ((chunk = chunk_find(inode, base)) == NULL)
+	{
+		/* the map is read unlocked. a mapping changed meanwhile bumps the generation, and it is read again */
+		u_int32_t gen = inode->bmap_gen;
+		pthread_mutex_unlock(&bmcache_lock);
+		if (chunk_fill(inode, base, map) != 0)
+			return -1;
+		pthread_mutex_lock(&bmcache_lock);
+		if (chunk_find(inode, base) != NULL || inode->bmap_gen != gen)
+			continue;
+		/* reuse the least recently used chunk, whoever owns it */
+		chunk = bmap_lru.lru_next;
+		if (chunk->inode != NULL)
+			chunk_drop(chunk);
+		chunk->base = base;
+		memcpy(chunk->map, map, sizeof(chunk->map));
+		dalloc_fill(inode, base, chunk->map, BMAP_CHUNK_SIZE); /* blocks without a physical block yet */
+		chunk->inode = inode;
+		chunk->inode_next = inode->bmap_cache;
+		inode->bmap_cache = chunk;
+		break;
+	}
+	lru_remove(chunk);
+	lru_insert(chunk, 1);
+	int i = logical_block_no - base;
+	*physical = chunk->map[i];
+	if (run != NULL)
+	{
+		u_int32_t n = 1;
+		while (i + n < BMAP_CHUNK_SIZE && (*physical == 0 ? chunk->map[i + n] == 0 : chunk->map[i + n] == *physical + n))
+			n++;
+		*run = n;
+	}
+	pthread_mutex_unlock(&bmcache_lock);
+	return 0;
+}
+
+/* a logical block has been (re)mapped. keeps a cached translation of it current */
+void bmcache_update(inode_t *inode, block_no_t logical_block_no, block_no_t physical)
+{
+	if (!__atomic_load_n(&bmcache_ready, __ATOMIC_ACQUIRE))
+		return;
+	pthread_mutex_lock(&bmcache_lock);
+	bmap_chunk_t *chunk = chunk_find(inode, logical_block_no - logical_block_no % BMAP_CHUNK_SIZE);
+	if (chunk != NULL)
+		chunk->map[logical_block_no % BMAP_CHUNK_SIZE] = physical;
+	inode->bmap_gen++;
+	pthread_mutex_unlock(&bmcache_lock);
+}
+
+/* forgets every cached translation of an inode */
+void bmcache_invalidate(inode_t *inode)
+{
+	if (!__atomic_load_n(&bmcache_ready, __ATOMIC_ACQUIRE))
+		return;
+	pthread_mutex_lock(&bmcache_lock);
+	while (inode->bmap_cache != NULL)
+		chunk_drop(inode->bmap_cache);
+	inode->bmap_gen++;
+	pthread_mutex_unlock(&bmcache_lock);
+}
@@ -1,86 +1,876 @@
 #include "buffer_cache.h"
+#include "disk.h"
+#include "journal.h"
+#include <time.h>
+#include <pthread.h>
 
-block_t buffer_data;
-buffer_header_t buffer_header = {0, BUFF_DEFAULT_STATUS};
-buffer_t buffer = {&buffer_header, &buffer_data};
+block_t buffer_data[NUM_BUFFERS];
+buffer_header_t buffer_header[NUM_BUFFERS];
+buffer_header_t *hash_queue[NUM_BUFF_HASH_QUEUES];
+/* free list: clean buffers in lru order. least recently used at head.
+ * buffers without valid data are put at the head so they are reused first.
+ * a buffer occupied by a lookup without locks stays on it and is dropped when the head reaches it. */
+buffer_header_t free_list = {.free_next = &free_list, .free_prev = &free_list};
+/* dirty list: modified buffers in the order they were first modified. they stay on it while occupied. */
+buffer_header_t dirty_list = {.free_next = &dirty_list, .free_prev = &dirty_list};
+int num_dirty = 0;
+buffer_cache_stats_t bcache_stats;
+int bcache_ready = 0;
 
-/* gives a free(unoccupied) buffer that can be used to store and track a disk block's content. */
-int getblk(block_no_t block_no, buffer_t *o_buffer)
+/* locking: hash_lock[BUFF_LOCK(b)] guards the hash queues it covers and the block number of the buffers in them.
+ * list_lock guards the free list, the dirty list and num_dirty. a hash lock is taken before list_lock.
+ * a buffer is owned by whoever set BUFF_OCCUPIED in its status with a compare and swap. only the owner changes
+ * its block number or data, so an occupied buffer keeps its identity. waiters sleep on hash_wait of the buffer's lock. */
+pthread_mutex_t hash_lock[NUM_BUFF_LOCKS];
+pthread_cond_t hash_wait[NUM_BUFF_LOCKS];
+pthread_mutex_t list_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t flush_lock; /* one flush at a time. recursive: allocating delayed blocks can flush again */
+pthread_once_t bcache_once = PTHREAD_ONCE_INIT;
+/* background flusher */
+pthread_t flusher;
+pthread_mutex_t flusher_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t flusher_wake = PTHREAD_COND_INITIALIZER;
+int flusher_running = 0;
+
+#define STAT_ADD(field, n) __atomic_fetch_add(&bcache_stats.field, (n), __ATOMIC_RELAXED)
+
+static int cas_status(buffer_header_t *header, int *expected, int desired)
+{
+	return __atomic_compare_exchange_n(&header->status, expected, desired, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+}
+
+static void hash_insert(buffer_header_t *header)
+{
+	buffer_header_t **head = hash_queue + BUFF_HASH(header->block_no);
+	header->hash_prev = NULL;
+	__atomic_store_n(&header->hash_next, *head, __ATOMIC_RELAXED);
+	if (*head != NULL)
+		(*head)->hash_prev = header;
+	__atomic_store_n(head, header, __ATOMIC_RELEASE); /* published for lookups without locks */
+}
+
+static void hash_remove(buffer_header_t *header)
+{
+	if (header->hash_prev != NULL)
+		__atomic_store_n(&header->hash_prev->hash_next, header->hash_next, __ATOMIC_RELEASE);
+	else if (hash_queue[BUFF_HASH(header->block_no)] == header)
+		__atomic_store_n(hash_queue + BUFF_HASH(header->block_no), header->hash_next, __ATOMIC_RELEASE);
+	else
+		return; /* not in any hash queue */
+	if (header->hash_next != NULL)
+		header->hash_next->hash_prev = header->hash_prev;
+	__atomic_store_n(&header->hash_next, NULL, __ATOMIC_RELEASE);
+	header->hash_prev = NULL;
+}
+
+/* caller holds the hash lock of block_no */
+static buffer_header_t *hash_find(block_no_t block_no)
+{
+	buffer_header_t *header = hash_queue[BUFF_HASH(block_no)];
+	while (header != NULL && header->block_no != block_no)
+		header = header->hash_next;
+	return header;
+}
+
+/* locks the hash locks of two blocks in order */
+static void lock_pair(block_no_t a, block_no_t b)
 {
-	/* simply 1 buffer cache */
-	if (buffer.header->status & BUFF_OCCUPIED)
+	int x = BUFF_LOCK(a), y = BUFF_LOCK(b);
+	pthread_mutex_lock(hash_lock + (x < y ? x : y));
+	if (x != y)
+		pthread_mutex_lock(hash_lock + (x < y ? y : x));
+}
+
+static void unlock_pair(block_no_t a, block_no_t b)
+{
+	int x = BUFF_LOCK(a), y = BUFF_LOCK(b);
+	pthread_mutex_unlock(hash_lock + x);
+	if (x != y)
+		pthread_mutex_unlock(hash_lock + y);
+}
+
+/* unlinks a buffer from the free list or the dirty list */
+static void list_remove(buffer_header_t *header)
+{
+	header->free_prev->free_next = header->free_next;
+	header->free_next->free_prev = header->free_prev;
+	header->free_next = header->free_prev = NULL;
+}
+
+/* buffers with valid data go to the tail (most recently used), others to the head */
+static void free_list_insert(buffer_header_t *header)
+{
+	if (__atomic_load_n(&header->status, __ATOMIC_SEQ_CST) & BUFF_VALIDDATA)
 	{
-		// ! this scenario shouldn't occur in non-multiprogramming environment
-		// perror("buffer unavailable: logical error in program\n");
-		return -1;
+		header->free_prev = free_list.free_prev;
+		header->free_next = &free_list;
+	}
+	else
+	{
+		header->free_prev = &free_list;
+		header->free_next = free_list.free_next;
+	}
+	header->free_prev->free_next = header;
+	header->free_next->free_prev = header;
+	__atomic_fetch_or(&header->status, BUFF_ONFREELIST, __ATOMIC_SEQ_CST);
+}
+
+static void dirty_list_append(buffer_header_t *header)
+{
+	header->free_prev = dirty_list.free_prev;
+	header->free_next = &dirty_list;
+	header->free_prev->free_next = header;
+	header->free_next->free_prev = header;
+	__atomic_fetch_or(&header->status, BUFF_ONDIRTYLIST, __ATOMIC_SEQ_CST);
+	header->dirtied = time(NULL);
+	__atomic_fetch_add(&num_dirty, 1, __ATOMIC_RELAXED);
+}
+
+/* a dirty buffer has been written. move it off the dirty list. its owner puts it on the free list when releasing it */
+static void mark_clean(buffer_header_t *header)
+{
+	pthread_mutex_lock(&list_lock);
+	if (__atomic_load_n(&header->status, __ATOMIC_SEQ_CST) & BUFF_ONDIRTYLIST)
+	{
+		list_remove(header);
+		__atomic_fetch_sub(&num_dirty, 1, __ATOMIC_RELAXED);
+	}
+	__atomic_fetch_and(&header->status, ~(BUFF_MODIFIED | BUFF_ONDIRTYLIST), __ATOMIC_SEQ_CST);
+	pthread_mutex_unlock(&list_lock);
+}
+
+static void bcache_init()
+{
+	pthread_mutexattr_t attr;
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(&flush_lock, &attr);
+	pthread_mutexattr_destroy(&attr);
+	for (int i = 0; i < NUM_BUFF_LOCKS; i++)
+	{
+		pthread_mutex_init(hash_lock + i, NULL);
+		pthread_cond_init(hash_wait + i, NULL);
+	}
+	for (int i = 0; i < NUM_BUFFERS; i++)
+	{
+		buffer_header[i].block_no = 0;
+		buffer_header[i].status = BUFF_DEFAULT_STATUS;
+		buffer_header[i].data = buffer_data + i;
+		buffer_header[i].hash_next = buffer_header[i].hash_prev = NULL;
+		buffer_header[i].waiters = 0;
+		buffer_header[i].jtid = 0;
+		free_list_insert(buffer_header + i);
+	}
+	__atomic_store_n(&bcache_ready, 1, __ATOMIC_RELEASE);
+}
+
+static void bcache_start()
+{
+	if (!__atomic_load_n(&bcache_ready, __ATOMIC_ACQUIRE))
+		pthread_once(&bcache_once, bcache_init);
+}
+
+/* gives up ownership of a buffer. it goes on the list its state needs and sleepers waiting for it are woken */
+static void release(buffer_header_t *header)
+{
+	block_no_t block_no = header->block_no; /* may change as soon as the buffer is released */
+	int status = __atomic_load_n(&header->status, __ATOMIC_SEQ_CST);
+	/* no list change needed: clean and still on the free list, or modified and on the dirty list */
+	while ((status & BUFF_MODIFIED) ? (status & BUFF_ONDIRTYLIST) : (status & BUFF_ONFREELIST))
+	{
+		if (cas_status(header, &status, status & ~BUFF_OCCUPIED))
+			goto wake;
+	}
+	pthread_mutex_lock(&list_lock);
+	status = __atomic_load_n(&header->status, __ATOMIC_SEQ_CST);
+	if (status & BUFF_MODIFIED)
+	{
+		if (!(status & BUFF_ONDIRTYLIST))
+		{
+			if (status & BUFF_ONFREELIST)
+			{
+				list_remove(header);
+				__atomic_fetch_and(&header->status, ~BUFF_ONFREELIST, __ATOMIC_SEQ_CST);
+			}
+			dirty_list_append(header);
+		}
 	}
-	if (buffer.header->block_no == block_no)
+	else if (!(status & BUFF_ONFREELIST))
+		free_list_insert(header);
+	__atomic_fetch_and(&header->status, ~BUFF_OCCUPIED, __ATOMIC_SEQ_CST);
+	pthread_mutex_unlock(&list_lock);
+wake:
+	if (__atomic_load_n(&header->waiters, __ATOMIC_SEQ_CST) > 0)
 	{
-		/* buffer is already of same block number. Just occupy the buffer. */
-		buffer.header->status |= BUFF_OCCUPIED;
-		*o_buffer = buffer;
+		int lock = BUFF_LOCK(block_no);
+		pthread_mutex_lock(hash_lock + lock);
+		pthread_cond_broadcast(hash_wait + lock);
+		pthread_mutex_unlock(hash_lock + lock);
+	}
+}
+
+/* occupies the buffer of a cached block without taking a lock. only a buffer that is not occupied and has valid data
+ * qualifies. a buffer that moves to another hash queue meanwhile makes the lookup miss; the caller then locks. */
+static buffer_header_t *lookup_unlocked(block_no_t block_no)
+{
+	buffer_header_t *header = __atomic_load_n(hash_queue + BUFF_HASH(block_no), __ATOMIC_ACQUIRE);
+	for (int steps = 0; header != NULL && steps < NUM_BUFFERS; steps++)
+	{
+		if (__atomic_load_n(&header->block_no, __ATOMIC_ACQUIRE) == block_no)
+		{
+			int status = __atomic_load_n(&header->status, __ATOMIC_SEQ_CST);
+			if ((status & (BUFF_OCCUPIED | BUFF_VALIDDATA)) != BUFF_VALIDDATA || !cas_status(header, &status, status | BUFF_OCCUPIED | BUFF_REFERENCED))
+				return NULL;
+			if (__atomic_load_n(&header->block_no, __ATOMIC_ACQUIRE) == block_no && (__atomic_load_n(&header->status, __ATOMIC_SEQ_CST) & BUFF_VALIDDATA))
+				return header;
+			release(header); /* buffer was given another block before it was occupied */
+			return NULL;
+		}
+		header = __atomic_load_n(&header->hash_next, __ATOMIC_ACQUIRE);
+	}
+	return NULL;
+}
+
+/* occupies a buffer from the head of the free list to hold another block. buffers used since the head last
+ * reached them go to the tail once more. returns NULL if the free list is empty. */
+static buffer_header_t *take_free()
+{
+	pthread_mutex_lock(&list_lock);
+	for (;;)
+	{
+		buffer_header_t *header = free_list.free_next;
+		if (header == &free_list)
+		{
+			pthread_mutex_unlock(&list_lock);
+			return NULL;
+		}
+		int status = __atomic_load_n(&header->status, __ATOMIC_SEQ_CST);
+		if (status & BUFF_OCCUPIED)
+		{
+			/* occupied by a lookup without locks. its owner puts it back when releasing it */
+			if (cas_status(header, &status, status & ~BUFF_ONFREELIST))
+				list_remove(header);
+		}
+		else if (status & BUFF_REFERENCED)
+		{
+			if (cas_status(header, &status, status & ~BUFF_REFERENCED))
+			{
+				list_remove(header);
+				free_list_insert(header);
+			}
+		}
+		else if (cas_status(header, &status, (status | BUFF_OCCUPIED) & ~BUFF_ONFREELIST))
+		{
+			list_remove(header);
+			pthread_mutex_unlock(&list_lock);
+			return header;
+		}
+	}
+}
+
+/* gives the occupied buffer of a block. if its buffer is occupied, waits for it when wait is set, else fails */
+static int get_buffer(block_no_t block_no, buffer_t *o_buffer, int wait)
+{
+	bcache_start();
+	buffer_header_t *header = lookup_unlocked(block_no);
+	while (header == NULL)
+	{
+		int lock = BUFF_LOCK(block_no);
+		pthread_mutex_lock(hash_lock + lock);
+		header = hash_find(block_no);
+		if (header != NULL)
+		{
+			int status = __atomic_load_n(&header->status, __ATOMIC_SEQ_CST);
+			if (!(status & BUFF_OCCUPIED))
+			{
+				/* block is already in cache. Just occupy the buffer. */
+				if (!cas_status(header, &status, status | BUFF_OCCUPIED | BUFF_REFERENCED))
+					header = NULL; /* lost a race. look again */
+				pthread_mutex_unlock(hash_lock + lock);
+				continue;
+			}
+			if (!wait)
+			{
+				pthread_mutex_unlock(hash_lock + lock);
+				return -1;
+			}
+			/* sleep until the buffer is released. it may hold another block by then, so look again */
+			__atomic_fetch_add(&header->waiters, 1, __ATOMIC_SEQ_CST);
+			while (__atomic_load_n(&header->block_no, __ATOMIC_ACQUIRE) == block_no && (__atomic_load_n(&header->status, __ATOMIC_SEQ_CST) & BUFF_OCCUPIED))
+				pthread_cond_wait(hash_wait + lock, hash_lock + lock);
+			__atomic_fetch_sub(&header->waiters, 1, __ATOMIC_SEQ_CST);
+			pthread_mutex_unlock(hash_lock + lock);
+			header = NULL;
+			continue;
+		}
+		pthread_mutex_unlock(hash_lock + lock);
+		buffer_header_t *victim = take_free();
+		if (victim == NULL)
+		{
+			/* no clean buffer left. write back the dirty ones in one sorted pass */
+			bflush();
+			if ((victim = take_free()) == NULL && jforce() == 0)
+			{
+				/* the dirty ones wait for their transaction. commit it so they can go */
+				bflush();
+				victim = take_free();
+			}
+			if (victim == NULL)
+				return -1; /* every buffer is occupied */
+		}
+		block_no_t old_block_no = victim->block_no;
+		lock_pair(old_block_no, block_no);
+		if (hash_find(block_no) != NULL)
+		{
+			/* another thread brought the block in meanwhile */
+			unlock_pair(old_block_no, block_no);
+			release(victim);
+			continue;
+		}
+		STAT_ADD(misses, 1);
+		if (__atomic_load_n(&victim->status, __ATOMIC_SEQ_CST) & BUFF_VALIDDATA)
+			STAT_ADD(evictions, 1); /* buffer is clean, it can be reused right away */
+		hash_remove(victim);
+		victim->data = DISK_IS_MAPPED() && !IS_DELAYED_BLOCK(block_no) ? DISK_MAPPED_BLOCK(block_no) : buffer_data + (victim - buffer_header);
+		/* a buffer pointing straight into the mapped image always has valid data */
+		__atomic_store_n(&victim->status, BUFF_OCCUPIED | (DISK_IS_MAPPED() && !IS_DELAYED_BLOCK(block_no) ? BUFF_VALIDDATA : 0), __ATOMIC_SEQ_CST);
+		victim->jtid = 0;
+		__atomic_store_n(&victim->block_no, block_no, __ATOMIC_RELEASE);
+		hash_insert(victim);
+		pthread_cond_broadcast(hash_wait + BUFF_LOCK(old_block_no)); /* sleepers on the evicted block look it up again */
+		unlock_pair(old_block_no, block_no);
+		o_buffer->header = victim;
+		o_buffer->data = victim->data;
 		return 0;
 	}
-	/* buffer is available but its content must be saved before using it */
-	bwrite(&buffer);
-	buffer.header->status = BUFF_DEFAULT_STATUS | BUFF_OCCUPIED;
-	buffer.header->block_no = block_no;
-	*o_buffer = buffer;
+	STAT_ADD(hits, 1);
+	o_buffer->header = header;
+	o_buffer->data = header->data;
 	return 0;
 }
 
-/* releases(unoccupies) a buffer. writing to disk is lazy. */
+/* gives an occupied buffer that can be used to store and track a disk block's content.
+ * if another thread occupies the block's buffer, waits until it is released. */
+int getblk(block_no_t block_no, buffer_t *o_buffer)
+{
+	return get_buffer(block_no, o_buffer, 1);
+}
+
+/* 2 when too many buffers are dirty, 1 when the oldest has waited too long, else 0.
+ * the oldest is looked at once a second at most, unless always is set, so writers rarely take list_lock for it. */
+time_t expiry_checked = 0;
+static int dirty_pressure(int always)
+{
+	int dirty = __atomic_load_n(&num_dirty, __ATOMIC_RELAXED), pressure = 0;
+	if (dirty * 100 > NUM_BUFFERS * BUFF_DIRTY_RATIO)
+		return 2;
+	time_t now = time(NULL);
+	if (dirty == 0 || (!always && __atomic_load_n(&expiry_checked, __ATOMIC_RELAXED) == now))
+		return 0;
+	__atomic_store_n(&expiry_checked, now, __ATOMIC_RELAXED);
+	pthread_mutex_lock(&list_lock);
+	if (num_dirty > 0 && now - dirty_list.free_next->dirtied >= BUFF_DIRTY_EXPIRE)
+		pressure = 1;
+	pthread_mutex_unlock(&list_lock);
+	return pressure;
+}
+
+/* writes back dirty buffers when too many are dirty or the oldest has waited too long.
+ * with the background flusher running, writers only wake it. */
+static void balance_dirty()
+{
+	int pressure = dirty_pressure(0);
+	if (pressure == 0)
+		return;
+	if (__atomic_load_n(&flusher_running, __ATOMIC_RELAXED))
+	{
+		if (pressure == 2)
+			pthread_cond_signal(&flusher_wake);
+		return;
+	}
+	/* the writer pays for the flush. if another thread is flushing already, that one does it */
+	if (pthread_mutex_trylock(&flush_lock) == 0)
+	{
+		bflush();
+		pthread_mutex_unlock(&flush_lock);
+	}
+}
+
+/* releases(unoccupies) a buffer. writing to disk is lazy. modified metadata is logged first */
 int brelse(buffer_t *i_buffer)
 {
-	/* just remove buffer from caller. mark buffer as unoccupied.*/
-	BUFF_REM_FIELD(*i_buffer,BUFF_OCCUPIED);
+	if (BUFF_IS_SET(*i_buffer, BUFF_JOURNAL))
+	{
+		__atomic_store_n(&i_buffer->header->jtid, jlog(i_buffer->header->block_no, i_buffer->data), __ATOMIC_RELAXED);
+		BUFF_REM_FIELD(*i_buffer, BUFF_JOURNAL);
+	}
+	/* mark buffer as unoccupied and put it on free or dirty list.*/
+	release(i_buffer->header);
 	i_buffer->header = NULL;
 	i_buffer->data = NULL;
+	balance_dirty();
 	return 0;
 }
 
+/* reads the blocks of occupied buffers that do not have valid data yet.
+ * buffers of consecutive blocks are read with one transfer, and all transfers are submitted together. */
+static int read_run(buffer_t *run, int n)
+{
+	block_t *blocks[NUM_BUFFERS];
+	int len[NUM_BUFFERS], done[NUM_BUFFERS], ret = 0;
+	for (int i = 0; i < n; i += len[i] ? len[i] : 1)
+	{
+		for (len[i] = 0; i + len[i] < n && !BUFF_IS_SET(run[i + len[i]], BUFF_VALIDDATA) && run[i + len[i]].header->block_no == run[i].header->block_no + len[i]; len[i]++)
+			blocks[i + len[i]] = run[i + len[i]].data;
+		done[i] = 0;
+		if (len[i] != 0) /* else buffer already has valid data */
+			disk_queue(disk_fd, run[i].header->block_no, blocks + i, len[i], 0, done + i);
+	}
+	disk_wait_all();
+	for (int i = 0; i < n; i += len[i] ? len[i] : 1)
+	{
+		for (int j = 0; j < done[i]; j++)
+		{
+			BUFF_SET_FIELD(run[i + j], BUFF_VALIDDATA);
+			BUFF_REM_FIELD(run[i + j], BUFF_MODIFIED);
+		}
+		if (done[i] < len[i])
+			ret = -1;
+	}
+	return ret;
+}
+
+/* writes the modified buffers in headers, which the caller occupies. buffers of consecutive blocks are written
+ * with one transfer, and all transfers are submitted together. written buffers become clean.
+ * a buffer logged by a transaction not yet committed stays dirty: the journal must have it first. */
+static int write_run(buffer_header_t **headers, int n)
+{
+	block_t *blocks[NUM_BUFFERS];
+	int len[NUM_BUFFERS], done[NUM_BUFFERS], ret = 0;
+	for (int i = 0; i < n; i += len[i] ? len[i] : 1)
+	{
+		for (len[i] = 0; i + len[i] < n && (__atomic_load_n(&headers[i + len[i]]->status, __ATOMIC_SEQ_CST) & (BUFF_MODIFIED | BUFF_VALIDDATA)) == (BUFF_MODIFIED | BUFF_VALIDDATA) && !IS_DELAYED_BLOCK(headers[i + len[i]]->block_no) && jcommitted(headers[i + len[i]]->jtid) && headers[i + len[i]]->block_no == headers[i]->block_no + len[i]; len[i]++)
+			blocks[i + len[i]] = headers[i + len[i]]->data;
+		done[i] = 0;
+		if (len[i] != 0) /* else write skipped as data is unmodified or invalid */
+		{
+			disk_queue(disk_fd, headers[i]->block_no, blocks + i, len[i], 1, done + i);
+			STAT_ADD(flushes, 1);
+		}
+	}
+	disk_wait_all();
+	for (int i = 0; i < n; i += len[i] ? len[i] : 1)
+	{
+		STAT_ADD(writebacks, done[i]);
+		for (int j = 0; j < done[i]; j++)
+			mark_clean(headers[i + j]);
+		if (done[i] < len[i])
+			ret = -1; /* the rest stay dirty */
+	}
+	return ret;
+}
+
 /* read a block from disk. returns a buffer with block's contents. */
 int bread(block_no_t block_no, buffer_t *o_buffer)
 {
-	if (block_no >= super_block.num_blocks)
+	return breadv(block_no, 1, o_buffer);
+}
+
+/* gives an occupied buffer for a newly allocated block. its old content does not matter, so the disk is not read.
+ * the buffer is zero filled and modified. */
+int bnew(block_no_t block_no, buffer_t *o_buffer)
+{
+	if ((block_no >= super_block.num_blocks && !IS_DELAYED_BLOCK(block_no)) || getblk(block_no, o_buffer) != 0)
+		return -1;
+	memset(o_buffer->data, 0, MY_BLK_SIZE);
+	BUFF_SET_FIELD(*o_buffer, BUFF_VALIDDATA | BUFF_MODIFIED);
+	return 0;
+}
+
+/* reads blocks [block_no, block_no + count) into count occupied buffers.
+ * blocks not in cache are read from disk together with one call per run. */
+int breadv(block_no_t block_no, int count, buffer_t *o_buffers)
+{
+	/* a delayed block is always cached, it is never read from disk */
+	if (count <= 0 || count > BUFF_MAX_RUN || (block_no + count > super_block.num_blocks && !IS_DELAYED_BLOCK(block_no)))
 	{
 /* 		sprintf(err, "bread: block %u is out of range\n", block_no);
 		perror(err); */
 		return -1;
 	}
-	if (getblk(block_no, o_buffer)!=0)
+	for (int i = 0; i < count; i++)
+	{
+		if (getblk(block_no + i, o_buffers + i) != 0)
+		{
+			while (i--)
+				brelse(o_buffers + i);
+			return -1;
+		}
+	}
+	if (read_run(o_buffers, count) != 0)
 	{
+		for (int i = 0; i < count; i++)
+			brelse(o_buffers + i);
 		return -1;
 	}
-	if (o_buffer->header->status & BUFF_VALIDDATA)
+	return 0;
+}
+
+/* occupies the buffer of a block if the block is cached. *header is NULL if it is not.
+ * returns -1 if the buffer is occupied already. */
+static int claim_cached(block_no_t block_no, buffer_header_t **header)
+{
+	int lock = BUFF_LOCK(block_no), ret = 0;
+	pthread_mutex_lock(hash_lock + lock);
+	*header = hash_find(block_no);
+	if (*header != NULL)
 	{
-		/* buffer contains valid data. No need to do anything */
-		return 0;
+		int status = __atomic_load_n(&(*header)->status, __ATOMIC_SEQ_CST);
+		if ((status & BUFF_OCCUPIED) || !cas_status(*header, &status, status | BUFF_OCCUPIED))
+			ret = -1;
+	}
+	pthread_mutex_unlock(hash_lock + lock);
+	return ret;
+}
+
+/* drops the block of an occupied buffer, modified or not, and releases the buffer to the head of the free list */
+static void forget(buffer_header_t *header)
+{
+	int lock = BUFF_LOCK(header->block_no);
+	pthread_mutex_lock(hash_lock + lock);
+	hash_remove(header);
+	__atomic_store_n(&header->block_no, 0, __ATOMIC_RELEASE);
+	pthread_cond_broadcast(hash_wait + lock); /* sleepers look the block up again */
+	pthread_mutex_unlock(hash_lock + lock);
+	pthread_mutex_lock(&list_lock);
+	int status = __atomic_load_n(&header->status, __ATOMIC_SEQ_CST);
+	if (status & (BUFF_ONDIRTYLIST | BUFF_ONFREELIST))
+		list_remove(header);
+	if (status & BUFF_ONDIRTYLIST)
+		__atomic_fetch_sub(&num_dirty, 1, __ATOMIC_RELAXED);
+	header->data = buffer_data + (header - buffer_header);
+	header->jtid = 0;
+	__atomic_store_n(&header->status, BUFF_DEFAULT_STATUS | BUFF_OCCUPIED, __ATOMIC_SEQ_CST);
+	free_list_insert(header);
+	__atomic_fetch_and(&header->status, ~BUFF_OCCUPIED, __ATOMIC_SEQ_CST);
+	pthread_mutex_unlock(&list_lock);
+}
+
+/* reads the gathered buffers and releases them */
+static void prefetch_run(buffer_t *run, int n)
+{
+	read_run(run, n);
+	for (int j = 0; j < n; j++)
+	{
+		if (BUFF_IS_SET(run[j], BUFF_VALIDDATA))
+			STAT_ADD(prefetched, 1);
+		brelse(run + j);
+	}
+}
+
+/* brings the listed blocks into the cache without keeping them occupied. blocks already cached, in use
+ * or numbered 0 are skipped. runs of consecutive blocks are read together and up to BUFF_MAX_RUN
+ * blocks are submitted at once. */
+int bprefetchv(const block_no_t *block_nos, int count)
+{
+	buffer_t run[BUFF_MAX_RUN];
+	int n = 0;
+	bcache_start();
+	for (int i = 0; i < count; i++)
+	{
+		block_no_t block_no = block_nos[i];
+		if (block_no == 0 || block_no >= super_block.num_blocks)
+			continue;
+		if (DISK_IS_MAPPED())
+		{
+			disk_prefetch(block_no, 1);
+			continue;
+		}
+		buffer_header_t *header;
+		if (claim_cached(block_no, &header) != 0)
+			continue; /* in use */
+		if (header != NULL)
+		{
+			if (__atomic_load_n(&header->status, __ATOMIC_SEQ_CST) & BUFF_VALIDDATA)
+			{
+				release(header); /* already cached */
+				continue;
+			}
+			run[n].header = header;
+			run[n].data = header->data;
+		}
+		else if (get_buffer(block_no, run + n, 0) != 0)
+			continue; /* another thread got to it first, or no buffer is free */
+		if (++n == BUFF_MAX_RUN)
+		{
+			prefetch_run(run, n);
+			n = 0;
+		}
+	}
+	prefetch_run(run, n);
+	return 0;
+}
+
+/* brings blocks [block_no, block_no + count) into the cache without keeping them occupied. */
+int bprefetch(block_no_t block_no, u_int32_t count)
+{
+	block_no_t block_nos[BUFF_MAX_RUN];
+	if (DISK_IS_MAPPED())
+		return disk_prefetch(block_no, count);
+	for (u_int32_t i = 0; i < count; i += BUFF_MAX_RUN)
+	{
+		int n = count - i < BUFF_MAX_RUN ? count - i : BUFF_MAX_RUN;
+		for (int j = 0; j < n; j++)
+			block_nos[j] = block_no + i + j;
+		bprefetchv(block_nos, n);
 	}
-	lseek(disk_fd, block_no * MY_BLK_SIZE, SEEK_SET);
-	read(disk_fd, o_buffer->data, MY_BLK_SIZE);
-	BUFF_SET_FIELD(*o_buffer,BUFF_VALIDDATA);
-	BUFF_REM_FIELD(*o_buffer,BUFF_MODIFIED);
 	return 0;
 }
+
 /* writes a buffer to disk. */
 int bwrite(buffer_t *i_buffer)
 {
-	if (BUFF_IS_SET(*i_buffer,BUFF_MODIFIED | BUFF_VALIDDATA))
-	{ /* write skipped if data is unmodified or invalid */
-		lseek(disk_fd, MY_BLK_SIZE * i_buffer->header->block_no, SEEK_SET);
-		write(disk_fd, i_buffer->data, MY_BLK_SIZE);
+	return bwritev(i_buffer, 1);
+}
+
+/* writes count buffers to disk. buffers of consecutive blocks are written with one call. */
+int bwritev(buffer_t *i_buffers, int count)
+{
+	buffer_header_t *headers[BUFF_MAX_RUN];
+	int ret = 0;
+	if (DISK_IS_MAPPED())
+	{
+		/* data already is in the mapped image. modified buffers stay dirty until bflush syncs them */
+		return 0;
+	}
+	for (int i = 0, n; i < count; i += n)
+	{
+		n = count - i < BUFF_MAX_RUN ? count - i : BUFF_MAX_RUN;
+		for (int j = 0; j < n; j++)
+			headers[j] = i_buffers[i + j].header;
+		if (write_run(headers, n) != 0)
+			ret = -1;
+	}
+	return ret;
+}
+
+static int cmp_block_no(const void *a, const void *b)
+{
+	block_no_t x = (*(buffer_header_t **)a)->block_no, y = (*(buffer_header_t **)b)->block_no;
+	return (x > y) - (x < y);
+}
+
+/* writes back every dirty buffer that is not occupied, in one pass sorted by block number.
+ * the buffers are occupied while they are written. delayed blocks are skipped, and journaled ones unless metadata is set. */
+static int flush_dirty(int metadata)
+{
+	buffer_header_t *dirty[NUM_BUFFERS];
+	int n = 0;
+	pthread_mutex_lock(&list_lock);
+	for (buffer_header_t *header = dirty_list.free_next; header != &dirty_list; header = header->free_next)
+	{
+		int status = __atomic_load_n(&header->status, __ATOMIC_SEQ_CST);
+		if (!(status & BUFF_OCCUPIED) && (metadata || __atomic_load_n(&header->jtid, __ATOMIC_RELAXED) == 0) && cas_status(header, &status, status | BUFF_OCCUPIED))
+			dirty[n++] = header;
+	}
+	pthread_mutex_unlock(&list_lock);
+	qsort(dirty, n, sizeof(buffer_header_t *), cmp_block_no);
+	int ret = write_run(dirty, n);
+	for (int i = 0; i < n; i++)
+		release(dirty[i]);
+	return ret;
+}
+
+/* writes back every unoccupied dirty buffer in one pass sorted by block number.
+ * delayed blocks get their physical blocks first.
+ * buffers of physically adjacent blocks are written together with one pwritev
+ * (one msync when the image is mapped). */
+int bflush()
+{
+	bcache_start();
+	pthread_mutex_lock(&flush_lock);
+	dalloc_flush();
+	int ret = flush_dirty(1);
+	pthread_mutex_unlock(&flush_lock);
+	return ret;
+}
+
+/* writes back every unoccupied dirty buffer but journaled metadata. the journal makes that durable, and it
+ * goes home later */
+int bflushdata()
+{
+	bcache_start();
+	pthread_mutex_lock(&flush_lock);
+	dalloc_flush();
+	int ret = flush_dirty(0);
+	pthread_mutex_unlock(&flush_lock);
+	return ret;
+}
+
+/* gives a cached block a new block number. a delayed block gets its physical block this way.
+ * a cached copy of the new block is dropped. fails if either buffer is occupied. */
+int brename(block_no_t old_block_no, block_no_t new_block_no)
+{
+	if (!__atomic_load_n(&bcache_ready, __ATOMIC_ACQUIRE))
+		return -1;
+	buffer_header_t *header, *stale;
+	if (claim_cached(old_block_no, &header) != 0 || header == NULL)
+		return -1;
+	if (claim_cached(new_block_no, &stale) != 0)
+	{
+		release(header);
+		return -1;
+	}
+	if (stale != NULL)
+		forget(stale);
+	lock_pair(old_block_no, new_block_no);
+	hash_remove(header);
+	__atomic_store_n(&header->block_no, new_block_no, __ATOMIC_RELEASE);
+	hash_insert(header);
+	pthread_cond_broadcast(hash_wait + BUFF_LOCK(old_block_no)); /* sleepers look the old block up again */
+	unlock_pair(old_block_no, new_block_no);
+	if (DISK_IS_MAPPED())
+	{
+		memcpy(DISK_MAPPED_BLOCK(new_block_no), header->data, MY_BLK_SIZE);
+		header->data = DISK_MAPPED_BLOCK(new_block_no);
+	}
+	release(header);
+	return 0;
+}
+
+/* writes back cached dirty blocks in [block_no, block_no + count) so the disk has their latest contents */
+int bflushrange(block_no_t block_no, u_int32_t count)
+{
+	buffer_header_t *dirty[NUM_BUFFERS];
+	int n = 0;
+	if (!__atomic_load_n(&bcache_ready, __ATOMIC_ACQUIRE))
+		return 0;
+	for (u_int32_t i = 0; i < count && n < NUM_BUFFERS; i++)
+	{
+		buffer_header_t *header;
+		if (claim_cached(block_no + i, &header) != 0 || header == NULL)
+			continue;
+		if (__atomic_load_n(&header->status, __ATOMIC_SEQ_CST) & BUFF_ONDIRTYLIST)
+			dirty[n++] = header;
+		else
+			release(header);
+	}
+	int ret = write_run(dirty, n);
+	for (int i = 0; i < n; i++)
+		release(dirty[i]);
+	return ret;
+}
+
+/* drops cached copies of blocks in [block_no, block_no + count), modified or not.
+ * used when the blocks are about to be overwritten on disk without the cache. */
+int binvalidate(block_no_t block_no, u_int32_t count)
+{
+	if (!__atomic_load_n(&bcache_ready, __ATOMIC_ACQUIRE))
+		return 0;
+	for (u_int32_t i = 0; i < count; i++)
+	{
+		buffer_header_t *header;
+		if (claim_cached(block_no + i, &header) == 0 && header != NULL)
+			forget(header);
 	}
-	i_buffer->header->status &= ~BUFF_MODIFIED;
-	/* validity of data remains the same */
 	return 0;
 }
 
+/* writes back all modified buffers and invalidates every unoccupied buffer */
 int bclearcache()
 {
-	bwrite(&buffer);
-	buffer.header->block_no = 0;
-	buffer.header->status = BUFF_DEFAULT_STATUS;
-	memset(buffer.data->b, 0, MY_BLK_SIZE);
+	bcache_start();
+	bflush();
+	for (int i = 0; i < NUM_BUFFERS; i++)
+	{
+		buffer_header_t *header = buffer_header + i;
+		int status = __atomic_load_n(&header->status, __ATOMIC_SEQ_CST);
+		if ((status & (BUFF_OCCUPIED | BUFF_ONDIRTYLIST)) || !cas_status(header, &status, status | BUFF_OCCUPIED))
+			continue;
+		forget(header);
+	}
 	return 0;
-}
\ No newline at end of file
+}
+
+/* switches how blocks reach the cache: DISK_BACKEND_PREAD copies them into the cache's own buffers,
+ * DISK_BACKEND_MMAP maps the image and hands out buffers pointing into the mapping.
+ * fails if any buffer is occupied. */
+int bsetbackend(int backend)
+{
+	bcache_start();
+	for (int i = 0; i < NUM_BUFFERS; i++)
+	{
+		if (BUFF_IS_SET((buffer_t){.header = buffer_header + i}, BUFF_OCCUPIED))
+			return -1;
+	}
+	if (bflush() != 0)
+		return -1;
+	bclearcache();
+	return disk_set_backend(disk_fd, backend, super_block.num_blocks);
+}
+
+int bcachestats(buffer_cache_stats_t *stats)
+{
+	*stats = bcache_stats;
+	return 0;
+}
+
+/* writes back dirty buffers every BUFF_FLUSH_INTERVAL seconds, or when a writer finds too many dirty, while
+ * they are under pressure. delayed blocks are left to bflush, as allocation is not done off the calling thread.
+ * old journal transactions are committed and a filling journal is checkpointed here too. */
+static void *flusher_main(void *arg)
+{
+	(void)arg;
+	pthread_mutex_lock(&flusher_lock);
+	while (flusher_running)
+	{
+		struct timespec until;
+		clock_gettime(CLOCK_REALTIME, &until);
+		until.tv_sec += BUFF_FLUSH_INTERVAL;
+		pthread_cond_timedwait(&flusher_wake, &flusher_lock, &until);
+		if (!flusher_running)
+			break;
+		pthread_mutex_unlock(&flusher_lock);
+		if (dirty_pressure(1))
+		{
+			pthread_mutex_lock(&flush_lock);
+			flush_dirty(1);
+			pthread_mutex_unlock(&flush_lock);
+		}
+		jbackground();
+		pthread_mutex_lock(&flusher_lock);
+	}
+	pthread_mutex_unlock(&flusher_lock);
+	return NULL;
+}
+
+/* starts the background flusher. writers then no longer flush the cache themselves */
+int bstartflusher()
+{
+	bcache_start();
+	pthread_mutex_lock(&flusher_lock);
+	if (!flusher_running)
+	{
+		flusher_running = 1;
+		if (pthread_create(&flusher, NULL, flusher_main, NULL) != 0)
+			flusher_running = 0;
+	}
+	int ret = flusher_running ? 0 : -1;
+	pthread_mutex_unlock(&flusher_lock);
+	return ret;
+}
+
+int bstopflusher()
+{
+	pthread_mutex_lock(&flusher_lock);
+	if (!flusher_running)
+	{
+		pthread_mutex_unlock(&flusher_lock);
+		return 0;
+	}
+	flusher_running = 0;
+	pthread_cond_signal(&flusher_wake);
+	pthread_mutex_unlock(&flusher_lock);
+	pthread_join(flusher, NULL);
+	return 0;
+}
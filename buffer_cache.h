@@ -4,10 +4,53 @@
 #define BUFF_MODIFIED 0b1
 #define BUFF_VALIDDATA 0b100
 #define BUFF_OCCUPIED 0b10
+#define BUFF_ONDIRTYLIST 0b1000 /* buffer is on the dirty list */
+#define BUFF_ONFREELIST 0b10000 /* buffer is on the free list. it may be occupied, then the list drops it when reached */
+#define BUFF_REFERENCED 0b100000 /* buffer was used since the free list last reached it. it gets a second chance */
+#define BUFF_JOURNAL 0b1000000 /* modified metadata. its image is logged in the journal when the buffer is released */
 #define BUFF_DEFAULT_STATUS 0b0
 
+/* number of buffers in the cache. can be overridden at compile time. */
+#ifndef NUM_BUFFERS
+#define NUM_BUFFERS 64
+#endif
+/* number of hash queues. must be a power of 2. */
+#ifndef NUM_BUFF_HASH_QUEUES
+#define NUM_BUFF_HASH_QUEUES 64
+#endif
+/* most blocks gathered into one batch of reads by bprefetch */
+#define BUFF_MAX_RUN (NUM_BUFFERS / 4)
+/* writers flush the cache themselves once this percentage of buffers is dirty */
+#define BUFF_DIRTY_RATIO 50
+/* dirty buffers older than this many seconds are written back at the next opportunity */
+#define BUFF_DIRTY_EXPIRE 5
+#define BUFF_HASH(block_no) ((block_no) & (NUM_BUFF_HASH_QUEUES - 1))
+/* locks striped over the hash queues. must be a power of 2, not above NUM_BUFF_HASH_QUEUES. */
+#ifndef NUM_BUFF_LOCKS
+#define NUM_BUFF_LOCKS 16
+#endif
+#define BUFF_LOCK(block_no) (BUFF_HASH(block_no) & (NUM_BUFF_LOCKS - 1))
+/* seconds between wakeups of the background flusher */
+#define BUFF_FLUSH_INTERVAL 1
 
-#define BUFF_SET_FIELD(buffer,field) ((buffer).header->status |= (field))
-#define BUFF_REM_FIELD(buffer,field) ((buffer).header->status &= ~(field))
-#define BUFF_IS_SET(buffer,field) (((buffer).header->status & (field))==(field))
-#endif
\ No newline at end of file
+/* status is changed atomically. lookups without a lock read it while the owner of the buffer changes it */
+#define BUFF_SET_FIELD(buffer,field) (__atomic_fetch_or(&(buffer).header->status, (field), __ATOMIC_SEQ_CST))
+#define BUFF_REM_FIELD(buffer,field) (__atomic_fetch_and(&(buffer).header->status, ~(field), __ATOMIC_SEQ_CST))
+#define BUFF_IS_SET(buffer,field) ((__atomic_load_n(&(buffer).header->status, __ATOMIC_SEQ_CST) & (field))==(field))
+
+typedef struct
+{
+	u_int64_t hits;		  /* getblk found the block in the cache */
+	u_int64_t misses;	  /* getblk had to take a buffer from the free list */
+	u_int64_t evictions;  /* a buffer holding another block was reused */
+	u_int64_t writebacks; /* modified buffers written to disk */
+	u_int64_t prefetched; /* blocks read ahead by bprefetch */
+	u_int64_t flushes;	  /* write transfers issued for dirty buffers */
+} buffer_cache_stats_t;
+
+extern int bcachestats(buffer_cache_stats_t *);
+extern int bsetbackend(int); /* backends are listed in disk.h */
+extern int bflushdata();
+extern int bstartflusher();
+extern int bstopflusher();
+#endif
@@ -0,0 +1,222 @@
+#include "myfs.h"
+#include "inode.h"
+#include "buffer_cache.h"
+
+/* a logical block of a file that has data in the cache but no physical block yet.
+ * its buffer is named by a virtual block number (DALLOC_BASE and above) until writeback picks the physical block. */
+typedef struct
+{
+	inode_t *inode; /* NULL if entry is unused */
+	block_no_t logical;
+	block_no_t vblock;
+} delayed_block_t;
+
+delayed_block_t delayed[DALLOC_MAX];
+int num_delayed = 0;
+block_no_t next_vblock = DALLOC_BASE;
+int dalloc_busy = 0;
+/* guards the table. recursive: writeback started while a block is delayed maps the waiting blocks */
+pthread_mutex_t dalloc_lock;
+pthread_once_t dalloc_once = PTHREAD_ONCE_INIT;
+
+static void dalloc_init()
+{
+	pthread_mutexattr_t attr;
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(&dalloc_lock, &attr);
+	pthread_mutexattr_destroy(&attr);
+}
+
+static void dalloc_enter()
+{
+	pthread_once(&dalloc_once, dalloc_init);
+	pthread_mutex_lock(&dalloc_lock);
+}
+
+static int dalloc_run(inode_t *);
+
+/* gives a zero filled buffer for a new logical block of a file without choosing its physical block.
+ * a block is reserved against the free count, so writeback cannot run out of space for it. the inode is held exclusively.
+ * if the table stays full, the block is allocated right away instead */
+int dalloc_block(inode_t *inode, block_no_t logical_block_no, buffer_t *buffer)
+{
+	dalloc_enter();
+	if (num_delayed == DALLOC_MAX)
+		bflush(); /* writeback picks blocks for every delayed block */
+	if (num_delayed == DALLOC_MAX && inode->num_delayed > 0 && !dalloc_busy)
+	{
+		/* writeback skips the inodes other writers hold, this one too. the caller holds it, so it is mapped here */
+		dalloc_busy = 1;
+		dalloc_run(inode);
+		dalloc_busy = 0;
+	}
+	if (num_delayed == DALLOC_MAX)
+	{
+		/* every entry belongs to an inode another writer holds. this block gets its physical block now */
+		pthread_mutex_unlock(&dalloc_lock);
+		block_no_t block_no;
+		if (balloc_range(alloc_goal(inode, logical_block_no), 1, 1, &block_no) != 1)
+			return -1;
+		if (bnew(block_no, buffer) != 0)
+		{
+			bfree_range(block_no, 1);
+			return -1;
+		}
+		if (add_physical_block(inode, logical_block_no, block_no) != 0)
+		{
+			brelse(buffer);
+			bfree_range(block_no, 1);
+			return -1;
+		}
+		return 0;
+	}
+	if (breserve(1) != 0)
+	{
+		pthread_mutex_unlock(&dalloc_lock);
+		return -1;
+	}
+	int i = 0;
+	while (delayed[i].inode != NULL)
+		i++;
+	block_no_t vblock = next_vblock++;
+	if (next_vblock == 0)
+		next_vblock = DALLOC_BASE;
+	if (bnew(vblock, buffer) != 0)
+	{
+		bunreserve(1);
+		pthread_mutex_unlock(&dalloc_lock);
+		return -1;
+	}
+	delayed[i].logical = logical_block_no;
+	delayed[i].vblock = vblock;
+	/* published last: dalloc_fill looks at entries without the lock */
+	__atomic_store_n(&delayed[i].inode, inode, __ATOMIC_RELEASE);
+	__atomic_add_fetch(&num_delayed, 1, __ATOMIC_RELAXED);
+	inode->num_delayed++;
+	bmcache_update(inode, logical_block_no, vblock);
+	pthread_mutex_unlock(&dalloc_lock);
+	return 0;
+}
+
+/* puts the virtual block numbers of an inode's delayed blocks in [base, base + count) into map.
+ * the caller holds the inode, so its entries cannot change. other entries change meanwhile, so the inode is read atomically */
+void dalloc_fill(inode_t *inode, block_no_t base, block_no_t *map, u_int32_t count)
+{
+	if (inode->num_delayed == 0)
+		return;
+	for (int i = 0; i < DALLOC_MAX; i++)
+	{
+		if (__atomic_load_n(&delayed[i].inode, __ATOMIC_ACQUIRE) == inode && delayed[i].logical >= base && delayed[i].logical - base < count)
+			map[delayed[i].logical - base] = delayed[i].vblock;
+	}
+}
+
+static int cmp_logical(const void *a, const void *b)
+{
+	block_no_t x = delayed[*(int *)a].logical, y = delayed[*(int *)b].logical;
+	return (x > y) - (x < y);
+}
+
+/* picks physical blocks for the delayed blocks of an inode, in logical order and as one run if free space allows */
+static int dalloc_run(inode_t *inode)
+{
+	int entries[DALLOC_MAX], n = 0, ret = 0;
+	for (int i = 0; i < DALLOC_MAX; i++)
+	{
+		if (delayed[i].inode == inode)
+			entries[n++] = i;
+	}
+	qsort(entries, n, sizeof(int), cmp_logical);
+	for (int k = 0; k < n;)
+	{
+		block_no_t first;
+		/* the reservation turns into an allocation. no other allocation can take the blocks meanwhile */
+		int got = balloc_reserved(alloc_goal(inode, delayed[entries[k]].logical), 1, n - k, &first);
+		if (got <= 0)
+			return -1;
+		for (int j = 0; j < got; j++, k++)
+		{
+			delayed_block_t *d = delayed + entries[k];
+			if (brename(d->vblock, first + j) != 0)
+			{
+				/* buffer is in use. it stays delayed */
+				bfree_range(first + j, 1);
+				breserve(1);
+				ret = -1;
+				continue;
+			}
+			add_physical_block(inode, d->logical, first + j);
+			__atomic_store_n(&d->inode, NULL, __ATOMIC_RELEASE);
+			__atomic_sub_fetch(&num_delayed, 1, __ATOMIC_RELAXED);
+			inode->num_delayed--;
+		}
+	}
+	return ret;
+}
+
+/* picks physical blocks for the delayed blocks of one inode. needed before its blocks are accessed without the cache
+ * or the inode leaves the inode table. the inode is held exclusively, or is not referenced at all. */
+int dalloc_inode(inode_t *inode)
+{
+	if (inode->num_delayed == 0)
+		return 0;
+	dalloc_enter();
+	int ret = 0;
+	if (!dalloc_busy)
+	{
+		dalloc_busy = 1;
+		ret = dalloc_run(inode);
+		dalloc_busy = 0;
+	}
+	pthread_mutex_unlock(&dalloc_lock);
+	return ret;
+}
+
+/* picks physical blocks for every delayed block. bflush calls it before writing back, so the blocks can be written.
+ * allocation may flush the cache itself. that nested flush writes only blocks that have their physical block.
+ * it never waits: if another thread is mapping blocks, or uses an inode right now, those blocks wait for a later flush. */
+int dalloc_flush()
+{
+	if (__atomic_load_n(&num_delayed, __ATOMIC_RELAXED) == 0)
+		return 0;
+	pthread_once(&dalloc_once, dalloc_init);
+	if (pthread_mutex_trylock(&dalloc_lock) != 0)
+		return 0;
+	int ret = 0;
+	if (!dalloc_busy)
+	{
+		dalloc_busy = 1;
+		for (int i = 0; i < DALLOC_MAX; i++)
+		{
+			inode_t *inode = delayed[i].inode;
+			if (inode == NULL || itrylock(inode, 0) != 0)
+				continue;
+			if (dalloc_run(inode) != 0)
+				ret = -1;
+			iunlock(inode);
+		}
+		dalloc_busy = 0;
+	}
+	pthread_mutex_unlock(&dalloc_lock);
+	return ret;
+}
+
+/* drops the delayed blocks of an inode whose blocks are being freed. their data is never written and no block is allocated */
+void dalloc_discard(inode_t *inode)
+{
+	if (inode->num_delayed == 0)
+		return;
+	dalloc_enter();
+	for (int i = 0; i < DALLOC_MAX && inode->num_delayed > 0; i++)
+	{
+		if (delayed[i].inode != inode)
+			continue;
+		binvalidate(delayed[i].vblock, 1);
+		bunreserve(1);
+		__atomic_store_n(&delayed[i].inode, NULL, __ATOMIC_RELEASE);
+		__atomic_sub_fetch(&num_delayed, 1, __ATOMIC_RELAXED);
+		inode->num_delayed--;
+	}
+	pthread_mutex_unlock(&dalloc_lock);
+}
@@ -0,0 +1,174 @@
+#include "myfs.h"
+#include "dir.h"
+
+/* the result of looking a name up in a directory. a negative entry (dir_entry.inode_no 0) tells the name is not there */
+typedef struct dentry
+{
+	inode_no_t parent;	 /* inode of the directory. 0 if entry is unused */
+	dir_entry_t dir_entry; /* name is the key */
+	offset_t found_at;	 /* offset of the entry in the directory. -1 for a negative entry */
+	struct dentry *hash_next;
+	struct dentry *lru_next, *lru_prev;
+} dentry_t;
+
+dentry_t dentry[DCACHE_SIZE];
+dentry_t *dcache_hash[DCACHE_HASH_QUEUES];
+/* lru list of all entries. least recently used (or unused) at head */
+dentry_t dcache_lru = {.lru_next = &dcache_lru, .lru_prev = &dcache_lru};
+int dcache_ready = 0;
+dcache_stats_t dcache_stats;
+pthread_mutex_t dcache_lock = PTHREAD_MUTEX_INITIALIZER; /* guards every entry, the lru list and the stats */
+
+static void lru_remove(dentry_t *d)
+{
+	d->lru_prev->lru_next = d->lru_next;
+	d->lru_next->lru_prev = d->lru_prev;
+}
+
+static void lru_insert(dentry_t *d, int at_tail)
+{
+	if (at_tail)
+	{
+		d->lru_prev = dcache_lru.lru_prev;
+		d->lru_next = &dcache_lru;
+	}
+	else
+	{
+		d->lru_prev = &dcache_lru;
+		d->lru_next = dcache_lru.lru_next;
+	}
+	d->lru_prev->lru_next = d;
+	d->lru_next->lru_prev = d;
+}
+
+static void dcache_init()
+{
+	for (int i = 0; i < DCACHE_SIZE; i++)
+	{
+		dentry[i].parent = 0;
+		lru_insert(dentry + i, 1);
+	}
+	dcache_ready = 1;
+}
+
+static dentry_t **dentry_queue(inode_no_t parent, const char *name)
+{
+	u_int32_t hash = parent * 2654435761u;
+	for (int i = 0; i < DIR_NAME_LEN; i++)
+		hash = (hash ^ (byte_t)name[i]) * 16777619u;
+	return dcache_hash + (hash & (DCACHE_HASH_QUEUES - 1));
+}
+
+static dentry_t *dentry_find(inode_no_t parent, const char *name)
+{
+	dentry_t *d = *dentry_queue(parent, name);
+	while (d != NULL && (d->parent != parent || memcmp(d->dir_entry.name, name, DIR_NAME_LEN) != 0))
+		d = d->hash_next;
+	return d;
+}
+
+/* takes an entry off its hash queue and puts it at the head of the lru list */
+static void dentry_drop(dentry_t *d)
+{
+	dentry_t **link = dentry_queue(d->parent, d->dir_entry.name);
+	while (*link != d)
+		link = &((*link)->hash_next);
+	*link = d->hash_next;
+	d->parent = 0;
+	d->hash_next = NULL;
+	lru_remove(d);
+	lru_insert(d, 0);
+	dcache_stats.invalidations++;
+}
+
+/* gives the cached result of looking name up in directory parent. returns -1 if there is none */
+int dcache_lookup(inode_no_t parent, const char *name, dir_entry_t *dir_entry, offset_t *found_at)
+{
+	pthread_mutex_lock(&dcache_lock);
+	dentry_t *d = dcache_ready ? dentry_find(parent, name) : NULL;
+	if (d == NULL)
+	{
+		dcache_stats.misses++;
+		pthread_mutex_unlock(&dcache_lock);
+		return -1;
+	}
+	if (d->dir_entry.inode_no == 0)
+		dcache_stats.negative_hits++;
+	else
+		dcache_stats.hits++;
+	lru_remove(d);
+	lru_insert(d, 1);
+	*dir_entry = d->dir_entry;
+	*found_at = d->found_at;
+	pthread_mutex_unlock(&dcache_lock);
+	return 0;
+}
+
+/* remembers the result of a lookup. a dir_entry with inode_no 0 makes a negative entry */
+void dcache_insert(inode_no_t parent, const char *name, const dir_entry_t *dir_entry, offset_t found_at)
+{
+	pthread_mutex_lock(&dcache_lock);
+	if (!dcache_ready)
+		dcache_init();
+	dentry_t *d = dentry_find(parent, name);
+	if (d == NULL)
+	{
+		/* reuse the least recently used entry */
+		d = dcache_lru.lru_next;
+		if (d->parent != 0)
+			dentry_drop(d);
+		d->parent = parent;
+		memcpy(d->dir_entry.name, name, DIR_NAME_LEN);
+		dentry_t **queue = dentry_queue(parent, name);
+		d->hash_next = *queue;
+		*queue = d;
+	}
+	d->dir_entry.inode_no = dir_entry->inode_no;
+	d->dir_entry.type = dir_entry->type;
+	d->found_at = dir_entry->inode_no == 0 ? -1 : found_at;
+	lru_remove(d);
+	lru_insert(d, 1);
+	pthread_mutex_unlock(&dcache_lock);
+}
+
+/* a name was added to or removed from a directory */
+void dcache_invalidate(inode_no_t parent, const char *name)
+{
+	pthread_mutex_lock(&dcache_lock);
+	dentry_t *d = dcache_ready ? dentry_find(parent, name) : NULL;
+	if (d != NULL)
+		dentry_drop(d);
+	pthread_mutex_unlock(&dcache_lock);
+}
+
+/* forgets every entry of a directory. used when it is removed or its entries move */
+void dcache_purge(inode_no_t parent)
+{
+	pthread_mutex_lock(&dcache_lock);
+	for (int i = 0; dcache_ready && i < DCACHE_SIZE; i++)
+	{
+		if (dentry[i].parent == parent)
+			dentry_drop(dentry + i);
+	}
+	pthread_mutex_unlock(&dcache_lock);
+}
+
+/* forgets every entry. used when the volume is unmounted */
+void dcache_clear()
+{
+	pthread_mutex_lock(&dcache_lock);
+	for (int i = 0; dcache_ready && i < DCACHE_SIZE; i++)
+	{
+		if (dentry[i].parent != 0)
+			dentry_drop(dentry + i);
+	}
+	pthread_mutex_unlock(&dcache_lock);
+}
+
+int dcachestats(dcache_stats_t *stats)
+{
+	pthread_mutex_lock(&dcache_lock);
+	*stats = dcache_stats;
+	pthread_mutex_unlock(&dcache_lock);
+	return 0;
+}
@@ -1,7 +1,95 @@
 #include "dir.h"
 #include "inode.h"
 #include "buffer_cache.h"
+#include "journal.h"
 #ifdef DIR_FIXED_ENTRY_SIZE_TYPE
+/* fnv-1a hash of the stored bytes of a name */
+static u_int32_t name_hash(const char *name)
+{
+	u_int32_t hash = 2166136261u;
+	for (int i = 0; i < DIR_NAME_LEN; i++)
+		hash = (hash ^ (byte_t)name[i]) * 16777619u;
+	return hash;
+}
+
+static int cmp_hash(const void *a, const void *b)
+{
+	u_int32_t x = name_hash(((dir_entry_t *)a)->name), y = name_hash(((dir_entry_t *)b)->name);
+	return (x > y) - (x < y);
+}
+
+/* looks for name among the first count entries of a directory block. returns its slot or -1.
+ * if free_slot is not NULL, the first unused slot is put in it, -1 if there is none. see dirscan.c */
+static int block_scan(buffer_t *buffer, int count, const char *name, int *free_slot)
+{
+	return dir_block_scan(buffer->data->b, count, name, free_slot);
+}
+
+/* gives the buffer of a logical block of a directory. a block that is not mapped yet is allocated, zero filled */
+static int dir_getblock(inode_t *dir, block_no_t logical, buffer_t *buffer)
+{
+	block_no_t physical;
+	u_int32_t run;
+	if (bmap_run(dir, logical, &physical, &run) != 0)
+		return -1;
+	if (physical != 0)
+		return bread(physical, buffer);
+	if (balloc_near(alloc_goal(dir, logical), buffer) != 0)
+		return -1;
+	dir->disk_inode.size_on_disk += MY_BLK_SIZE;
+	INO_SET_FIELD(dir, INODE_MODIFIED);
+	add_physical_block(dir, logical, buffer->header->block_no);
+	return 0;
+}
+
+/* index entry whose leaf holds the names with the given hash: the last one with hash not above it */
+static int htree_search(buffer_t *root, u_int32_t hash)
+{
+	htree_entry_t *entries = HTREE_ENTRIES(root);
+	int lo = 0, hi = HTREE_HEADER(root)->count - 1;
+	while (lo < hi)
+	{
+		int mid = (lo + hi + 1) / 2;
+		if (entries[mid].hash <= hash)
+			lo = mid;
+		else
+			hi = mid - 1;
+	}
+	return lo;
+}
+
+/* root and one leaf are read */
+static dir_entry_t htree_lookup(inode_t *dir, const char *name, offset_t *found_at)
+{
+	dir_entry_t dir_entry;
+	dir_entry.inode_no = 0;
+	buffer_t root, leaf;
+	if (dir_getblock(dir, 0, &root) != 0)
+		return dir_entry;
+	block_no_t logical = 0;
+	int slot = block_scan(&root, 1, name, NULL); /* ".." */
+	if (slot < 0)
+	{
+		logical = HTREE_ENTRIES(&root)[htree_search(&root, name_hash(name))].block;
+		brelse(&root);
+		if (dir_getblock(dir, logical, &leaf) != 0)
+			return dir_entry;
+		slot = block_scan(&leaf, DIR_ENTRIES_PER_BLOCK, name, NULL);
+	}
+	else
+		leaf = root;
+	if (slot >= 0)
+	{
+		memcpy(&dir_entry, leaf.data->b + slot * DIR_ENTRY_SIZE, DIR_ENTRY_SIZE);
+		*found_at = (offset_t)logical * MY_BLK_SIZE + slot * DIR_ENTRY_SIZE;
+	}
+	brelse(&leaf);
+	return dir_entry;
+}
+
+static dir_entry_t dir_scan(inode_t *, const char *, offset_t *);
+
+/* results are kept in the name lookup cache, found or not */
 dir_entry_t dir_lookup(inode_t *inode, const char *name, offset_t *found_at)
 {
 	dir_entry_t dir_entry;
@@ -12,83 +100,298 @@ dir_entry_t dir_lookup(inode_t *inode, const char *name, offset_t *found_at)
 		perror("dir_lookup: trying to look up in a non directory\n");
 		return dir_entry;
 	}
-	char formatted_name[MAX_FILE_NAME_SIZE];
+	char formatted_name[DIR_NAME_LEN];
 	{
-		memset(formatted_name, 0, MAX_FILE_NAME_SIZE);
+		memset(formatted_name, 0, DIR_NAME_LEN);
 		int l = strlen(name);
-		if (l > MAX_FILE_NAME_SIZE)
+		if (l > DIR_NAME_LEN) /* longer than any stored name */
 			return dir_entry;
 		memcpy(formatted_name, name, l);
 		name = formatted_name;
 	}
-	u_int32_t num_entries = ((u_int32_t)inode->disk_inode.size) / DIR_ENTRY_SIZE, entries_seen = 0;
-	if (num_entries == 0)
-		return dir_entry;
-	offset_t off = 0, byte_off;
+	/* entries cannot change while the directory is held, so the cached result stays right */
+	ilock_shared(inode);
+	if (dcache_lookup(inode->inode_no, name, &dir_entry, found_at) != 0)
+	{
+		dir_entry = dir_scan(inode, name, found_at);
+		dcache_insert(inode->inode_no, name, &dir_entry, *found_at);
+	}
+	iunlock(inode);
+	return dir_entry;
+}
+
+/* searches the directory's blocks for a name */
+static dir_entry_t dir_scan(inode_t *inode, const char *name, offset_t *found_at)
+{
+	dir_entry_t dir_entry;
+	dir_entry.inode_no = 0;
+	if (INO_USES_HTREE(inode))
+		return htree_lookup(inode, name, found_at);
+	u_int32_t num_entries = ((u_int32_t)inode->disk_inode.size) / DIR_ENTRY_SIZE;
 	buffer_t buffer;
-	size_t t;
 	block_no_t block_no;
-	inode_no_t inode_no = 0;
-	while (entries_seen < num_entries)
+	u_int32_t run;
+	for (block_no_t logical = 0; logical * DIR_ENTRIES_PER_BLOCK < num_entries; logical++)
 	{
-		bmap(inode, off, &block_no, &byte_off, &t);
+		int count = num_entries - logical * DIR_ENTRIES_PER_BLOCK;
+		if (count > DIR_ENTRIES_PER_BLOCK)
+			count = DIR_ENTRIES_PER_BLOCK;
+		bmap_run(inode, logical, &block_no, &run);
+		if (block_no == 0)
+			continue;
 		bread(block_no, &buffer);
-		while (t > DIR_ENTRY_SIZE)
+		int slot = block_scan(&buffer, count, name, NULL);
+		if (slot >= 0)
+		{
+			memcpy(&dir_entry, buffer.data->b + slot * DIR_ENTRY_SIZE, DIR_ENTRY_SIZE);
+			brelse(&buffer);
+			*found_at = (offset_t)logical * MY_BLK_SIZE + slot * DIR_ENTRY_SIZE;
+			return dir_entry;
+		}
+		brelse(&buffer);
+	}
+	return dir_entry;
+}
+
+/* converts a linear directory to a hash indexed one. entries are sorted by hash and spread over leaves
+ * filled to half, so the next insertions do not split them. */
+static int htree_convert(inode_t *dir)
+{
+	u_int32_t num_entries = ((u_int32_t)dir->disk_inode.size) / DIR_ENTRY_SIZE, n = 0;
+	dir_entry_t *entries = malloc((num_entries + 1) * DIR_ENTRY_SIZE), dotdot;
+	if (entries == NULL)
+		return -1;
+	char dotdot_name[DIR_NAME_LEN] = "..";
+	memset(&dotdot, 0, DIR_ENTRY_SIZE);
+	buffer_t buffer;
+	block_no_t block_no;
+	u_int32_t run;
+	for (u_int32_t i = 0; i < num_entries; i++)
+	{
+		if (i % DIR_ENTRIES_PER_BLOCK == 0)
 		{
-			memcpy(&dir_entry, buffer.data->b + byte_off, DIR_ENTRY_SIZE);
-			entries_seen++;
-			t -= DIR_ENTRY_SIZE;
-			byte_off += DIR_ENTRY_SIZE;
-			if (dir_entry.inode_no != 0 && memcmp(dir_entry.name, name, MAX_FILE_NAME_SIZE) == 0)
+			bmap_run(dir, i / DIR_ENTRIES_PER_BLOCK, &block_no, &run);
+			if (block_no == 0)
 			{
-				brelse(&buffer);
-				*found_at = (entries_seen - 1) * DIR_ENTRY_SIZE;
-				return dir_entry;
+				i += DIR_ENTRIES_PER_BLOCK - 1;
+				continue;
 			}
+			bread(block_no, &buffer);
 		}
+		memcpy(entries + n, buffer.data->b + i % DIR_ENTRIES_PER_BLOCK * DIR_ENTRY_SIZE, DIR_ENTRY_SIZE);
+		if (entries[n].inode_no != 0)
+		{
+			if (memcmp(entries[n].name, dotdot_name, DIR_NAME_LEN) == 0)
+				dotdot = entries[n];
+			else
+				n++;
+		}
+		if (i % DIR_ENTRIES_PER_BLOCK == DIR_ENTRIES_PER_BLOCK - 1 || i == num_entries - 1)
+			brelse(&buffer);
+	}
+	qsort(entries, n, DIR_ENTRY_SIZE, cmp_hash);
+	u_int32_t leaves = (n + DIR_ENTRIES_PER_BLOCK / 2 - 1) / (DIR_ENTRIES_PER_BLOCK / 2);
+	if (leaves == 0)
+		leaves = 1;
+	if (leaves > HTREE_MAX_ENTRIES)
+	{
+		free(entries);
+		return -1;
+	}
+	htree_entry_t index[HTREE_MAX_ENTRIES];
+	u_int32_t count = 0;
+	for (u_int32_t l = 0, start = 0; l < leaves && (start < n || l == 0); l++)
+	{
+		/* names with equal hashes stay in one leaf */
+		u_int32_t end = (l + 1) * n / leaves;
+		if (end < start)
+			end = start;
+		while (end < n && end > 0 && name_hash(entries[end].name) == name_hash(entries[end - 1].name))
+			end++;
+		if (end - start > DIR_ENTRIES_PER_BLOCK || dir_getblock(dir, count + 1, &buffer) != 0)
+		{
+			free(entries);
+			return -1;
+		}
+		memset(buffer.data->b, 0, MY_BLK_SIZE);
+		memcpy(buffer.data->b, entries + start, (end - start) * DIR_ENTRY_SIZE);
+		BUFF_SET_FIELD(buffer, BUFF_MODIFIED | BUFF_JOURNAL);
 		brelse(&buffer);
-		off += MY_BLK_SIZE;
+		index[count].hash = count == 0 ? 0 : name_hash(entries[start].name);
+		index[count].block = count + 1;
+		index[count].free = DIR_ENTRIES_PER_BLOCK - (end - start);
+		count++;
+		start = end;
 	}
-	dir_entry.inode_no = 0;
-	return dir_entry;
+	free(entries);
+	if (dir_getblock(dir, 0, &buffer) != 0)
+		return -1;
+	memset(buffer.data->b, 0, MY_BLK_SIZE);
+	memcpy(buffer.data->b, &dotdot, DIR_ENTRY_SIZE);
+	HTREE_HEADER(&buffer)->count = count;
+	HTREE_HEADER(&buffer)->limit = HTREE_MAX_ENTRIES;
+	memcpy(HTREE_ENTRIES(&buffer), index, count * sizeof(htree_entry_t));
+	BUFF_SET_FIELD(buffer, BUFF_MODIFIED | BUFF_JOURNAL);
+	brelse(&buffer);
+	dcache_purge(dir->inode_no); /* entries have moved */
+	dir->disk_inode.flags |= INODE_FL_HTREE;
+	dir->disk_inode.size = (offset_t)(count + 1) * MY_BLK_SIZE;
+	INO_SET_FIELD(dir, INODE_MODIFIED);
+	return 0;
 }
-int add_dir_entry(inode_t *dir, dir_entry_t new_entry)
+
+/* splits the full leaf of index entry i in two by hash. the upper half goes to a new leaf after the last block.
+ * *leaf becomes the half the given hash belongs to. returns the index entry of that half, or -1. */
+static int htree_split(inode_t *dir, buffer_t *root, int i, buffer_t *leaf, u_int32_t hash)
+{
+	htree_header_t *header = HTREE_HEADER(root);
+	htree_entry_t *index = HTREE_ENTRIES(root);
+	block_no_t logical = dir->disk_inode.size / MY_BLK_SIZE;
+	if (header->count >= header->limit || logical > UINT16_MAX || dir->disk_inode.size + MY_BLK_SIZE > INODE_MAX_SIZE(dir))
+		return -1;
+	dir_entry_t entries[DIR_ENTRIES_PER_BLOCK];
+	memcpy(entries, leaf->data->b, MY_BLK_SIZE);
+	qsort(entries, DIR_ENTRIES_PER_BLOCK, DIR_ENTRY_SIZE, cmp_hash);
+	/* names with equal hashes stay in one leaf */
+	int mid = DIR_ENTRIES_PER_BLOCK / 2;
+	while (mid < DIR_ENTRIES_PER_BLOCK && name_hash(entries[mid].name) == name_hash(entries[mid - 1].name))
+		mid++;
+	if (mid == DIR_ENTRIES_PER_BLOCK)
+	{
+		mid = DIR_ENTRIES_PER_BLOCK / 2;
+		while (mid > 0 && name_hash(entries[mid].name) == name_hash(entries[mid - 1].name))
+			mid--;
+	}
+	if (mid == 0)
+		return -1; /* every name in the leaf has the same hash */
+	buffer_t new_leaf;
+	if (dir_getblock(dir, logical, &new_leaf) != 0)
+		return -1;
+	memset(new_leaf.data->b, 0, MY_BLK_SIZE);
+	memcpy(new_leaf.data->b, entries + mid, (DIR_ENTRIES_PER_BLOCK - mid) * DIR_ENTRY_SIZE);
+	BUFF_SET_FIELD(new_leaf, BUFF_MODIFIED | BUFF_JOURNAL);
+	memset(leaf->data->b, 0, MY_BLK_SIZE);
+	memcpy(leaf->data->b, entries, mid * DIR_ENTRY_SIZE);
+	BUFF_SET_FIELD(*leaf, BUFF_MODIFIED | BUFF_JOURNAL);
+	memmove(index + i + 2, index + i + 1, (header->count - i - 1) * sizeof(htree_entry_t));
+	index[i + 1].hash = name_hash(entries[mid].name);
+	index[i + 1].block = logical;
+	index[i + 1].free = mid;
+	index[i].free = DIR_ENTRIES_PER_BLOCK - mid;
+	header->count++;
+	BUFF_SET_FIELD(*root, BUFF_MODIFIED | BUFF_JOURNAL);
+	dcache_purge(dir->inode_no); /* entries have moved */
+	dir->disk_inode.size += MY_BLK_SIZE;
+	INO_SET_FIELD(dir, INODE_MODIFIED);
+	if (hash < index[i + 1].hash)
+	{
+		brelse(&new_leaf);
+		return i;
+	}
+	brelse(leaf);
+	*leaf = new_leaf;
+	return i + 1;
+}
+
+/* tells if the name lookup cache knows the name is not in the directory. the directory is held, so that stays true */
+static int dir_absent(inode_t *dir, const char *name)
+{
+	dir_entry_t dir_entry;
+	offset_t found_at;
+	return dcache_lookup(dir->inode_no, name, &dir_entry, &found_at) == 0 && dir_entry.inode_no == 0;
+}
+
+/* only the leaf the name hashes to is searched for a duplicate and a free slot. a leaf the index counts as full is
+ * split without looking for a free slot, and a name known to be missing is not looked for at all */
+static int htree_add(inode_t *dir, dir_entry_t *new_entry)
+{
+	u_int32_t hash = name_hash(new_entry->name);
+	buffer_t root, leaf;
+	if (dir_getblock(dir, 0, &root) != 0)
+		return -1;
+	int i = htree_search(&root, hash), slot = -1, absent = dir_absent(dir, new_entry->name);
+	if ((!absent && block_scan(&root, 1, new_entry->name, NULL) >= 0) || dir_getblock(dir, HTREE_ENTRIES(&root)[i].block, &leaf) != 0)
+	{
+		brelse(&root);
+		return -1;
+	}
+	if ((!absent || HTREE_ENTRIES(&root)[i].free > 0) && block_scan(&leaf, DIR_ENTRIES_PER_BLOCK, new_entry->name, &slot) >= 0)
+	{
+		/* no duplicate records allowed*/
+		brelse(&leaf);
+		brelse(&root);
+		return -1;
+	}
+	if (slot < 0)
+	{
+		if ((i = htree_split(dir, &root, i, &leaf, hash)) < 0)
+		{
+			brelse(&leaf);
+			brelse(&root);
+			return -1;
+		}
+		block_scan(&leaf, DIR_ENTRIES_PER_BLOCK, new_entry->name, &slot);
+	}
+	memcpy(leaf.data->b + slot * DIR_ENTRY_SIZE, new_entry, DIR_ENTRY_SIZE);
+	BUFF_SET_FIELD(leaf, BUFF_MODIFIED | BUFF_JOURNAL);
+	brelse(&leaf);
+	HTREE_ENTRIES(&root)[i].free--;
+	BUFF_SET_FIELD(root, BUFF_MODIFIED | BUFF_JOURNAL);
+	brelse(&root);
+	return 0;
+}
+
+static int dir_add(inode_t *dir, dir_entry_t new_entry)
 {
 	if (dir->disk_inode.type != FT_DIR)
 	{
 		return -1;
 	}
-	u_int32_t num_entries = ((u_int32_t)dir->disk_inode.size) / DIR_ENTRY_SIZE, entries_seen = 0;
-	offset_t off = 0, byte_off;
+	if (INO_USES_HTREE(dir))
+	{
+		if (htree_add(dir, &new_entry) != 0)
+			return -1;
+		dcache_invalidate(dir->inode_no, new_entry.name);
+		dir->disk_inode.links++;
+		INO_SET_FIELD(dir, INODE_MODIFIED);
+		return 0;
+	}
+	u_int32_t num_entries = ((u_int32_t)dir->disk_inode.size) / DIR_ENTRY_SIZE;
 	buffer_t buffer;
-	size_t t;
 	block_no_t block_no;
+	u_int32_t run;
 	offset_t loc = -1;
-	while (entries_seen < num_entries)
+	/* a name known to be missing needs no search for duplicates. then blocks are looked at from the free slot hint
+	 * up to the first free slot */
+	int absent = dir_absent(dir, new_entry.name);
+	for (block_no_t logical = absent ? dir->dir_free / MY_BLK_SIZE : 0; logical * DIR_ENTRIES_PER_BLOCK < num_entries && (!absent || loc == -1); logical++)
 	{
 		/* see all entries */
-		bmap(dir, off, &block_no, &byte_off, &t);
+		int count = num_entries - logical * DIR_ENTRIES_PER_BLOCK, slot;
+		if (count > DIR_ENTRIES_PER_BLOCK)
+			count = DIR_ENTRIES_PER_BLOCK;
+		bmap_run(dir, logical, &block_no, &run);
+		if (block_no == 0)
+			continue;
 		bread(block_no, &buffer);
-		while (t != 0)
+		if (block_scan(&buffer, count, new_entry.name, &slot) >= 0) /* look for duplicates */
 		{
-			dir_entry_t dir_entry;
-			memcpy(&dir_entry, buffer.data->b + byte_off, DIR_ENTRY_SIZE);
-			if (loc == -1 && dir_entry.inode_no == 0)
-			{ /* look for empty entry */
-				loc = off + byte_off;
-			}
-			entries_seen++;
-			t -= DIR_ENTRY_SIZE;
-			byte_off += DIR_ENTRY_SIZE;
-			if (dir_entry.inode_no != 0 && memcmp(dir_entry.name, new_entry.name, MAX_FILE_NAME_SIZE) == 0) /* look for duplicates */
-			{
-				/* no duplicate records allowed*/
-				brelse(&buffer);
-				return -1;
-			}
+			/* no duplicate records allowed*/
+			brelse(&buffer);
+			return -1;
 		}
 		brelse(&buffer);
-		off += MY_BLK_SIZE;
+		if (loc == -1 && slot != -1)
+		{ /* look for empty entry */
+			loc = (offset_t)logical * MY_BLK_SIZE + slot * DIR_ENTRY_SIZE;
+		}
+	}
+	if (loc == -1 && DIR_HTREE_THRESHOLD > 0 && dir->disk_inode.size >= (offset_t)DIR_HTREE_THRESHOLD * MY_BLK_SIZE)
+	{
+		/* directory has grown past linear scans */
+		if (htree_convert(dir) != 0)
+			return -1;
+		return dir_add(dir, new_entry);
 	}
 	if (loc == -1 && num_entries >= MAX_FILE_SIZE / DIR_ENTRY_SIZE) /* no space for new record */
 	{
@@ -100,29 +403,19 @@ int add_dir_entry(inode_t *dir, dir_entry_t new_entry)
 		dir->disk_inode.size += DIR_ENTRY_SIZE;
 		INO_SET_FIELD(dir, INODE_MODIFIED);
 	}
-	bmap(dir, loc, &block_no, &byte_off, &t);
-	if (block_no == 0)
-	{
-		balloc(&buffer);
-	}
-	else
-		bread(block_no, &buffer);
-	memcpy(buffer.data->b + byte_off, &new_entry, DIR_ENTRY_SIZE);
-	BUFF_SET_FIELD(buffer, BUFF_MODIFIED);
-	block_no_t physical_block_no = buffer.header->block_no;
+	if (dir_getblock(dir, loc / MY_BLK_SIZE, &buffer) != 0)
+		return -1;
+	dir->dir_free = loc + DIR_ENTRY_SIZE; /* loc was the first free slot */
+	memcpy(buffer.data->b + loc % MY_BLK_SIZE, &new_entry, DIR_ENTRY_SIZE);
+	BUFF_SET_FIELD(buffer, BUFF_MODIFIED | BUFF_JOURNAL);
 	brelse(&buffer);
+	dcache_invalidate(dir->inode_no, new_entry.name);
 	dir->disk_inode.links++;
 	INO_SET_FIELD(dir, INODE_MODIFIED);
-	if (block_no == 0) /* if data was written on a new block */
-	{
-		dir->disk_inode.size_on_disk += MY_BLK_SIZE;
-		INO_SET_FIELD(dir, INODE_MODIFIED);
-		add_physical_block(dir, loc / MY_BLK_SIZE, physical_block_no);
-	}
 	return 0;
 }
 
-int rem_dir_entry(inode_t *dir, offset_t loc)
+static int dir_rem(inode_t *dir, offset_t loc)
 {
 	block_no_t block_no;
 	offset_t byte_offset;
@@ -132,32 +425,68 @@ int rem_dir_entry(inode_t *dir, offset_t loc)
 		return -1;
 	buffer_t buffer;
 	bread(block_no, &buffer);
+	dcache_invalidate(dir->inode_no, ((dir_entry_t *)(buffer.data->b + byte_offset))->name);
 	memset(buffer.data->b + byte_offset, 0, DIR_ENTRY_SIZE);
+	BUFF_SET_FIELD(buffer, BUFF_MODIFIED | BUFF_JOURNAL);
+	brelse(&buffer);
+	if (INO_USES_HTREE(dir) && loc >= MY_BLK_SIZE && dir_getblock(dir, 0, &buffer) == 0)
+	{
+		/* one more free slot in the leaf */
+		htree_entry_t *index = HTREE_ENTRIES(&buffer);
+		for (int i = 0; i < HTREE_HEADER(&buffer)->count; i++)
+		{
+			if (index[i].block == loc / MY_BLK_SIZE)
+			{
+				index[i].free++;
+				BUFF_SET_FIELD(buffer, BUFF_MODIFIED | BUFF_JOURNAL);
+				break;
+			}
+		}
+		brelse(&buffer);
+	}
+	else if (loc < dir->dir_free)
+		dir->dir_free = loc;
 	dir->disk_inode.links--;
 	INO_SET_FIELD(dir, INODE_MODIFIED);
-	brelse(&buffer);
 	return 0;
 }
 
-int mymkdir(const char *parent_dir, const char *dir_name)
+/* the directory is held exclusively while its entries change */
+int add_dir_entry(inode_t *dir, dir_entry_t new_entry)
+{
+	ilock(dir);
+	int ret = dir_add(dir, new_entry);
+	iunlock(dir);
+	return ret;
+}
+
+int rem_dir_entry(inode_t *dir, offset_t loc)
+{
+	ilock(dir);
+	int ret = dir_rem(dir, loc);
+	iunlock(dir);
+	return ret;
+}
+
+static int dir_mkdir(const char *parent_dir, const char *dir_name)
 {
 	inode_t *par_dir_inode, *dir_inode;
-	if (namei(parent_dir, &parent_dir) != 0)
+	if (namei(parent_dir, &par_dir_inode) != 0)
 	{
 		return -1;
 	}
 	dir_entry_t new_entry;
 	{
 		int l = strlen(dir_name);
-		if (l > MAX_FILE_NAME_SIZE)
+		if (l > DIR_NAME_LEN)
 		{
 			iput(par_dir_inode);
 			return -1;
 		}
-		memset(new_entry.name, 0, MAX_FILE_NAME_SIZE);
+		memset(new_entry.name, 0, DIR_NAME_LEN);
 		memcpy(new_entry.name, dir_name, l);
 	}
-	if (ialloc(&dir_inode) != 0)
+	if (ialloc_near(igroup_pick(), &dir_inode) != 0)
 	{
 		iput(par_dir_inode);
 		return -1;
@@ -165,9 +494,10 @@ int mymkdir(const char *parent_dir, const char *dir_name)
 	new_entry.type = dir_inode->disk_inode.type = FT_DIR;
 	INO_SET_FIELD(dir_inode, INODE_MODIFIED);
 	new_entry.inode_no = dir_inode->inode_no;
+	dir_inode->dir_free = 0; /* the inode may have held another directory while cached */
 	dir_entry_t parent_dir_entry;
 	{
-		memset(parent_dir_entry.name, 0, MAX_FILE_NAME_SIZE);
+		memset(parent_dir_entry.name, 0, DIR_NAME_LEN);
 		parent_dir_entry.name[0] = parent_dir_entry.name[1] = '.';
 	}
 	parent_dir_entry.inode_no = par_dir_inode->inode_no;
@@ -176,12 +506,20 @@ int mymkdir(const char *parent_dir, const char *dir_name)
 	dir_inode->disk_inode.links = 1;
 	INO_SET_FIELD(dir_inode, INODE_MODIFIED);
 	iput(dir_inode);
-	add_dir_entry(parent_dir, new_entry);
+	add_dir_entry(par_dir_inode, new_entry);
 	iput(par_dir_inode);
 	return 0;
 }
 
-int myrmdir(const char *dir_path)
+int mymkdir(const char *parent_dir, const char *dir_name)
+{
+	jbegin();
+	int ret = dir_mkdir(parent_dir, dir_name);
+	jend();
+	return ret;
+}
+
+static int dir_rmdir(const char *dir_path)
 {
 	char dir_name[MAX_FILE_NAME_SIZE + 1];
 	char par_path[100];
@@ -206,28 +544,219 @@ int myrmdir(const char *dir_path)
 	if (namei(par_path, &par) != 0)
 		return -1;
 	offset_t found_at;
+	ilock(par); /* the entry stays where it was found until it is removed */
 	dir_entry_t dir_entry = dir_lookup(par, dir_name, &found_at);
 	if (dir_entry.inode_no != 0)
 	{
 		if (iget(dir_entry.inode_no, &dir) == 0)
 		{
+			ilock(dir);
 			if (dir->disk_inode.links == 1)
 			{
 				rem_dir_entry(par, found_at);
+				dcache_purge(dir->inode_no); /* its inode number can be reused */
 				dir->disk_inode.links = 0;
 				INO_SET_FIELD(dir, INODE_MODIFIED);
+				iunlock(dir);
+				iunlock(par);
 				iput(dir);
+				iput(par);
 				return 0;
 			}
+			iunlock(dir);
 			iput(dir);
 		}
 	}
+	iunlock(par);
 	iput(par);
 	return -1;
 }
 
+int myrmdir(const char *dir_path)
+{
+	jbegin();
+	int ret = dir_rmdir(dir_path);
+	jend();
+	return ret;
+}
+
+dir_stream_t dir_table[MAX_OPEN_DIRS] = {[0 ... MAX_OPEN_DIRS - 1] = {.inode = NULL, .lock = PTHREAD_MUTEX_INITIALIZER}};
+
+/* gives the open stream of a directory descriptor with its lock held, or NULL */
+static dir_stream_t *dir_stream_lock(int dd)
+{
+	if (dd < 0 || dd >= MAX_OPEN_DIRS)
+		return NULL;
+	pthread_mutex_lock(&dir_table[dd].lock);
+	if (dir_table[dd].inode == NULL)
+	{
+		pthread_mutex_unlock(&dir_table[dd].lock);
+		return NULL;
+	}
+	return dir_table + dd;
+}
+
+/* opens a directory for listing. returns a directory descriptor */
+int myopendir(const char *path)
+{
+	inode_t *inode;
+	if (namei(path, &inode) != 0)
+		return -1;
+	if (inode->disk_inode.type != FT_DIR)
+	{
+		iput(inode);
+		return -1;
+	}
+	/* a slot is claimed under its lock. one that is locked is in use, so it is not waited for */
+	for (int dd = 0; dd < MAX_OPEN_DIRS; dd++)
+	{
+		if (pthread_mutex_trylock(&dir_table[dd].lock) != 0)
+			continue;
+		if (dir_table[dd].inode == NULL)
+		{
+			dir_table[dd].inode = inode;
+			dir_table[dd].offset = 0;
+			pthread_mutex_unlock(&dir_table[dd].lock);
+			return dd;
+		}
+		pthread_mutex_unlock(&dir_table[dd].lock);
+	}
+	iput(inode);
+	return -1;
+}
+
+/* a read of the stream in progress is finished first */
+int myclosedir(int dd)
+{
+	dir_stream_t *ds = dir_stream_lock(dd);
+	if (ds == NULL)
+		return -1;
+	inode_t *inode = ds->inode;
+	ds->inode = NULL;
+	pthread_mutex_unlock(&ds->lock);
+	iput(inode);
+	return 0;
+}
+
+/* copies up to count used entries from the stream's position on and moves past them. each block is read once per call.
+ * in a hash indexed directory only the ".." slot of the root is an entry; leaves follow in block order. */
+static int dir_read(dir_stream_t *ds, dir_entry_t *entries, int count)
+{
+	inode_t *dir = ds->inode;
+	buffer_t buffer;
+	block_no_t physical;
+	u_int32_t run;
+	int n = 0;
+	ilock_shared(dir);
+	while (n < count && ds->offset < dir->disk_inode.size)
+	{
+		block_no_t logical = ds->offset / MY_BLK_SIZE;
+		int slot = ds->offset % MY_BLK_SIZE / DIR_ENTRY_SIZE, end = DIR_ENTRIES_PER_BLOCK;
+		if (INO_USES_HTREE(dir) && logical == 0)
+			end = 1;
+		else if (dir->disk_inode.size - ds->offset < (offset_t)(end - slot) * DIR_ENTRY_SIZE)
+			end = slot + (dir->disk_inode.size - ds->offset) / DIR_ENTRY_SIZE;
+		if (slot < end && bmap_run(dir, logical, &physical, &run) == 0 && physical != 0)
+		{
+			if (bread(physical, &buffer) != 0)
+				break;
+			for (; slot < end && n < count; slot++)
+			{
+				memcpy(entries + n, buffer.data->b + slot * DIR_ENTRY_SIZE, DIR_ENTRY_SIZE);
+				if (entries[n].inode_no != 0)
+					n++;
+			}
+			brelse(&buffer);
+		}
+		else
+			slot = end; /* hole */
+		ds->offset = slot < end ? (offset_t)logical * MY_BLK_SIZE + slot * DIR_ENTRY_SIZE : (offset_t)(logical + 1) * MY_BLK_SIZE;
+	}
+	iunlock(dir);
+	return n;
+}
+
+/* reads up to count entries of an open directory, like getdents. returns how many were read, 0 at the end */
+int myreaddir(int dd, dir_entry_t *entries, int count)
+{
+	dir_stream_t *ds;
+	if (count < 0 || (ds = dir_stream_lock(dd)) == NULL)
+		return -1;
+	int n = dir_read(ds, entries, count);
+	pthread_mutex_unlock(&ds->lock);
+	return n;
+}
+
+typedef struct
+{
+	block_no_t block; /* inode table block */
+	int index;		  /* entry in the batch */
+} inode_ref_t;
+
+static int cmp_inode_ref(const void *a, const void *b)
+{
+	const inode_ref_t *x = a, *y = b;
+	if (x->block != y->block)
+		return (x->block > y->block) - (x->block < y->block);
+	return x->index - y->index;
+}
+
+/* reads entries with the disk inode of each. the inodes of all entries of a call are taken in inode table order
+ * and every inode table block they need is prefetched once, so a call costs about one read per inode block. */
+int myreaddirplus(int dd, dir_entry_plus_t *entries, int count)
+{
+	if (count < 0)
+		return -1;
+	dir_entry_t *batch = malloc(count * sizeof(dir_entry_t));
+	inode_ref_t *refs = malloc(count * sizeof(inode_ref_t));
+	dir_stream_t *ds = NULL;
+	if ((count > 0 && (batch == NULL || refs == NULL)) || (ds = dir_stream_lock(dd)) == NULL)
+	{
+		free(batch);
+		free(refs);
+		return -1;
+	}
+	int n = dir_read(ds, batch, count);
+	pthread_mutex_unlock(&ds->lock);
+	for (int i = 0; i < n; i++)
+	{
+		refs[i].block = INODE_NO_TO_BLOCK_NO(batch[i].inode_no);
+		refs[i].index = i;
+	}
+	qsort(refs, n, sizeof(inode_ref_t), cmp_inode_ref);
+	block_no_t blocks[BUFF_MAX_RUN];
+	for (int i = 0, next = 0; i < n; i++)
+	{
+		if (i == next)
+		{
+			/* a window of distinct inode blocks is prefetched just before its inodes are read, so the cache holds it */
+			int k = 0;
+			for (; next < n && (k < BUFF_MAX_RUN || refs[next].block == blocks[k - 1]); next++)
+			{
+				if (k == 0 || refs[next].block != blocks[k - 1])
+					blocks[k++] = refs[next].block;
+			}
+			bprefetchv(blocks, k);
+		}
+		dir_entry_plus_t *e = entries + refs[i].index;
+		inode_t *inode;
+		e->dir_entry = batch[refs[i].index];
+		if (iget(e->dir_entry.inode_no, &inode) == 0)
+		{
+			ilock_shared(inode);
+			e->disk_inode = inode->disk_inode;
+			iunlock(inode);
+			iput(inode);
+		}
+		else
+			memset(&e->disk_inode, 0, sizeof(disk_inode_t));
+	}
+	free(batch);
+	free(refs);
+	return n;
+}
 #endif
-int mylink(const char *existing_path, const char *new_path)
+static int dir_link(const char *existing_path, const char *new_path)
 {
 	char fil_name[MAX_FILE_NAME_SIZE + 1];
 	char par_path[100];
@@ -246,6 +775,8 @@ int mylink(const char *existing_path, const char *new_path)
 		fil_name[MAX_FILE_NAME_SIZE] = '\0';
 		dirn[1] = '\0';
 		int fnl = strlen(fil_name);
+		if (fnl > DIR_NAME_LEN)
+			return -1;
 		memset(fil_name + fnl, 0, MAX_FILE_NAME_SIZE - fnl);
 	}
 	inode_t *inode, *par_dir;
@@ -258,11 +789,13 @@ int mylink(const char *existing_path, const char *new_path)
 				if (par_dir->disk_inode.type == FT_DIR)
 				{
 					dir_entry_t dir_entry;
+					ilock(inode);
 					inode->disk_inode.links++;
 					INO_SET_FIELD(inode, INODE_MODIFIED);
+					iunlock(inode);
 					dir_entry.inode_no = inode->inode_no;
 					iput(inode);
-					memcpy(dir_entry.name, fil_name, MAX_FILE_NAME_SIZE);
+					memcpy(dir_entry.name, fil_name, DIR_NAME_LEN);
 					dir_entry.type = FT_FIL;
 					if (add_dir_entry(par_dir, dir_entry) == 0)
 					{
@@ -279,7 +812,15 @@ int mylink(const char *existing_path, const char *new_path)
 	}
 	return -1;
 }
-int myunlink(const char *fil_path)
+
+int mylink(const char *existing_path, const char *new_path)
+{
+	jbegin();
+	int ret = dir_link(existing_path, new_path);
+	jend();
+	return ret;
+}
+static int dir_unlink(const char *fil_path)
 {
 	char fil_name[MAX_FILE_NAME_SIZE + 1];
 	char par_path[100];
@@ -304,18 +845,33 @@ int myunlink(const char *fil_path)
 	if (namei(par_path, &par) == 0)
 	{
 		offset_t found_at;
+		ilock(par); /* the entry stays where it was found until it is removed */
 		dir_entry_t dir_entry = dir_lookup(par, fil_name, &found_at);
 		if (dir_entry.inode_no != 0)
 		{
 			rem_dir_entry(par, found_at);
+			iunlock(par);
 			iput(par);
 			iget(dir_entry.inode_no, &inode);
+			ilock(inode);
 			inode->disk_inode.links--;
 			INO_SET_FIELD(inode, INODE_MODIFIED);
+			if (inode->disk_inode.links == 0)
+				dcache_purge(inode->inode_no); /* its inode number can be reused */
+			iunlock(inode);
 			iput(inode);
 			return 0;
 		}
+		iunlock(par);
 		iput(par);
 	}
 	return -1;
+}
+
+int myunlink(const char *fil_path)
+{
+	jbegin();
+	int ret = dir_unlink(fil_path);
+	jend();
+	return ret;
 }
\ No newline at end of file
@@ -3,7 +3,73 @@
 #define DIR_H
 #define DIR_FIXED_ENTRY_SIZE_TYPE 
 #ifdef DIR_FIXED_ENTRY_SIZE_TYPE
-#define DIR_ENTRY_SIZE (sizeof(dir_entry_t))
+#define DIR_ENTRY_SIZE ((int)sizeof(dir_entry_t))
 #define DIR_ENTRIES_PER_BLOCK (MY_BLK_SIZE/DIR_ENTRY_SIZE)
+#define DIR_NAME_LEN ((int)sizeof(((dir_entry_t *)0)->name)) /* bytes of a name kept in an entry */
+
+/* directory blocks are searched with sse2 or avx2 compares, picked at run time. DIR_NO_SIMD keeps the plain loop */
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__) && !defined(DIR_NO_SIMD)
+#define DIR_HAVE_SIMD
+#endif
+
+/* a linear directory that has filled this many blocks is converted to a hash indexed one when it grows.
+ * 0 keeps every directory linear. can be overridden at compile time. */
+#ifndef DIR_HTREE_THRESHOLD
+#define DIR_HTREE_THRESHOLD 2
+#endif
+
+/* hash indexed directory: logical block 0 is the root. its first entry slot holds "..", then come a header and
+ * index entries sorted by hash. index entry i points to the leaf holding the names with hash from its hash up to
+ * the hash of entry i + 1. entry 0 has hash 0. leaves are blocks of plain entries. */
+typedef struct
+{
+	u_int16_t count; /* index entries in use */
+	u_int16_t limit; /* index entries that fit in the root */
+	u_int32_t reserved;
+} htree_header_t;
+typedef struct
+{
+	u_int32_t hash;	 /* least hash of names in the leaf */
+	u_int16_t block; /* logical block of the leaf */
+	u_int16_t free;	 /* free entry slots in the leaf */
+} htree_entry_t;
+#define HTREE_HEADER_OFF DIR_ENTRY_SIZE
+#define HTREE_ENTRIES_OFF (HTREE_HEADER_OFF + sizeof(htree_header_t))
+#define HTREE_MAX_ENTRIES ((MY_BLK_SIZE - HTREE_ENTRIES_OFF) / sizeof(htree_entry_t))
+#define HTREE_HEADER(buffer) ((htree_header_t *)((buffer)->data->b + HTREE_HEADER_OFF))
+#define HTREE_ENTRIES(buffer) ((htree_entry_t *)((buffer)->data->b + HTREE_ENTRIES_OFF))
+
+/* directories open for listing at once */
+#define MAX_OPEN_DIRS 10
+
+typedef struct
+{
+	inode_t *inode; /* NULL if not open */
+	offset_t offset; /* offset in the directory of the next entry to look at */
+	pthread_mutex_t lock; /* guards the other fields. held while the stream is read */
+} dir_stream_t;
+
+/* entries of the cache of name lookups. can be overridden at compile time. */
+#ifndef DCACHE_SIZE
+#define DCACHE_SIZE 1024
+#endif
+/* hash queues of the name lookup cache. must be a power of 2. */
+#define DCACHE_HASH_QUEUES 256
+
+typedef struct
+{
+	u_int64_t hits;			 /* name found in the cache */
+	u_int64_t negative_hits; /* cache told the name is not in the directory */
+	u_int64_t misses;		 /* directory had to be searched */
+	u_int64_t invalidations; /* entries dropped because the directory changed or space was needed */
+} dcache_stats_t;
+
+extern int dir_block_scan(const byte_t *, int, const char *, int *);
+extern int dcache_lookup(inode_no_t, const char *, dir_entry_t *, offset_t *);
+extern void dcache_insert(inode_no_t, const char *, const dir_entry_t *, offset_t);
+extern void dcache_invalidate(inode_no_t, const char *);
+extern void dcache_purge(inode_no_t);
+extern void dcache_clear();
+extern int dcachestats(dcache_stats_t *);
+#endif
 #endif
-#endif
\ No newline at end of file
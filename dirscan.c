@@ -0,0 +1,133 @@
+#include "myfs.h"
+#include "dir.h"
+#ifdef DIR_HAVE_SIMD
+#include <immintrin.h>
+#endif
+
+/* kernels that search a block of directory entries for a name and for the first free slot (inode number 0).
+ * an entry is 16 bytes with the name in its last DIR_NAME_LEN bytes, so one entry fills one 128 bit lane.
+ * the simd kernels compare 4 entries per pass and look at single entries only in passes that have a candidate. */
+
+typedef int (*scan_kernel_t)(const byte_t *, int, const char *, int *);
+
+static int scan_scalar(const byte_t *block, int count, const char *name, int *free_slot)
+{
+	dir_entry_t dir_entry;
+	for (int slot = 0; slot < count; slot++)
+	{
+		memcpy(&dir_entry, block + slot * DIR_ENTRY_SIZE, DIR_ENTRY_SIZE);
+		if (dir_entry.inode_no == 0)
+		{
+			if (free_slot != NULL && *free_slot == -1)
+				*free_slot = slot;
+		}
+		else if (memcmp(dir_entry.name, name, DIR_NAME_LEN) == 0)
+			return slot;
+	}
+	return -1;
+}
+
+#ifdef DIR_HAVE_SIMD
+/* byte compare masks hold 16 bits per entry, 4 entries in 64 bits */
+#define NAME_OFF (DIR_ENTRY_SIZE - DIR_NAME_LEN)
+#define NAME_BITS ((((u_int64_t)1 << DIR_NAME_LEN) - 1) << NAME_OFF)
+#define INODE_BITS (((u_int64_t)1 << sizeof(inode_no_t)) - 1)
+#define LANES(bits) ((bits) * 0x0001000100010001ull)
+/* tells if any 16 bit lane of x is 0 */
+#define ANY_LANE_ZERO(x) ((((x) - LANES(1)) & ~(x) & LANES(0x8000)) != 0)
+
+/* eq: bytes equal to the name pattern. zero: bytes that are 0 */
+static int scan_pass(u_int64_t eq, u_int64_t zero, int slot, int count, int *free_slot)
+{
+	int want_free = free_slot != NULL && *free_slot == -1;
+	/* candidate entries have all name bytes equal or, while a free slot is wanted, all inode bytes 0 */
+	if (!ANY_LANE_ZERO(~eq & LANES(NAME_BITS)) && !(want_free && ANY_LANE_ZERO(~zero & LANES(INODE_BITS))))
+		return -1;
+	for (int i = 0; i < 4 && slot + i < count; i++, eq >>= 16, zero >>= 16)
+	{
+		if ((zero & INODE_BITS) == INODE_BITS)
+		{
+			if (free_slot != NULL && *free_slot == -1)
+				*free_slot = slot + i;
+		}
+		else if ((eq & NAME_BITS) == NAME_BITS)
+			return slot + i;
+	}
+	return -1;
+}
+
+/* scans slots [from, count) */
+static int sse2_from(const byte_t *block, int from, int count, const char *name, int *free_slot)
+{
+	byte_t pattern[DIR_ENTRY_SIZE] = {0};
+	memcpy(pattern + NAME_OFF, name, DIR_NAME_LEN);
+	__m128i target = _mm_loadu_si128((const __m128i *)pattern), zero = _mm_setzero_si128();
+	for (int slot = from; slot < count; slot += 4)
+	{
+		u_int64_t eq = 0, z = 0;
+		for (int i = 0; i < 4 && slot + i < count; i++)
+		{
+			__m128i entry = _mm_loadu_si128((const __m128i *)(block + (slot + i) * DIR_ENTRY_SIZE));
+			eq |= (u_int64_t)(u_int16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(entry, target)) << (16 * i);
+			z |= (u_int64_t)(u_int16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(entry, zero)) << (16 * i);
+		}
+		int found = scan_pass(eq, z, slot, count, free_slot);
+		if (found >= 0)
+			return found;
+	}
+	return -1;
+}
+
+static int scan_sse2(const byte_t *block, int count, const char *name, int *free_slot)
+{
+	return sse2_from(block, 0, count, name, free_slot);
+}
+
+__attribute__((target("avx2"))) static int scan_avx2(const byte_t *block, int count, const char *name, int *free_slot)
+{
+	byte_t pattern[2 * DIR_ENTRY_SIZE] = {0};
+	memcpy(pattern + NAME_OFF, name, DIR_NAME_LEN);
+	memcpy(pattern + DIR_ENTRY_SIZE + NAME_OFF, name, DIR_NAME_LEN);
+	__m256i target = _mm256_loadu_si256((const __m256i *)pattern), zero = _mm256_setzero_si256();
+	int slot = 0;
+	for (; slot + 4 <= count; slot += 4)
+	{
+		/* two entries per compare */
+		__m256i a = _mm256_loadu_si256((const __m256i *)(block + slot * DIR_ENTRY_SIZE));
+		__m256i b = _mm256_loadu_si256((const __m256i *)(block + (slot + 2) * DIR_ENTRY_SIZE));
+		u_int64_t eq = (u_int32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(a, target)) | (u_int64_t)(u_int32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(b, target)) << 32;
+		u_int64_t z = (u_int32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(a, zero)) | (u_int64_t)(u_int32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(b, zero)) << 32;
+		int found = scan_pass(eq, z, slot, count, free_slot);
+		if (found >= 0)
+			return found;
+	}
+	/* last entries of a partly used block */
+	return sse2_from(block, slot, count, name, free_slot);
+}
+#endif
+
+scan_kernel_t scan_kernel = NULL;
+
+/* picks the widest kernel the cpu supports */
+static scan_kernel_t scan_choose()
+{
+#ifdef DIR_HAVE_SIMD
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		return scan_avx2;
+	if (__builtin_cpu_supports("sse2"))
+		return scan_sse2;
+#endif
+	return scan_scalar;
+}
+
+/* looks for a name (DIR_NAME_LEN bytes, zero padded) among the first count entries of a directory block.
+ * returns its slot or -1. if free_slot is not NULL, the first free slot before the name is put in it, -1 if there is none. */
+int dir_block_scan(const byte_t *block, int count, const char *name, int *free_slot)
+{
+	if (scan_kernel == NULL)
+		scan_kernel = scan_choose();
+	if (free_slot != NULL)
+		*free_slot = -1;
+	return scan_kernel(block, count, name, free_slot);
+}
@@ -0,0 +1,339 @@
+#include "disk.h"
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <pthread.h>
+#ifdef DISK_HAVE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <stdint.h>
+#include <errno.h>
+#endif
+
+int disk_backend = DISK_BACKEND_PREAD;
+block_t *disk_map = NULL;
+size_t disk_map_len = 0;
+int disk_map_fd = -1; /* file that is mapped. other files always use read/write calls */
+
+/* a queued vectored read or write of consecutive blocks */
+typedef struct
+{
+	int fd;
+	block_no_t block_no;
+	block_t **blocks;
+	int count;
+	int write;
+	int *done; /* blocks transferred are added here when the operation completes */
+	struct iovec iov[DISK_MAX_IOV];
+} disk_op_t;
+
+#ifdef DISK_HAVE_IO_URING
+struct
+{
+	int fd;
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sq_ring, *cq_ring;
+	size_t sq_ring_len, cq_ring_len, sqes_len;
+	unsigned queued;   /* sqes written but not yet submitted */
+	unsigned inflight; /* operations submitted or queued but not yet completed */
+} ring = {.fd = -1};
+disk_op_t ring_ops[DISK_QUEUE_DEPTH];
+disk_op_t *ring_free_ops[DISK_QUEUE_DEPTH];
+int ring_num_free_ops = 0;
+/* the ring is shared by all threads. a thread waiting for its transfers completes those of others too */
+pthread_mutex_t ring_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+static int disk_rw(int, block_no_t, block_t **, int, int);
+
+#ifdef DISK_HAVE_IO_URING
+static void ring_exit()
+{
+	if (ring.fd < 0)
+		return;
+	munmap(ring.sqes, ring.sqes_len);
+	if (ring.cq_ring != ring.sq_ring)
+		munmap(ring.cq_ring, ring.cq_ring_len);
+	munmap(ring.sq_ring, ring.sq_ring_len);
+	close(ring.fd);
+	ring.fd = -1;
+}
+
+static int ring_init()
+{
+	struct io_uring_params p;
+	memset(&p, 0, sizeof(p));
+	ring.fd = syscall(__NR_io_uring_setup, DISK_QUEUE_DEPTH, &p);
+	if (ring.fd < 0)
+		return -1;
+	ring.sq_ring_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	ring.cq_ring_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+	{
+		if (ring.cq_ring_len > ring.sq_ring_len)
+			ring.sq_ring_len = ring.cq_ring_len;
+		ring.cq_ring_len = ring.sq_ring_len;
+	}
+	ring.sq_ring = mmap(NULL, ring.sq_ring_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQ_RING);
+	if (ring.sq_ring == MAP_FAILED)
+	{
+		close(ring.fd);
+		ring.fd = -1;
+		return -1;
+	}
+	ring.cq_ring = ring.sq_ring;
+	if (!(p.features & IORING_FEAT_SINGLE_MMAP))
+	{
+		ring.cq_ring = mmap(NULL, ring.cq_ring_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_CQ_RING);
+		if (ring.cq_ring == MAP_FAILED)
+		{
+			munmap(ring.sq_ring, ring.sq_ring_len);
+			close(ring.fd);
+			ring.fd = -1;
+			return -1;
+		}
+	}
+	ring.sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+	ring.sqes = mmap(NULL, ring.sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQES);
+	if (ring.sqes == MAP_FAILED)
+	{
+		ring.sqes_len = 0;
+		ring.sqes = NULL;
+		if (ring.cq_ring != ring.sq_ring)
+			munmap(ring.cq_ring, ring.cq_ring_len);
+		munmap(ring.sq_ring, ring.sq_ring_len);
+		close(ring.fd);
+		ring.fd = -1;
+		return -1;
+	}
+	ring.sq_head = (unsigned *)((char *)ring.sq_ring + p.sq_off.head);
+	ring.sq_tail = (unsigned *)((char *)ring.sq_ring + p.sq_off.tail);
+	ring.sq_mask = (unsigned *)((char *)ring.sq_ring + p.sq_off.ring_mask);
+	ring.sq_array = (unsigned *)((char *)ring.sq_ring + p.sq_off.array);
+	ring.cq_head = (unsigned *)((char *)ring.cq_ring + p.cq_off.head);
+	ring.cq_tail = (unsigned *)((char *)ring.cq_ring + p.cq_off.tail);
+	ring.cq_mask = (unsigned *)((char *)ring.cq_ring + p.cq_off.ring_mask);
+	ring.cqes = (struct io_uring_cqe *)((char *)ring.cq_ring + p.cq_off.cqes);
+	ring.queued = ring.inflight = 0;
+	for (int i = 0; i < DISK_QUEUE_DEPTH; i++)
+		ring_free_ops[i] = ring_ops + i;
+	ring_num_free_ops = DISK_QUEUE_DEPTH;
+	return 0;
+}
+
+/* puts one sqe for op on the submission queue. it is submitted by the next ring_wait_all */
+static void ring_queue(disk_op_t *op)
+{
+	unsigned tail = *ring.sq_tail, idx = tail & *ring.sq_mask;
+	struct io_uring_sqe *sqe = ring.sqes + idx;
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = op->write ? IORING_OP_WRITEV : IORING_OP_READV;
+	sqe->fd = op->fd;
+	sqe->off = (u_int64_t)op->block_no * MY_BLK_SIZE;
+	sqe->addr = (u_int64_t)(uintptr_t)op->iov;
+	sqe->len = op->count;
+	sqe->user_data = (u_int64_t)(uintptr_t)op;
+	ring.sq_array[idx] = idx;
+	__atomic_store_n(ring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+	ring.queued++;
+	ring.inflight++;
+}
+
+/* submits everything queued and reaps completions until nothing is in flight.
+ * an operation that completes short is finished with positional calls. */
+static int ring_wait_all()
+{
+	int ret = 0;
+	while (ring.inflight > 0)
+	{
+		int r = syscall(__NR_io_uring_enter, ring.fd, ring.queued, ring.inflight, IORING_ENTER_GETEVENTS, NULL, 0);
+		if (r < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		ring.queued -= r < (int)ring.queued ? r : (int)ring.queued;
+		unsigned head = *ring.cq_head, tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+		for (; head != tail; head++)
+		{
+			struct io_uring_cqe *cqe = ring.cqes + (head & *ring.cq_mask);
+			disk_op_t *op = (disk_op_t *)(uintptr_t)cqe->user_data;
+			int done = cqe->res > 0 ? cqe->res / MY_BLK_SIZE : 0;
+			if (done < op->count)
+				done += disk_rw(op->fd, op->block_no + done, op->blocks + done, op->count - done, op->write);
+			if (done < op->count)
+				ret = -1;
+			*op->done += done;
+			ring_free_ops[ring_num_free_ops++] = op;
+			ring.inflight--;
+		}
+		__atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+	}
+	return ret;
+}
+#endif
+
+/* switches the way the image behind fd is accessed. the mapping covers num_blocks blocks.
+ * if io_uring cannot be set up, the positional read/write backend is kept; disk_backend tells which is in use. */
+int disk_set_backend(int fd, int backend, block_no_t num_blocks)
+{
+	disk_wait_all();
+	if (disk_map != NULL)
+	{
+		msync(disk_map, disk_map_len, MS_SYNC);
+		munmap(disk_map, disk_map_len);
+		disk_map = NULL;
+		disk_map_len = 0;
+		disk_map_fd = -1;
+	}
+#ifdef DISK_HAVE_IO_URING
+	ring_exit();
+#endif
+	disk_backend = DISK_BACKEND_PREAD;
+	if (backend == DISK_BACKEND_MMAP)
+	{
+		size_t len = (size_t)num_blocks * MY_BLK_SIZE;
+		void *map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		if (map == MAP_FAILED)
+			return -1;
+		disk_map = map;
+		disk_map_len = len;
+		disk_map_fd = fd;
+		disk_backend = DISK_BACKEND_MMAP;
+	}
+#ifdef DISK_HAVE_IO_URING
+	else if (backend == DISK_BACKEND_IO_URING && ring_init() == 0)
+	{
+		disk_backend = DISK_BACKEND_IO_URING;
+	}
+#endif
+	return 0;
+}
+
+/* moves count consecutive blocks starting at block_no between the disk and the given blocks.
+ * uses positional vectored io, so the file offset of fd is never touched.
+ * returns number of blocks transferred. */
+static int disk_rw(int fd, block_no_t block_no, block_t **blocks, int count, int write)
+{
+	struct iovec iov[DISK_MAX_IOV];
+	int done = 0;
+	while (done < count)
+	{
+		int n = count - done < DISK_MAX_IOV ? count - done : DISK_MAX_IOV;
+		for (int i = 0; i < n; i++)
+		{
+			iov[i].iov_base = blocks[done + i];
+			iov[i].iov_len = MY_BLK_SIZE;
+		}
+		off_t pos = ((off_t)block_no + done) * MY_BLK_SIZE;
+		ssize_t r = write ? pwritev(fd, iov, n, pos) : preadv(fd, iov, n, pos);
+		if (r < MY_BLK_SIZE)
+			break; /* error or end of file */
+		done += r / MY_BLK_SIZE;
+	}
+	return done;
+}
+
+/* same as disk_rw but through the mapping. blocks that already point into the mapping are not copied.
+ * writes are synced with one msync for the whole range. */
+static int disk_map_rw(block_no_t block_no, block_t **blocks, int count, int write)
+{
+	if ((size_t)(block_no + count) * MY_BLK_SIZE > disk_map_len)
+		return 0;
+	for (int i = 0; i < count; i++)
+	{
+		block_t *mapped = DISK_MAPPED_BLOCK(block_no + i);
+		if (blocks[i] == mapped)
+			continue;
+		if (write)
+			memcpy(mapped, blocks[i], MY_BLK_SIZE);
+		else
+			memcpy(blocks[i], mapped, MY_BLK_SIZE);
+	}
+	if (write && msync(DISK_MAPPED_BLOCK(block_no), (size_t)count * MY_BLK_SIZE, MS_SYNC) != 0)
+		return 0;
+	return count;
+}
+
+/* queues a transfer of count consecutive blocks. the number of blocks transferred is added to *done
+ * once it completes, which is no later than the next disk_wait_all. blocks must stay valid until then.
+ * only the io_uring backend defers the transfer, the others complete it right away. */
+int disk_queue(int fd, block_no_t block_no, block_t **blocks, int count, int write, int *done)
+{
+	if (DISK_IS_MAPPED() && fd == disk_map_fd)
+	{
+		*done += disk_map_rw(block_no, blocks, count, write);
+		return 0;
+	}
+#ifdef DISK_HAVE_IO_URING
+	if (disk_backend == DISK_BACKEND_IO_URING)
+	{
+		pthread_mutex_lock(&ring_lock);
+		for (int queued = 0; queued < count;)
+		{
+			if (ring_num_free_ops == 0)
+				ring_wait_all();
+			disk_op_t *op = ring_free_ops[--ring_num_free_ops];
+			op->fd = fd;
+			op->block_no = block_no + queued;
+			op->blocks = blocks + queued;
+			op->count = count - queued < DISK_MAX_IOV ? count - queued : DISK_MAX_IOV;
+			op->write = write;
+			op->done = done;
+			for (int i = 0; i < op->count; i++)
+			{
+				op->iov[i].iov_base = op->blocks[i];
+				op->iov[i].iov_len = MY_BLK_SIZE;
+			}
+			ring_queue(op);
+			queued += op->count;
+		}
+		pthread_mutex_unlock(&ring_lock);
+		return 0;
+	}
+#endif
+	*done += disk_rw(fd, block_no, blocks, count, write);
+	return 0;
+}
+
+/* waits until every queued transfer has completed. all of them are submitted with one system call. */
+int disk_wait_all()
+{
+#ifdef DISK_HAVE_IO_URING
+	if (ring.fd >= 0)
+	{
+		pthread_mutex_lock(&ring_lock);
+		int ret = ring_wait_all();
+		pthread_mutex_unlock(&ring_lock);
+		return ret;
+	}
+#endif
+	return 0;
+}
+
+int disk_read(int fd, block_no_t block_no, block_t **blocks, int count)
+{
+	int done = 0;
+	disk_queue(fd, block_no, blocks, count, 0, &done);
+	disk_wait_all();
+	return done;
+}
+
+int disk_write(int fd, block_no_t block_no, block_t **blocks, int count)
+{
+	int done = 0;
+	disk_queue(fd, block_no, blocks, count, 1, &done);
+	disk_wait_all();
+	return done;
+}
+
+/* hints that blocks [block_no, block_no + count) will be needed soon. only the mapping needs it */
+int disk_prefetch(block_no_t block_no, int count)
+{
+	if (!DISK_IS_MAPPED() || (size_t)(block_no + count) * MY_BLK_SIZE > disk_map_len)
+		return 0;
+	return madvise(DISK_MAPPED_BLOCK(block_no), (size_t)count * MY_BLK_SIZE, MADV_WILLNEED);
+}
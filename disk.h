@@ -0,0 +1,31 @@
+#include "myfs.h"
+#ifndef DISK_H
+#define DISK_H
+/* most blocks moved by one preadv/pwritev call */
+#define DISK_MAX_IOV 256
+
+/* ways the disk image can be accessed */
+#define DISK_BACKEND_PREAD 0 /* positional read/write calls */
+#define DISK_BACKEND_MMAP 1	 /* image mapped into memory. blocks are used in place */
+#define DISK_BACKEND_IO_URING 2 /* batched asynchronous io through io_uring (linux only) */
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define DISK_HAVE_IO_URING
+#endif
+#endif
+/* most transfers in flight at once with io_uring */
+#define DISK_QUEUE_DEPTH 32
+
+extern int disk_backend;
+extern block_t *disk_map;
+#define DISK_IS_MAPPED() (disk_backend == DISK_BACKEND_MMAP)
+#define DISK_MAPPED_BLOCK(block_no) (disk_map + (block_no))
+
+extern int disk_set_backend(int, int, block_no_t);
+extern int disk_read(int, block_no_t, block_t **, int);
+extern int disk_write(int, block_no_t, block_t **, int);
+extern int disk_queue(int, block_no_t, block_t **, int, int, int *);
+extern int disk_wait_all();
+extern int disk_prefetch(block_no_t, int);
+#endif
@@ -0,0 +1,269 @@
+#include "myfs.h"
+#include "inode.h"
+#include "buffer_cache.h"
+
+/* copies the extents of an extent mapped inode into ext. returns number of extents or -1. */
+int extent_load(inode_t *inode, extent_t *ext)
+{
+	int count = inode->disk_inode.index.extents.count;
+	if (inode->disk_inode.index.extents.depth == 0)
+	{
+		memcpy(ext, inode->disk_inode.index.extents.extent, count * sizeof(extent_t));
+		return count;
+	}
+	buffer_t buffer;
+	if (bread(inode->disk_inode.index.extents.tree, &buffer) != 0)
+		return -1;
+	memcpy(ext, buffer.data->b + EXTENT_BLOCK_HEADER_SIZE, count * sizeof(extent_t));
+	brelse(&buffer);
+	return count;
+}
+
+/* writes count extents back to the inode. they spill into an extent block once they do not fit inline. */
+int extent_store(inode_t *inode, extent_t *ext, int count)
+{
+	if (count > EXTENTS_PER_BLOCK)
+	{
+		/* extent block is full. file is too fragmented */
+		return -1;
+	}
+	if (inode->disk_inode.index.extents.depth == 0 && count <= NUM_INLINE_EXTENTS)
+	{
+		memcpy(inode->disk_inode.index.extents.extent, ext, count * sizeof(extent_t));
+		inode->disk_inode.index.extents.count = count;
+		INO_SET_FIELD(inode, INODE_MODIFIED);
+		return 0;
+	}
+	buffer_t buffer;
+	if (inode->disk_inode.index.extents.depth == 0)
+	{
+		if (balloc(&buffer) != 0)
+			return -1;
+		inode->disk_inode.index.extents.tree = buffer.header->block_no;
+		inode->disk_inode.index.extents.depth = 1;
+		memset(inode->disk_inode.index.extents.extent, 0, sizeof(inode->disk_inode.index.extents.extent));
+	}
+	else if (bread(inode->disk_inode.index.extents.tree, &buffer) != 0)
+		return -1;
+	u_int16_t header[EXTENT_BLOCK_HEADER_SIZE / sizeof(u_int16_t)] = {count, 0};
+	memcpy(buffer.data->b, header, EXTENT_BLOCK_HEADER_SIZE);
+	memcpy(buffer.data->b + EXTENT_BLOCK_HEADER_SIZE, ext, count * sizeof(extent_t));
+	BUFF_SET_FIELD(buffer, BUFF_MODIFIED | BUFF_JOURNAL);
+	brelse(&buffer);
+	inode->disk_inode.index.extents.count = count;
+	INO_SET_FIELD(inode, INODE_MODIFIED);
+	return 0;
+}
+
+/* index of the last extent starting at or before logical, -1 if none */
+static int extent_search(extent_t *ext, int count, block_no_t logical)
+{
+	int lo = 0, hi = count - 1, found = -1;
+	while (lo <= hi)
+	{
+		int mid = (lo + hi) / 2;
+		if (ext[mid].logical <= logical)
+		{
+			found = mid;
+			lo = mid + 1;
+		}
+		else
+			hi = mid - 1;
+	}
+	return found;
+}
+
+/* translates a logical block. *run gets the number of blocks from logical on that are mapped contiguously,
+ * or, if logical is a hole (*physical is 0), the number of blocks up to the next extent.
+ * returns 1 if the block is allocated but unwritten, 0 if not, -1 on error. */
+int extent_lookup(inode_t *inode, block_no_t logical, block_no_t *physical, u_int32_t *run)
+{
+	extent_t ext[EXTENTS_PER_BLOCK];
+	int count = extent_load(inode, ext);
+	if (count < 0)
+		return -1;
+	int i = extent_search(ext, count, logical);
+	if (i >= 0 && logical - ext[i].logical < EXTENT_LEN(ext[i]))
+	{
+		*physical = ext[i].physical + (logical - ext[i].logical);
+		*run = EXTENT_LEN(ext[i]) - (logical - ext[i].logical);
+		return EXTENT_IS_UNWRITTEN(ext[i]);
+	}
+	*physical = 0;
+	*run = i + 1 < count ? ext[i + 1].logical - logical : UINT32_MAX - logical;
+	return 0;
+}
+
+/* frees the physical blocks that logical blocks [logical, logical + length) are mapped to */
+static void extent_free_range(const extent_t *ext, int count, block_no_t logical, u_int32_t length)
+{
+	block_no_t end = logical + length;
+	for (int i = 0; i < count; i++)
+	{
+		block_no_t e_start = ext[i].logical, e_end = ext[i].logical + EXTENT_LEN(ext[i]);
+		if (e_end <= logical || e_start >= end)
+			continue;
+		block_no_t cut_start = e_start > logical ? e_start : logical, cut_end = e_end < end ? e_end : end;
+		bfree_range(ext[i].physical + (cut_start - e_start), cut_end - cut_start);
+	}
+}
+
+/* unmaps logical blocks [logical, logical + length). extents are trimmed or split. their physical blocks are not freed */
+static int extent_punch(extent_t *ext, int *count, block_no_t logical, u_int32_t length)
+{
+	block_no_t end = logical + length;
+	for (int i = 0; i < *count; i++)
+	{
+		u_int32_t unwritten = ext[i].length & EXTENT_UNWRITTEN; /* pieces keep the state of the extent */
+		block_no_t e_start = ext[i].logical, e_end = ext[i].logical + EXTENT_LEN(ext[i]);
+		if (e_end <= logical || e_start >= end)
+			continue;
+		block_no_t cut_start = e_start > logical ? e_start : logical, cut_end = e_end < end ? e_end : end;
+		if (cut_start > e_start && cut_end < e_end)
+		{
+			/* range is inside the extent. split it in two */
+			if (*count == EXTENTS_PER_BLOCK)
+				return -1;
+			memmove(ext + i + 2, ext + i + 1, (*count - i - 1) * sizeof(extent_t));
+			ext[i + 1].logical = cut_end;
+			ext[i + 1].physical = ext[i].physical + (cut_end - e_start);
+			ext[i + 1].length = (e_end - cut_end) | unwritten;
+			ext[i].length = (cut_start - e_start) | unwritten;
+			(*count)++;
+			return 0;
+		}
+		if (cut_start > e_start)
+		{
+			ext[i].length = (cut_start - e_start) | unwritten;
+			continue;
+		}
+		if (cut_end < e_end)
+		{
+			ext[i].physical += cut_end - e_start;
+			ext[i].logical = cut_end;
+			ext[i].length = (e_end - cut_end) | unwritten;
+			continue;
+		}
+		/* whole extent is unmapped */
+		memmove(ext + i, ext + i + 1, (*count - i - 1) * sizeof(extent_t));
+		(*count)--;
+		i--;
+	}
+	return 0;
+}
+
+/* maps the unmapped logical blocks [logical, logical + length) to physical blocks starting at physical.
+ * length may carry EXTENT_UNWRITTEN. the new run is merged with neighbouring extents in the same state when they are contiguous with it. */
+static int extent_insert(extent_t *ext, int *count, block_no_t logical, block_no_t physical, u_int32_t length)
+{
+	u_int32_t unwritten = length & EXTENT_UNWRITTEN;
+	length &= ~EXTENT_UNWRITTEN;
+	int i = extent_search(ext, *count, logical);
+	if (i >= 0 && (ext[i].length & EXTENT_UNWRITTEN) == unwritten && ext[i].logical + EXTENT_LEN(ext[i]) == logical && ext[i].physical + EXTENT_LEN(ext[i]) == physical)
+	{
+		/* extends the previous extent. it may now touch the next one */
+		ext[i].length += length;
+		if (i + 1 < *count && (ext[i + 1].length & EXTENT_UNWRITTEN) == unwritten && ext[i].logical + EXTENT_LEN(ext[i]) == ext[i + 1].logical && ext[i].physical + EXTENT_LEN(ext[i]) == ext[i + 1].physical)
+		{
+			ext[i].length += EXTENT_LEN(ext[i + 1]);
+			memmove(ext + i + 1, ext + i + 2, (*count - i - 2) * sizeof(extent_t));
+			(*count)--;
+		}
+		return 0;
+	}
+	if (i + 1 < *count && (ext[i + 1].length & EXTENT_UNWRITTEN) == unwritten && logical + length == ext[i + 1].logical && physical + length == ext[i + 1].physical)
+	{
+		/* extends the next extent backwards */
+		ext[i + 1].logical = logical;
+		ext[i + 1].physical = physical;
+		ext[i + 1].length += length;
+		return 0;
+	}
+	if (*count == EXTENTS_PER_BLOCK)
+		return -1;
+	memmove(ext + i + 2, ext + i + 1, (*count - i - 1) * sizeof(extent_t));
+	ext[i + 1].logical = logical;
+	ext[i + 1].physical = physical;
+	ext[i + 1].length = length | unwritten;
+	(*count)++;
+	return 0;
+}
+
+/* maps logical blocks [logical, logical + length) to the physical run starting at physical.
+ * blocks previously mapped in that range are freed. with EXTENT_UNWRITTEN in length the run is mapped unwritten. */
+int extent_map(inode_t *inode, block_no_t logical, block_no_t physical, u_int32_t length)
+{
+	extent_t ext[EXTENTS_PER_BLOCK + 1], old[EXTENTS_PER_BLOCK];
+	int count = extent_load(inode, ext), old_count = count;
+	if (count < 0)
+		return -1;
+	memcpy(old, ext, count * sizeof(extent_t));
+	if (extent_punch(ext, &count, logical, length & ~EXTENT_UNWRITTEN) != 0 || extent_insert(ext, &count, logical, physical, length) != 0 || extent_store(inode, ext, count) != 0)
+		return -1;
+	/* the old blocks are freed once nothing maps them. a failure above leaves them mapped and allocated */
+	extent_free_range(old, old_count, logical, length & ~EXTENT_UNWRITTEN);
+	return 0;
+}
+
+/* unwritten blocks in [logical, logical + length) become written. they keep their physical blocks */
+int extent_written(inode_t *inode, block_no_t logical, u_int32_t length)
+{
+	extent_t ext[EXTENTS_PER_BLOCK + 2];
+	int count = extent_load(inode, ext);
+	if (count < 0)
+		return -1;
+	block_no_t cur = logical, end = logical + length;
+	while (cur < end)
+	{
+		int i = extent_search(ext, count, cur);
+		if (i < 0 || cur - ext[i].logical >= EXTENT_LEN(ext[i]))
+		{
+			/* hole. go on from the next extent */
+			if (i + 1 >= count)
+				break;
+			cur = ext[i + 1].logical;
+			continue;
+		}
+		block_no_t stop = ext[i].logical + EXTENT_LEN(ext[i]) < end ? ext[i].logical + EXTENT_LEN(ext[i]) : end;
+		if (EXTENT_IS_UNWRITTEN(ext[i]))
+		{
+			block_no_t physical = ext[i].physical + (cur - ext[i].logical);
+			if (extent_punch(ext, &count, cur, stop - cur) != 0 || extent_insert(ext, &count, cur, physical, stop - cur) != 0)
+				return -1;
+			for (block_no_t b = cur; b < stop; b++)
+				bmcache_update(inode, b, physical + (b - cur)); /* reads see the block from now on */
+		}
+		cur = stop;
+	}
+	return extent_store(inode, ext, count);
+}
+
+/* switches a regular file that has no blocks yet to extent mapping. fails if it has blocks */
+int extent_enable(inode_t *inode)
+{
+	if (INO_USES_EXTENTS(inode))
+		return 0;
+	if (inode->disk_inode.type != FT_FIL || inode->disk_inode.size_on_disk != 0)
+		return -1;
+	bmcache_invalidate(inode);
+	memset(&(inode->disk_inode.index), 0, sizeof(inode->disk_inode.index));
+	inode->disk_inode.flags |= INODE_FL_EXTENTS;
+	INO_SET_FIELD(inode, INODE_MODIFIED);
+	return 0;
+}
+
+/* frees every block mapped by the inode, and its extent block */
+int extent_free_all(inode_t *inode)
+{
+	extent_t ext[EXTENTS_PER_BLOCK];
+	int count = extent_load(inode, ext);
+	if (count < 0)
+		return -1;
+	for (int i = 0; i < count; i++)
+		bfree_range(ext[i].physical, EXTENT_LEN(ext[i]));
+	if (inode->disk_inode.index.extents.depth != 0)
+		bfree(inode->disk_inode.index.extents.tree);
+	memset(&(inode->disk_inode.index), 0, sizeof(inode->disk_inode.index));
+	INO_SET_FIELD(inode, INODE_MODIFIED);
+	return 0;
+}
@@ -1,13 +1,175 @@
 #include "filecontrol.h"
 #include "inode.h"
 #include "buffer_cache.h"
+#include "journal.h"
+#include "disk.h"
 #include <stdarg.h>
 
-#define MAX_OPEN_FILES 10
+/* open files. an fd names an open file; several fds can share one (see mydup) and with it the offset.
+ * both tables grow by chunks that are never freed, so a slot reached through a stale pointer is still valid memory.
+ * a chunk's free slots are found in its bitmap and claimed with a compare and swap, so no lock is shared by all opens. */
+typedef struct
+{
+	u_int64_t used[FD_CHUNK_SIZE / 64]; /* bit set if the slot is taken */
+	u_int32_t free;						/* slots not taken */
+} slot_map_t;
 
-open_file_info_t file_table[MAX_OPEN_FILES];
+typedef struct
+{
+	slot_map_t map;
+	open_file_info_t *file[FD_CHUNK_SIZE];
+} fd_chunk_t;
 
-int myopen(const char *filename, int mode, ...)
+typedef struct
+{
+	slot_map_t map;
+	open_file_info_t file[FD_CHUNK_SIZE];
+} file_chunk_t;
+
+fd_chunk_t *fd_table[FD_CHUNKS];
+file_chunk_t *file_table[FD_CHUNKS];
+
+/* chunk c of the fd table. it is made on first use */
+static slot_map_t *fd_chunk(int c)
+{
+	fd_chunk_t *chunk = __atomic_load_n(fd_table + c, __ATOMIC_ACQUIRE), *fresh;
+	if (chunk != NULL || (fresh = calloc(1, sizeof(fd_chunk_t))) == NULL)
+		return (slot_map_t *)chunk;
+	fresh->map.free = FD_CHUNK_SIZE;
+	if (__atomic_compare_exchange_n(fd_table + c, &chunk, fresh, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+		return (slot_map_t *)fresh;
+	free(fresh); /* another thread made it */
+	return (slot_map_t *)chunk;
+}
+
+static slot_map_t *file_chunk(int c)
+{
+	file_chunk_t *chunk = __atomic_load_n(file_table + c, __ATOMIC_ACQUIRE), *fresh;
+	if (chunk != NULL || (fresh = calloc(1, sizeof(file_chunk_t))) == NULL)
+		return (slot_map_t *)chunk;
+	fresh->map.free = FD_CHUNK_SIZE;
+	for (int i = 0; i < FD_CHUNK_SIZE; i++)
+		pthread_mutex_init(&fresh->file[i].pos_lock, NULL);
+	if (__atomic_compare_exchange_n(file_table + c, &chunk, fresh, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+		return (slot_map_t *)fresh;
+	free(fresh);
+	return (slot_map_t *)chunk;
+}
+
+/* claims the lowest free slot of a table. full chunks are skipped by their count, a chunk is searched a word at a time.
+ * returns the slot number, or -1 if the table is full */
+static int slot_claim(slot_map_t *(*chunk)(int))
+{
+	for (int c = 0; c < FD_CHUNKS; c++)
+	{
+		slot_map_t *map = chunk(c);
+		if (map == NULL)
+			return -1;
+		if (__atomic_load_n(&map->free, __ATOMIC_RELAXED) == 0)
+			continue;
+		for (int w = 0; w < FD_CHUNK_SIZE / 64; w++)
+		{
+			u_int64_t word = __atomic_load_n(map->used + w, __ATOMIC_ACQUIRE);
+			while (~word != 0)
+			{
+				int bit = __builtin_ctzll(~word);
+				if (__atomic_compare_exchange_n(map->used + w, &word, word | (u_int64_t)1 << bit, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+				{
+					__atomic_fetch_sub(&map->free, 1, __ATOMIC_RELAXED);
+					return c * FD_CHUNK_SIZE + w * 64 + bit;
+				}
+			}
+		}
+	}
+	return -1;
+}
+
+static void slot_release(slot_map_t *map, int slot)
+{
+	slot %= FD_CHUNK_SIZE;
+	__atomic_fetch_and(map->used + slot / 64, ~((u_int64_t)1 << slot % 64), __ATOMIC_RELEASE);
+	__atomic_fetch_add(&map->free, 1, __ATOMIC_RELAXED);
+}
+
+static open_file_info_t **fd_slot(int fd)
+{
+	if (fd < 0 || fd >= MAX_OPEN_FILES)
+		return NULL;
+	fd_chunk_t *chunk = __atomic_load_n(fd_table + fd / FD_CHUNK_SIZE, __ATOMIC_ACQUIRE);
+	return chunk == NULL ? NULL : chunk->file + fd % FD_CHUNK_SIZE;
+}
+
+/* gives an unused open file with one reference */
+static open_file_info_t *file_alloc()
+{
+	int i = slot_claim(file_chunk);
+	if (i < 0)
+		return NULL;
+	open_file_info_t *file = __atomic_load_n(file_table + i / FD_CHUNK_SIZE, __ATOMIC_ACQUIRE)->file + i % FD_CHUNK_SIZE;
+	file->offset = 0;
+	file->ra_next = 0;
+	file->ra_end = 0;
+	file->ra_window = 0;
+	__atomic_store_n(&file->refs, 1, __ATOMIC_RELEASE);
+	return file;
+}
+
+/* drops a reference to an open file. the last one closes it */
+static void fput(open_file_info_t *file)
+{
+	if (__atomic_sub_fetch(&file->refs, 1, __ATOMIC_ACQ_REL) != 0)
+		return;
+	if (file->inode != NULL)
+		iput(file->inode);
+	file->inode = NULL;
+	file->mode = M_DEFAULT_MODE;
+	for (int c = 0; c < FD_CHUNKS; c++)
+	{
+		file_chunk_t *chunk = __atomic_load_n(file_table + c, __ATOMIC_ACQUIRE);
+		if (chunk == NULL)
+			break;
+		if (file >= chunk->file && file < chunk->file + FD_CHUNK_SIZE)
+		{
+			slot_release(&chunk->map, file - chunk->file);
+			return;
+		}
+	}
+}
+
+/* gives the open file of an fd with a reference taken, or NULL if the fd is not open.
+ * the reference is taken only while the open file is in use, and the fd is checked again after it, so a close
+ * racing with the lookup is seen */
+static open_file_info_t *fget(int fd)
+{
+	open_file_info_t **slot = fd_slot(fd);
+	open_file_info_t *file = slot == NULL ? NULL : __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+	if (file == NULL)
+		return NULL;
+	u_int32_t refs = __atomic_load_n(&file->refs, __ATOMIC_ACQUIRE);
+	do
+	{
+		if (refs == 0)
+			return NULL;
+	} while (!__atomic_compare_exchange_n(&file->refs, &refs, refs + 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+	if (__atomic_load_n(slot, __ATOMIC_ACQUIRE) != file)
+	{
+		fput(file); /* closed meanwhile. the open file may already serve another fd */
+		return NULL;
+	}
+	return file;
+}
+
+/* gives the lowest free fd to an open file. the caller's reference goes with it */
+static int fd_install(open_file_info_t *file)
+{
+	int fd = slot_claim(fd_chunk);
+	if (fd < 0)
+		return -1;
+	__atomic_store_n(fd_slot(fd), file, __ATOMIC_RELEASE);
+	return fd;
+}
+
+static int file_open(const char *filename, int mode, permission_t perm)
 {
 	inode_t *inode = NULL;
 	if (namei(filename, &inode) != 0)
@@ -15,10 +177,6 @@ int myopen(const char *filename, int mode, ...)
 		/* file does not exist. if M_CREAT is given, try to create the file */
 		if (IS_SET(mode, M_CREAT))
 		{
-			va_list l;
-			va_start(l, mode);
-			permission_t perm = va_arg(l, permission_t);
-			va_end(l);
 			if (mycreat(filename, perm) != 0)
 			{
 				/* 				perror("open: failed to create file\n"); */
@@ -36,49 +194,70 @@ int myopen(const char *filename, int mode, ...)
 			return -1;
 		}
 	}
-	int fd;
-	for (fd = 0; fd < MAX_OPEN_FILES; fd++)
-	{
-		if (IS_SET(file_table->mode, S_OPEN))
-			continue;
-		break;
-	}
-	if (fd == MAX_OPEN_FILES)
+	open_file_info_t *file = file_alloc();
+	if (file == NULL)
 	{
-		/* 		perror("open: no free file descriptor\n"); */
+		/* 		perror("open: too many open files\n"); */
 		iput(inode);
 		return -1;
 	}
-	file_table[fd].inode = inode;
-	file_table[fd].mode = M_DEFAULT_MODE | S_OPEN;
+	file->inode = inode;
+	file->mode = M_DEFAULT_MODE | S_OPEN;
 	if (IS_SET(mode, M_RD))
-		file_table[fd].mode |= M_RD;
+		file->mode |= M_RD;
 	if (IS_SET(mode, M_WR))
 	{
-		file_table[fd].mode |= M_WR;
+		file->mode |= M_WR;
+		ilock(inode);
 		if (IS_SET(mode, M_TRUNC))
+		{
 			free_all_blocks(inode);
+			inode->disk_inode.size = 0;
+			INO_SET_FIELD(inode, INODE_MODIFIED);
+		}
+		if (IS_SET(mode, M_EXTENTS))
+			extent_enable(inode); /* only a file with no blocks yet can switch */
+		iunlock(inode);
 	}
 	if (IS_SET(mode, M_APP))
-		file_table[fd].mode |= M_APP;
-	file_table[fd].offset = 0;
-	INO_REM_FIELD(inode, INODE_LOCKED);
+		file->mode |= M_APP;
+	if (IS_SET(mode, M_DIRECT))
+		file->mode |= M_DIRECT;
+	int fd = fd_install(file);
+	if (fd < 0)
+	{
+		/* 		perror("open: no free file descriptor\n"); */
+		fput(file);
+		return -1;
+	}
 	return fd;
 }
 
-offset_t mylseek(int fd, offset_t relative_offset, int whence)
+int myopen(const char *filename, int mode, ...)
 {
-	if (fd < 0 || fd >= MAX_OPEN_FILES || (file_table[fd].mode & S_OPEN) == 0)
+	permission_t perm = {.permissions = 0};
+	if (IS_SET(mode, M_CREAT))
 	{
-		perror("lseek: bad fd\n");
-		return -1;
+		va_list l;
+		va_start(l, mode);
+		perm = va_arg(l, permission_t);
+		va_end(l);
 	}
-	inode_t *inode = file_table[fd].inode;
-	INO_SET_FIELD(inode, INODE_LOCKED);
+	jbegin();
+	int fd = file_open(filename, mode, perm);
+	jend();
+	return fd;
+}
+
+/* moves the offset of an open file. its pos_lock is held */
+static offset_t file_seek(open_file_info_t *file, offset_t relative_offset, int whence)
+{
+	inode_t *inode = file->inode;
+	ilock_shared(inode);
 	switch (whence)
 	{
 	case WH_CUR:
-		relative_offset += file_table[fd].offset;
+		relative_offset += file->offset;
 		break;
 	case WH_END:
 		relative_offset += inode->disk_inode.size;
@@ -87,55 +266,89 @@ offset_t mylseek(int fd, offset_t relative_offset, int whence)
 	default:
 		break;
 	}
-	INO_REM_FIELD(inode, INODE_LOCKED);
-	if (relative_offset < 0 || relative_offset >= MAX_FILE_SIZE)
+	iunlock(inode);
+	if (relative_offset < 0 || relative_offset >= INODE_MAX_SIZE(inode))
 	{
 		// ! final position is more than myfs allows or before the beginning
 		perror("lseek: bad position seeked\n");
 		return -1;
 	}
-	file_table[fd].offset = relative_offset;
+	file->offset = relative_offset;
 	return relative_offset;
 }
+
+offset_t mylseek(int fd, offset_t relative_offset, int whence)
+{
+	open_file_info_t *file = fget(fd);
+	if (file == NULL)
+	{
+		perror("lseek: bad fd\n");
+		return -1;
+	}
+	pthread_mutex_lock(&file->pos_lock);
+	offset_t offset = file_seek(file, relative_offset, whence);
+	pthread_mutex_unlock(&file->pos_lock);
+	fput(file);
+	return offset;
+}
+
 int myclose(int fd)
 {
-	if (fd < 0 || fd >= MAX_OPEN_FILES || (file_table[fd].mode & S_OPEN) == 0)
+	open_file_info_t **slot = fd_slot(fd);
+	open_file_info_t *file = slot == NULL ? NULL : __atomic_exchange_n(slot, NULL, __ATOMIC_ACQ_REL);
+	if (file == NULL)
 	{
 		perror("close: bad fd\n");
 		return -1;
 	}
-	inode_t *inode = file_table[fd].inode;
-	INO_SET_FIELD(inode, INODE_LOCKED);
+	slot_release(&fd_table[fd / FD_CHUNK_SIZE]->map, fd);
 	/*
 		todo: check changes in inode before closing. (like access time, modified time etc.)
 	*/
-	iput(inode);
-	file_table[fd].inode = NULL;
-	file_table[fd].mode = M_DEFAULT_MODE;
-	file_table[fd].offset = -1;
+	jbegin(); /* the last close of an unlinked file frees it */
+	fput(file);
+	jend();
 	return 0;
 }
-int mycreat(const char *path, permission_t perm)
+
+/* gives another fd for the open file of fd. both share the offset */
+int mydup(int fd)
+{
+	open_file_info_t *file = fget(fd);
+	if (file == NULL)
+		return -1;
+	int new_fd = fd_install(file);
+	if (new_fd < 0)
+		fput(file);
+	return new_fd;
+}
+
+static int file_create(const char *path, permission_t perm)
 {
 	char dir_path[100];
-	dir_path[0] = 0;
+	int l = strlen(path);
+	if (l + 2 > (int)sizeof(dir_path))
+	{
+		perror("creat: very long path\n");
+		return -1;
+	}
+	dir_path[0] = 0; /* stops the backward scan for the last '/' */
 	strcpy(dir_path + 1, path);
-	int l = strlen(dir_path);
-	char *filename = dir_path + l - 1;
-	while (*filename != '/' || *filename != 0)
+	char *filename = dir_path + l;
+	while (*filename != '/' && *filename != 0)
 		filename--;
-	int fnamelen = dir_path + l - filename;
+	int fnamelen = dir_path + l - filename; /* name is after the '/' or the leading 0 */
 	if (fnamelen <= 0)
 	{
 		return -1;
 	}
-	if (fnamelen > MAX_FILE_NAME_SIZE)
+	if (fnamelen > (int)sizeof(((dir_entry_t *)0)->name))
 	{
 		perror("creat: very long filename\n");
 		return -1;
 	}
 	inode_t *dir;
-	if (*filename == 0)
+	if (*filename == 0 || filename == dir_path + 1)
 	{
 		if (namei("/", &dir) != 0)
 		{
@@ -151,126 +364,425 @@ int mycreat(const char *path, permission_t perm)
 		}
 	}
 	inode_t *fil_inode;
-	if (ialloc(&fil_inode) != 0)
+	if (ialloc_near(dir->inode_no, &fil_inode) != 0)
 	{
 		iput(dir);
 		return -1;
 	}
 	dir_entry_t dir_entry = {.inode_no = fil_inode->inode_no, .type = FT_FIL};
-	memset(dir_entry.name, 0, MAX_FILE_NAME_SIZE);
-	memcpy(dir_entry.name, filename, fnamelen);
-	add_dir_entry(dir, dir_entry);
-	/*
-		todo: set entries of inode for new file
-	*/
-	fil_inode->disk_inode.links++;
+	memset(dir_entry.name, 0, sizeof(dir_entry.name));
+	memcpy(dir_entry.name, filename + 1, fnamelen);
+	ilock(fil_inode);
 	fil_inode->disk_inode.permission = perm;
 	fil_inode->disk_inode.type = FT_FIL;
 	INO_SET_FIELD(fil_inode, INODE_MODIFIED);
+	iunlock(fil_inode);
+	if (add_dir_entry(dir, dir_entry) != 0)
+	{
+		iput(fil_inode); /* it has no links, so this frees it */
+		iput(dir);
+		return -1;
+	}
+	ilock(fil_inode);
+	fil_inode->disk_inode.links++;
+	INO_SET_FIELD(fil_inode, INODE_MODIFIED);
+	iunlock(fil_inode);
 	iput(fil_inode);
+	iput(dir);
 	return 0;
 }
 
+int mycreat(const char *path, permission_t perm)
+{
+	jbegin();
+	int ret = file_create(path, perm);
+	jend();
+	return ret;
+}
+
+/* prefetches logical blocks [from, to) of a file. the cache reads physically contiguous blocks together
+ * and submits the reads of a whole batch at once. */
+static void prefetch_blocks(inode_t *inode, block_no_t from, block_no_t to)
+{
+	block_no_t block_nos[BUFF_MAX_RUN], physical;
+	u_int32_t run;
+	int n = 0;
+	for (block_no_t i = from; i < to; i += run)
+	{
+		if (bmap_run(inode, i, &physical, &run) != 0 || run == 0)
+			break;
+		if (run > to - i)
+			run = to - i;
+		for (u_int32_t j = 0; physical != 0 && j < run; j++) /* holes are skipped */
+		{
+			block_nos[n] = physical + j;
+			if (++n == BUFF_MAX_RUN)
+			{
+				bprefetchv(block_nos, n);
+				n = 0;
+			}
+		}
+	}
+	bprefetchv(block_nos, n);
+}
+
+/* detects sequential reads on an open file and keeps an adaptive window of blocks read ahead of it */
+static void file_readahead(open_file_info_t *file, offset_t offset, size_t n)
+{
+	inode_t *inode = file->inode;
+	offset_t fsz = inode->disk_inode.size;
+	if (n == 0 || offset >= fsz || IS_SET(file->mode, M_DIRECT))
+		return;
+	if (offset + (offset_t)n > fsz)
+		n = fsz - offset;
+	block_no_t first = offset / MY_BLK_SIZE, last = (offset + n - 1) / MY_BLK_SIZE;
+	block_no_t eof_block = (fsz - 1) / MY_BLK_SIZE + 1;
+	if (offset != file->ra_next)
+	{
+		/* random access. drop the window but still read the requested span in one go */
+		file->ra_window = 0;
+		file->ra_end = 0;
+		file->ra_next = offset + n;
+		if (last > first)
+			prefetch_blocks(inode, first, last + 1);
+		return;
+	}
+	file->ra_next = offset + n;
+	if (file->ra_window == 0)
+		file->ra_window = RA_MIN_WINDOW;
+	else if (last + file->ra_window / 2 < file->ra_end)
+		return; /* enough blocks are still ahead of the reader */
+	else if (file->ra_window < RA_MAX_WINDOW)
+		file->ra_window *= 2; /* stream continues. grow the window */
+	block_no_t from = file->ra_end > first ? file->ra_end : first;
+	block_no_t to = last + 1 + file->ra_window;
+	if (to > eof_block)
+		to = eof_block;
+	if (from < to)
+		prefetch_blocks(inode, from, to);
+	file->ra_end = to;
+}
+
+/* moves whole logical blocks [first, first + count) of a file between buf and the disk, bypassing the buffer cache.
+ * blocks missing from the file are zero-filled on read and allocated on write. physically contiguous
+ * blocks are moved with one transfer, and the transfers of a batch are submitted together.
+ * the inode has no delayed blocks: they are not on disk yet. returns number of blocks moved. */
+static u_int32_t direct_io(inode_t *inode, block_no_t first, u_int32_t count, byte_t *buf, int write)
+{
+	block_t *blocks[DIRECT_BATCH];
+	block_no_t block_nos[DIRECT_BATCH];
+	int len[DIRECT_BATCH], done[DIRECT_BATCH];
+	u_int32_t moved = 0;
+	while (moved < count)
+	{
+		int n = count - moved < DIRECT_BATCH ? count - moved : DIRECT_BATCH, mapped;
+		for (mapped = 0; mapped < n;)
+		{
+			block_no_t logical_block_no = first + moved + mapped, physical;
+			u_int32_t run;
+			if (bmap_run(inode, logical_block_no, &physical, &run) != 0 || run == 0)
+				break;
+			if (run > (u_int32_t)(n - mapped))
+				run = n - mapped;
+			if (physical == 0 && write && INO_USES_EXTENTS(inode))
+			{
+				/* unwritten blocks look like a hole. preallocated blocks only change state */
+				int unwritten = extent_lookup(inode, logical_block_no, &physical, &run);
+				if (unwritten < 0)
+					break;
+				if (run > (u_int32_t)(n - mapped))
+					run = n - mapped;
+				if (unwritten && extent_written(inode, logical_block_no, run) != 0)
+					break;
+			}
+			if (physical == 0 && write)
+			{
+				/* fill the hole with one contiguous run. direct writes need no buffers for it */
+				int got = balloc_range(alloc_goal(inode, logical_block_no), 1, run, &physical);
+				if (got <= 0)
+					break;
+				run = got;
+				inode->disk_inode.size_on_disk += (offset_t)run * MY_BLK_SIZE;
+				INO_SET_FIELD(inode, INODE_MODIFIED);
+				for (u_int32_t i = 0; i < run; i++)
+					add_physical_block(inode, logical_block_no + i, physical + i);
+			}
+			/* a hole on read is filled with zeros below */
+			for (u_int32_t i = 0; i < run; i++, mapped++)
+			{
+				blocks[mapped] = (block_t *)(buf + (offset_t)(moved + mapped) * MY_BLK_SIZE);
+				block_nos[mapped] = physical == 0 ? 0 : physical + i;
+			}
+		}
+		for (int i = 0; i < mapped; i += len[i] ? len[i] : 1)
+		{
+			done[i] = 0;
+			if (block_nos[i] == 0)
+			{
+				memset(blocks[i], 0, MY_BLK_SIZE);
+				len[i] = 0;
+				done[i] = 1;
+				continue;
+			}
+			for (len[i] = 1; i + len[i] < mapped && block_nos[i + len[i]] == block_nos[i] + len[i]; len[i]++)
+				;
+			/* cached copies must not disagree with the disk */
+			if (write)
+				binvalidate(block_nos[i], len[i]);
+			else
+				bflushrange(block_nos[i], len[i]);
+			disk_queue(disk_fd, block_nos[i], blocks + i, len[i], write, done + i);
+		}
+		disk_wait_all();
+		for (int i = 0; i < mapped; i += len[i] ? len[i] : 1)
+		{
+			moved += done[i];
+			if (done[i] < (len[i] ? len[i] : 1))
+				return moved;
+		}
+		if (mapped < n)
+			break;
+	}
+	return moved;
+}
+
+static ssize_t cached_read(open_file_info_t *file, byte_t *dst, size_t n);
+static ssize_t cached_write(open_file_info_t *file, byte_t *src, size_t n);
+
+/* reads block aligned part of the request straight from disk. unaligned head and tail go through the cache */
+static ssize_t direct_read(open_file_info_t *file, byte_t *dst, size_t n)
+{
+	inode_t *inode = file->inode;
+	offset_t fsz = inode->disk_inode.size;
+	if (file->offset >= fsz)
+		return 0;
+	if (n > (size_t)(fsz - file->offset))
+		n = fsz - file->offset;
+	size_t head = (MY_BLK_SIZE - file->offset % MY_BLK_SIZE) % MY_BLK_SIZE, read = 0;
+	if (head > n)
+		head = n;
+	u_int32_t body = (n - head) / MY_BLK_SIZE;
+	if (head > 0 && (read = cached_read(file, dst, head)) != head)
+		return read;
+	if (body > 0)
+	{
+		if (inode->num_delayed > 0)
+		{
+			/* blocks reached without the cache need their physical blocks */
+			ilock(inode);
+			dalloc_inode(inode);
+			iunlock(inode);
+		}
+		ilock_shared(inode);
+		u_int32_t moved = direct_io(inode, file->offset / MY_BLK_SIZE, body, dst + read, 0);
+		iunlock(inode);
+		file->offset += (offset_t)moved * MY_BLK_SIZE;
+		read += (size_t)moved * MY_BLK_SIZE;
+		if (moved < body)
+			return read;
+	}
+	if (read < n)
+	{
+		ssize_t r = cached_read(file, dst + read, n - read);
+		if (r > 0)
+			read += r;
+	}
+	return read;
+}
+
+/* writes block aligned part of the request straight to disk. unaligned head and tail go through the cache */
+static ssize_t direct_write(open_file_info_t *file, byte_t *src, size_t n)
+{
+	inode_t *inode = file->inode;
+	if (file->offset + n > INODE_MAX_SIZE(inode))
+		n = INODE_MAX_SIZE(inode) - file->offset;
+	size_t head = (MY_BLK_SIZE - file->offset % MY_BLK_SIZE) % MY_BLK_SIZE, written = 0;
+	if (head > n)
+		head = n;
+	u_int32_t body = (n - head) / MY_BLK_SIZE;
+	if (head > 0 && (written = cached_write(file, src, head)) != head)
+		return written;
+	if (body > 0)
+	{
+		ilock(inode);
+		dalloc_inode(inode); /* blocks reached without the cache need their physical blocks */
+		u_int32_t moved = direct_io(inode, file->offset / MY_BLK_SIZE, body, src + written, 1);
+		file->offset += (offset_t)moved * MY_BLK_SIZE;
+		written += (size_t)moved * MY_BLK_SIZE;
+		if (file->offset > inode->disk_inode.size)
+		{
+			inode->disk_inode.size = file->offset;
+			INO_SET_FIELD(inode, INODE_MODIFIED);
+		}
+		iunlock(inode);
+		if (moved < body)
+			return written;
+	}
+	if (written < n)
+	{
+		ssize_t w = cached_write(file, src + written, n - written);
+		if (w > 0)
+			written += w;
+	}
+	return written;
+}
+
 ssize_t myread(int fd, byte_t *dst, size_t n)
 {
-	if (fd < 0 || fd >= MAX_OPEN_FILES || (file_table[fd].mode & S_OPEN) == 0)
+	open_file_info_t *file = fget(fd);
+	if (file == NULL)
 	{
 		perror("read: bad file descriptor\n");
 		return -1;
 	}
-	if (!IS_SET(file_table[fd].mode, M_RD))
+	if (!IS_SET(file->mode, M_RD))
 	{
 		// ! no permission to read
+		fput(file);
 		return -1;
 	}
-	inode_t *inode = file_table[fd].inode;
-	offset_t byte_offset, offset = file_table[fd].offset;
+	ssize_t read;
+	pthread_mutex_lock(&file->pos_lock); /* reads sharing the open file take turns with its offset */
+	if (IS_SET(file->mode, M_DIRECT))
+		read = direct_read(file, dst, n);
+	else
+		read = cached_read(file, dst, n);
+	pthread_mutex_unlock(&file->pos_lock);
+	fput(file);
+	return read;
+}
+
+/* copies n bytes from byte_offset of a block. a hole (block 0), or a block allocated but never written, reads as zeros */
+static int copy_block(block_no_t block_no, offset_t byte_offset, byte_t *dst, size_t n)
+{
+	buffer_t buffer;
+	if (block_no == 0)
+	{
+		memset(dst, 0, n);
+		return 0;
+	}
+	if (bread(block_no, &buffer) != 0)
+		return -1;
+	memcpy(dst, buffer.data->b + byte_offset, n);
+	brelse(&buffer);
+	return 0;
+}
+
+static ssize_t cached_read(open_file_info_t *file, byte_t *dst, size_t n)
+{
+	inode_t *inode = file->inode;
+	offset_t byte_offset, offset = file->offset;
 	size_t bytes_in_block, read = 0;
 	block_no_t block_no;
-	buffer_t buffer;
-	INO_SET_FIELD(inode, INODE_LOCKED);
+	ilock_shared(inode); /* readers of a file do not wait for each other */
+	file_readahead(file, offset, n);
 	do
 	{
 		if (bmap(inode, offset, &block_no, &byte_offset, &bytes_in_block) != 0)
 		{
-			INO_REM_FIELD(inode, INODE_LOCKED);
+			iunlock(inode);
 			if (read > 0)
 			{
-				file_table[fd].offset += read;
+				file->offset += read;
 				return read;
 			}
 			return -1;
 		}
+		if (bytes_in_block == 0)
+		{
+			/* end of file reached */
+			iunlock(inode);
+			file->offset += read;
+			return read;
+		}
 		if (n <= bytes_in_block)
 		{
-			if (bread(block_no, &buffer) != 0)
+			if (copy_block(block_no, byte_offset, dst + read, n) != 0)
 			{
-				INO_REM_FIELD(inode, INODE_LOCKED);
+				iunlock(inode);
 				if (read > 0)
 				{
-					file_table[fd].offset += read;
+					file->offset += read;
 					return read;
 				}
 				perror("read: cannot read block\n");
 				return -1;
 			}
-			memcpy(dst + read, buffer.data->b + byte_offset, n);
 			read += n;
 			n = 0;
-			brelse(&buffer);
-			INO_REM_FIELD(inode, INODE_LOCKED);
-			file_table[fd].offset += read;
+			iunlock(inode);
+			file->offset += read;
 			return read;
 		}
-		if (bread(block_no, &buffer) != 0)
+		if (copy_block(block_no, byte_offset, dst + read, bytes_in_block) != 0)
 		{
-			INO_REM_FIELD(inode, INODE_LOCKED);
+			iunlock(inode);
 			if (read > 0)
 			{
-				file_table[fd].offset += read;
+				file->offset += read;
 				return read;
 			}
 			perror("read: cannot read block\n");
 			return -1;
 		}
-		memcpy(dst + read, buffer.data->b + byte_offset, bytes_in_block);
 		read += bytes_in_block;
+		offset += bytes_in_block;
 		n -= bytes_in_block;
-		brelse(&buffer);
 
 	} while (n > 0);
 	return -1;
 }
 ssize_t mywrite(int fd, byte_t *src, size_t n)
 {
-	if (fd < 0 || fd >= MAX_OPEN_FILES || (file_table[fd].mode & S_OPEN) == 0)
+	open_file_info_t *file = fget(fd);
+	if (file == NULL)
 	{
-		perror("read: bad file descriptor\n");
+		perror("write: bad file descriptor\n");
 		return -1;
 	}
-	if (!IS_SET(file_table[fd].mode, M_WR))
+	if (!IS_SET(file->mode, M_WR))
 	{
 		// ! no permission to write
+		fput(file);
 		return -1;
 	}
-	if (IS_SET(file_table[fd].mode, M_APP))
+	inode_t *inode = file->inode;
+	ssize_t written;
+	jbegin();
+	pthread_mutex_lock(&file->pos_lock);
+	if (IS_SET(file->mode, M_APP))
 	{
-		/* move offset to end for each write operation in append mode */
-		mylseek(fd, 0, WH_END);
+		/* move offset to end for each write operation in append mode. nothing may grow the file in between */
+		ilock(inode);
+		file_seek(file, 0, WH_END);
 	}
-	inode_t *inode = file_table[fd].inode;
-	offset_t byte_offset, offset = file_table[fd].offset;
+	if (IS_SET(file->mode, M_DIRECT))
+		written = direct_write(file, src, n);
+	else
+		written = cached_write(file, src, n);
+	if (IS_SET(file->mode, M_APP))
+		iunlock(inode);
+	pthread_mutex_unlock(&file->pos_lock);
+	fput(file);
+	jend();
+	return written;
+}
+
+static ssize_t cached_write(open_file_info_t *file, byte_t *src, size_t n)
+{
+	inode_t *inode = file->inode;
+	offset_t byte_offset, offset = file->offset;
 	size_t bytes_in_block, written = 0;
 	block_no_t block_no;
 	buffer_t buffer;
-	INO_SET_FIELD(inode, INODE_LOCKED);
-	if (offset + n > MAX_FILE_SIZE)
+	ilock(inode);
+	if (offset + n > INODE_MAX_SIZE(inode))
 	{
-		n = MAX_FILE_SIZE - offset;
+		n = INODE_MAX_SIZE(inode) - offset;
 	}
 	if (n == 0)
 	{
-		INO_REM_FIELD(inode, INODE_LOCKED);
+		iunlock(inode);
 		return 0;
 	}
 	while (n > 0)
@@ -278,12 +790,15 @@ ssize_t mywrite(int fd, byte_t *src, size_t n)
 		if (bmap(inode, offset, &block_no, &byte_offset, &bytes_in_block) != 0)
 		{
 			if (written == 0)
+			{
+				iunlock(inode);
 				return -1;
+			}
 			break;
 		}
 		offset_t remaining = MY_BLK_SIZE - byte_offset;
 		size_t to_write;
-		if (n <= remaining)
+		if (n <= (size_t)remaining)
 		{
 			to_write = n;
 		}
@@ -291,7 +806,15 @@ ssize_t mywrite(int fd, byte_t *src, size_t n)
 		{
 			to_write = remaining;
 		}
-		if (block_no == 0)
+		block_no_t unwritten;
+		u_int32_t run;
+		if (block_no == 0 && INO_USES_EXTENTS(inode) && extent_lookup(inode, offset / MY_BLK_SIZE, &unwritten, &run) == 1)
+		{
+			/* block was preallocated. it holds zeros until written, its old content is never read */
+			if (extent_written(inode, offset / MY_BLK_SIZE, 1) != 0 || bnew(unwritten, &buffer) != 0)
+				break;
+		}
+		else if (block_no == 0)
 		{
 			/*
 			 *	cases:
@@ -299,6 +822,9 @@ ssize_t mywrite(int fd, byte_t *src, size_t n)
 			 *	2) the offset is out of the file
 			 *
 			 */
+			/* delayed allocation: the physical block is picked at writeback, together with its neighbours */
+			if (dalloc_block(inode, offset / MY_BLK_SIZE, &buffer) != 0)
+				break;
 			if (offset >= inode->disk_inode.size_on_disk)
 			{
 				/* in this case, the file has to be extended */
@@ -306,7 +832,6 @@ ssize_t mywrite(int fd, byte_t *src, size_t n)
 			}
 			inode->disk_inode.size_on_disk += MY_BLK_SIZE;
 			INO_SET_FIELD(inode, INODE_MODIFIED);
-			balloc(&buffer);
 		}
 		else
 			bread(block_no, &buffer);
@@ -315,22 +840,139 @@ ssize_t mywrite(int fd, byte_t *src, size_t n)
 		 * 1) write can be completed within this block
 		 * 2) we use whole block but write cannot be completed
 		 */
-		if (offset + to_write > inode->disk_inode.size) /* if write goes beyond file, increase file size */
+		if (offset + (offset_t)to_write > inode->disk_inode.size) /* if write goes beyond file, increase file size */
 			inode->disk_inode.size = offset + to_write;
 		memcpy(buffer.data->b + byte_offset, src + written, to_write);
 		written += to_write;
 		offset += to_write;
 		n -= to_write;
 		BUFF_SET_FIELD(buffer, BUFF_MODIFIED);
-		block_no_t physical_block_no = buffer.header->block_no;
 		brelse(&buffer);
-		if (block_no == 0)
+	}
+	file->offset += written;
+	iunlock(inode);
+	return written;
+}
+/* allocates the blocks of [offset, offset + len) of a file up front, as few contiguous runs as free space allows.
+ * an extent mapped file (or one with no blocks yet, which is switched to extents) gets them unwritten: they read
+ * as zeros without any disk access until written. a file with index blocks gets zero filled blocks instead.
+ * the size grows to cover the range unless FA_KEEP_SIZE is given. */
+static int file_fallocate(int fd, offset_t offset, offset_t len, int flags)
+{
+	open_file_info_t *file = fget(fd);
+	if (file == NULL || !IS_SET(file->mode, M_WR))
+	{
+		perror("fallocate: bad file descriptor\n");
+		if (file != NULL)
+			fput(file);
+		return -1;
+	}
+	inode_t *inode = file->inode;
+	ilock(inode);
+	extent_enable(inode);
+	if (offset < 0 || len <= 0 || offset + len > INODE_MAX_SIZE(inode))
+	{
+		iunlock(inode);
+		fput(file);
+		return -1;
+	}
+	dalloc_inode(inode);
+	block_no_t physical, last = (offset + len - 1) / MY_BLK_SIZE;
+	u_int32_t run;
+	int ret = 0;
+	for (block_no_t logical_block_no = offset / MY_BLK_SIZE; logical_block_no <= last; logical_block_no += run)
+	{
+		int unwritten = INO_USES_EXTENTS(inode) ? extent_lookup(inode, logical_block_no, &physical, &run) : bmap_run(inode, logical_block_no, &physical, &run);
+		if (unwritten < 0 || run == 0)
 		{
-			block_no_t logical_block_no = offset / MY_BLK_SIZE;
-			add_physical_block(inode, logical_block_no, physical_block_no);
+			ret = -1;
+			break;
+		}
+		if (run > last - logical_block_no + 1)
+			run = last - logical_block_no + 1;
+		if (physical != 0)
+			continue; /* already allocated */
+		int got = balloc_range(alloc_goal(inode, logical_block_no), 1, run, &physical);
+		if (got <= 0)
+		{
+			perror("fallocate: no free blocks\n");
+			ret = -1;
+			break;
+		}
+		run = got;
+		if (INO_USES_EXTENTS(inode))
+		{
+			if (extent_map(inode, logical_block_no, physical, run | EXTENT_UNWRITTEN) != 0)
+			{
+				/* file is too fragmented for its extent block */
+				bfree_range(physical, run);
+				ret = -1;
+				break;
+			}
 		}
+		else
+		{
+			buffer_t buffer;
+			for (u_int32_t i = 0; i < run; i++)
+			{
+				if (bnew(physical + i, &buffer) == 0)
+					brelse(&buffer);
+				add_physical_block(inode, logical_block_no + i, physical + i);
+			}
+		}
+		inode->disk_inode.size_on_disk += (offset_t)run * MY_BLK_SIZE;
+		INO_SET_FIELD(inode, INODE_MODIFIED);
 	}
-	file_table[fd].offset += written;
-	INO_REM_FIELD(inode, INODE_LOCKED);
-	return written;
+	if (ret == 0 && !IS_SET(flags, FA_KEEP_SIZE) && offset + len > inode->disk_inode.size)
+	{
+		inode->disk_inode.size = offset + len;
+		INO_SET_FIELD(inode, INODE_MODIFIED);
+	}
+	iunlock(inode);
+	fput(file);
+	return ret;
+}
+
+int myfallocate(int fd, offset_t offset, offset_t len, int flags)
+{
+	jbegin();
+	int ret = file_fallocate(fd, offset, len, flags);
+	jend();
+	return ret;
+}
+
+/* makes all changes durable: modified inodes go to their blocks, file data goes home and the metadata is committed
+ * to the journal with one sequential write. its home blocks are written later. without a journal, everything goes home */
+int mysync()
+{
+	jbegin();
+	int ret = isync();
+	jend();
+	if (ret != 0 || bflushdata() != 0)
+		return -1;
+	return jcommit();
+}
+
+/* makes one file durable: its inode and every metadata change before it are committed together with whatever
+ * other threads committing at the same time logged. dirty file data in the cache is written first */
+int myfsync(int fd)
+{
+	open_file_info_t *file = fget(fd);
+	if (file == NULL)
+	{
+		perror("fsync: bad file descriptor\n");
+		return -1;
+	}
+	inode_t *inode = file->inode;
+	jbegin();
+	ilock(inode);
+	int ret = dalloc_inode(inode); /* its blocks are chosen before its inode is logged */
+	if (INO_IS_SET(inode, INODE_MODIFIED) && iwrite(inode) != 0)
+		ret = -1;
+	iunlock(inode);
+	jend();
+	if (ret == 0 && (bflushdata() != 0 || jcommit() != 0))
+		ret = -1;
+	fput(file);
+	return ret;
 }
\ No newline at end of file
@@ -8,12 +8,30 @@
 #define M_TRUNC 0b1000
 #define M_CREAT 0b10000
 #define S_OPEN 0b100000
+#define M_DIRECT 0b1000000 /* block aligned parts of reads and writes bypass the buffer cache */
+#define M_EXTENTS 0b10000000 /* a file opened for writing that has no blocks yet is switched to extent mapping */
 #define M_RDWR (M_RD | M_WR)
 
+/* most files open at once. fds and open files are kept in tables that grow by chunks of FD_CHUNK_SIZE slots */
+#ifndef MAX_OPEN_FILES
+#define MAX_OPEN_FILES 65536
+#endif
+#define FD_CHUNK_SIZE 256
+#define FD_CHUNKS (MAX_OPEN_FILES / FD_CHUNK_SIZE)
+
 #define WH_SET 0
 #define WH_CUR 1
 #define WH_END 2
 
+/* read-ahead window limits in blocks */
+#define RA_MIN_WINDOW 4
+#define RA_MAX_WINDOW 16
+/* most blocks mapped and submitted together by a direct read or write */
+#define DIRECT_BATCH 256
+
+/* myfallocate flags */
+#define FA_KEEP_SIZE 0b1 /* file size is not changed */
+
 #define IS_SET(mode, field) ((mode & (field)) == (field))
 
 #endif
\ No newline at end of file
@@ -1,97 +1,190 @@
 #include "myfs.h"
 #include "inode.h"
-struct bfreelist
-{
-	block_no_t freeptr;
-	u_int32_t freecount;
-};
+#include "disk.h"
+#include "journal.h"
+#include "dir.h"
+#include "buffer_cache.h"
+#include <sys/stat.h>
+
+/* the mounted volume */
+int disk_fd = -1;
+super_block_t super_block;
+char err[100];
 
-struct ifreelist
+/* threads writing the inode table of a new volume. each takes at least DISK_MAX_IOV blocks */
+#ifndef MKFS_THREADS
+#define MKFS_THREADS 4
+#endif
+
+/* writes the free space bitmap at bitmap_start. blocks [used, num_blocks) are free, the rest are marked in use.
+ * with zeroed set the disk reads as zeros already, so only bitmap blocks with a bit set are written */
+int create_bitmap(int fd, block_no_t bitmap_start, block_no_t used, block_no_t num_blocks, int zeroed)
 {
-	inode_no_t freeptr;
-	u_int32_t freecount;
-};
+	block_t block;
+	block_t *blockp = &block;
+	for (block_no_t i = 0; i < BITMAP_BLOCKS(num_blocks); i++)
+	{
+		block_no_t from = i * BITS_PER_BITMAP_BLOCK, to = from + BITS_PER_BITMAP_BLOCK;
+		if (zeroed && from >= used && to <= num_blocks)
+			continue;
+		/* bits of blocks before used and from num_blocks on are set */
+		int free_from = used > from ? (used < to ? used - from : BITS_PER_BITMAP_BLOCK) : 0;
+		int free_to = num_blocks < to ? (num_blocks > from ? num_blocks - from : 0) : BITS_PER_BITMAP_BLOCK;
+		memset(&block, 0, MY_BLK_SIZE);
+		for (int bit = 0; bit < BITS_PER_BITMAP_BLOCK; bit++)
+		{
+			if (bit == free_from && free_from < free_to)
+				bit = free_to; /* whole bytes of the free part are not looked at */
+			if (bit < BITS_PER_BITMAP_BLOCK)
+				block.b[bit / 8] |= 1 << (bit % 8);
+		}
+		if (disk_write(fd, bitmap_start + i, &blockp, 1) != 1)
+			return -1;
+	}
+	return 0;
+}
 
-struct bfreelist create_bfreelist(int fd, block_no_t from, block_no_t to)
+/* writes the allocator summary of a new volume at summary_start: the free blocks each bitmap block covers */
+int create_summary(int fd, block_no_t summary_start, block_no_t used, block_no_t num_blocks)
 {
-	struct bfreelist freelist;
-	freelist.freecount = INDEX_SIZE;
-	freelist.freeptr = 0;
-	int left = (int)((long)to - (long)from + 1);
-	while (left >= INDEX_SIZE)
+	u_int32_t n = SUMMARY_BLOCKS(num_blocks);
+	block_t *blocks = calloc(n, sizeof(block_t)), **blockp = malloc(n * sizeof(block_t *));
+	int ret = blocks != NULL && blockp != NULL ? 0 : -1;
+	for (u_int32_t i = 0; ret == 0 && i < BITMAP_BLOCKS(num_blocks); i++)
 	{
-		block_t block;
-		block_no_t *entry = (block_no_t *)(block.b + MY_BLK_SIZE) - 1, *first = (block_no_t *)&block;
-		*(entry--) = freelist.freeptr;
-		while (entry >= first)
-			*(entry--) = to--;
-		freelist.freeptr = to--;
-		left -= INDEX_SIZE;
-		lseek(fd, (freelist.freeptr + NUM_SUPER_BLOCKS - 1) * MY_BLK_SIZE, SEEK_SET);
-		write(fd, &block, MY_BLK_SIZE);
+		block_no_t from = i * BITS_PER_BITMAP_BLOCK, to = from + BITS_PER_BITMAP_BLOCK;
+		from = from > used ? from : used;
+		to = to < num_blocks ? to : num_blocks;
+		u_int32_t free_blocks = to > from ? to - from : 0;
+		memcpy(blocks->b + i * sizeof(u_int32_t), &free_blocks, sizeof(u_int32_t));
 	}
-	if (left > 0)
+	for (u_int32_t i = 0; ret == 0 && i < n; i++)
+		blockp[i] = blocks + i;
+	if (ret == 0 && disk_write(fd, summary_start, blockp, n) != (int)n)
+		ret = -1;
+	free(blocks);
+	free(blockp);
+	return ret;
+}
+
+/* writes a super block to block 0 */
+static int super_write(int fd, super_block_t *sup)
+{
+	block_t block = {.b = {0}}, *blockp = &block;
+	memcpy(block.b, sup, sizeof(super_block_t));
+	return disk_write(fd, 0, &blockp, 1) == 1 ? 0 : -1;
+}
+
+static int super_read(int fd, super_block_t *sup)
+{
+	block_t block, *blockp = &block;
+	if (disk_read(fd, 0, &blockp, 1) != 1)
+		return -1;
+	memcpy(sup, block.b, sizeof(super_block_t));
+	return sup->magic == SUPER_MAGIC ? 0 : -1;
+}
+
+/* table blocks [from, to) of a new volume written by one thread of create_itable */
+typedef struct
+{
+	int fd;
+	block_no_t from, to;
+	int ret;
+} itable_part_t;
+
+/* writes the table blocks of a part DISK_MAX_IOV at a time. every table block has the same content,
+ * so each vectored write repeats one block */
+static void *itable_write(void *arg)
+{
+	itable_part_t *part = arg;
+	block_t block, *blockp[DISK_MAX_IOV];
+	itable_fill(&block);
+	for (int i = 0; i < DISK_MAX_IOV; i++)
+		blockp[i] = &block;
+	part->ret = 0;
+	for (block_no_t b = part->from, n; part->ret == 0 && b < part->to; b += n)
 	{
-		freelist.freecount = left;
-		block_t block;
-		block_no_t *entry = (block_no_t *)(block.b + MY_BLK_SIZE) - 1;
-		*(entry--) = freelist.freeptr;
-		left--;
-		while (left--)
-			*(entry--) = to--;
-		freelist.freeptr = to--;
-		left = 0;
-		lseek(fd, (freelist.freeptr + NUM_SUPER_BLOCKS - 1) * MY_BLK_SIZE, SEEK_SET);
-		write(fd, &block, MY_BLK_SIZE);
+		n = part->to - b < DISK_MAX_IOV ? part->to - b : DISK_MAX_IOV;
+		if (disk_write(part->fd, b, blockp, n) != (int)n)
+			part->ret = -1;
 	}
-	return freelist;
+	return NULL;
 }
 
-struct ifreelist create_ifreelist(int fd, inode_no_t from, inode_no_t to)
+/* writes inode table blocks [NUM_SUPER_BLOCKS, NUM_SUPER_BLOCKS + count) of unused inodes.
+ * a large table is split between threads */
+static int create_itable(int fd, block_no_t count)
 {
-	struct ifreelist freelist;
-	freelist.freecount = INODE_INDEX_COUNT;
-	freelist.freeptr = 0;
-	int left = (int)((long)to - (long)from + 1);
-	while (left >= INODE_INDEX_COUNT)
+	itable_part_t part[MKFS_THREADS];
+	pthread_t thread[MKFS_THREADS];
+	int started[MKFS_THREADS] = {0};
+	block_no_t threads = (count + DISK_MAX_IOV - 1) / DISK_MAX_IOV;
+	if (threads > MKFS_THREADS)
+		threads = MKFS_THREADS;
+	if (threads == 0)
+		threads = 1;
+	for (block_no_t t = 0; t < threads; t++)
 	{
-		disk_inode_t inode = model_unused_inode;
-		inode_no_t *entry = (inode_no_t *)(&(inode.index) + 1) - 1, *first = (inode_no_t *)(&(inode.index));
-		while (entry >= first)
-			*(entry--) = to--;
-		freelist.freeptr = to--;
-		left -= INODE_INDEX_COUNT;
-		block_no_t block_no = INODE_NO_TO_BLOCK_NO(freelist.freeptr);
-		offset_t offset = INODE_NO_TO_BYTE_OFF(freelist.freecount);
-		lseek(fd, block_no * MY_BLK_SIZE + offset, SEEK_SET);
-		write(fd, &inode, DISK_INODE_SIZE);
+		part[t] = (itable_part_t){.fd = fd, .from = NUM_SUPER_BLOCKS + (u_int64_t)count * t / threads, .to = NUM_SUPER_BLOCKS + (u_int64_t)count * (t + 1) / threads};
+		/* the caller writes the first part itself, and any part a thread could not be started for */
+		started[t] = t > 0 && pthread_create(thread + t, NULL, itable_write, part + t) == 0;
 	}
-	if (left > 0)
+	int ret = 0;
+	for (block_no_t t = 0; t < threads; t++)
 	{
-		freelist.freecount = left;
-		disk_inode_t inode = model_unused_inode;
-		inode_no_t *entry = (inode_no_t *)(&(inode.index) + 1) - 1;
-		*(entry--) = freelist.freeptr;
-		left--;
-		while (left--)
-			*(entry--) = to--;
-		freelist.freeptr = to--;
-		left = 0;
-		block_no_t block_no = INODE_NO_TO_BLOCK_NO(freelist.freeptr);
-		offset_t offset = INODE_NO_TO_BYTE_OFF(freelist.freecount);
-		lseek(fd, block_no * MY_BLK_SIZE + offset, SEEK_SET);
-		write(fd, &inode, DISK_INODE_SIZE);
+		if (started[t])
+			pthread_join(thread[t], NULL);
+		else
+			itable_write(part + t);
+		if (part[t].ret != 0)
+			ret = -1;
 	}
-	return freelist;
+	return ret;
 }
 
+/* blocks of the root directory of a new volume: its index block and the block of its entries */
+#define ROOT_BLOCKS 2
+
+/* writes the root directory of a new volume, inode 1, over the first inode table block. its index block is
+ * block first, its entries are in block first + 1. like a directory made by mymkdir it holds only "..", which is the root itself */
+static int create_root(int fd, block_no_t first)
+{
+	block_t table, index = {.b = {0}}, entries = {.b = {0}};
+	block_t *blockp[ROOT_BLOCKS] = {&index, &entries}, *tablep = &table;
+	itable_fill(&table);
+	disk_inode_t root = model_unused_inode;
+	root.type = FT_DIR;
+	root.links = 1;
+	root.size = DIR_ENTRY_SIZE;
+	root.size_on_disk = MY_BLK_SIZE;
+	root.index.deg1[0] = first;
+	memcpy(table.b + INODE_NO_TO_BYTE_OFF(1), &root, DISK_INODE_SIZE);
+	block_no_t data = first + 1;
+	memcpy(index.b, &data, sizeof(block_no_t));
+	dir_entry_t parent = {.inode_no = 1, .type = FT_DIR, .name = ".."};
+	memcpy(entries.b, &parent, DIR_ENTRY_SIZE);
+	if (disk_write(fd, INODE_NO_TO_BLOCK_NO(1), &tablep, 1) != 1 || disk_write(fd, first, blockp, ROOT_BLOCKS) != ROOT_BLOCKS)
+		return -1;
+	return 0;
+}
+
+/* makes a volume. see create_volume_flags */
 int create_volume(const char *name, block_no_t number_of_blocks, inode_no_t number_of_inodes)
+{
+	return create_volume_flags(name, number_of_blocks, number_of_inodes, 0);
+}
+
+/* makes a volume of number_of_blocks blocks and number_of_inodes inodes in file name.
+ * a regular file is made sparse, so only the blocks of the volume that are not all zeros are written.
+ * with VOL_LAZY_ITABLE only the first ITABLE_LAZY_BLOCKS blocks of the inode table are made, ialloc makes the rest.
+ * with VOL_PREALLOCATE the space of the volume is allocated in the file system holding it */
+int create_volume_flags(const char *name, block_no_t number_of_blocks, inode_no_t number_of_inodes, int flags)
 {
 	/* number of blocks + num_super_blocks (for super block) blocks */
-	int inode_array_blocks = (number_of_inodes * DISK_INODE_SIZE) / MY_BLK_SIZE;
-	if (inode_array_blocks * MY_BLK_SIZE < number_of_inodes * DISK_INODE_SIZE)
-		inode_array_blocks++;
-	if (number_of_blocks < inode_array_blocks)
+	block_no_t inode_array_blocks = (number_of_inodes + INODES_PER_BLOCK - 1) / INODES_PER_BLOCK;
+	block_no_t ibitmap_blocks = IBITMAP_BLOCKS(number_of_inodes), bitmap_blocks = BITMAP_BLOCKS(number_of_blocks + NUM_SUPER_BLOCKS);
+	block_no_t summary_blocks = SUMMARY_BLOCKS(number_of_blocks + NUM_SUPER_BLOCKS);
+	if (number_of_inodes < 2 || number_of_blocks < inode_array_blocks + ibitmap_blocks + bitmap_blocks + summary_blocks + JOURNAL_BLOCKS + ROOT_BLOCKS)
 	{
 		perror("failed\n");
 		return -1;
@@ -102,25 +195,120 @@ int create_volume(const char *name, block_no_t number_of_blocks, inode_no_t numb
 		perror("failed\n");
 		return -1;
 	}
-	lseek(fd, (number_of_blocks + NUM_SUPER_BLOCKS) * MY_BLK_SIZE - 1, SEEK_SET);
-	write(fd, "\0", 1);
-	block_t default_inode_array_block = {.b = {0}};
-	offset_t off = 0;
-	for (int i = 0; i < INODES_PER_BLOCK; i++)
+	/* a truncated regular file reads as zeros up to its new size. a device does not */
+	struct stat st;
+	off_t size = ((off_t)number_of_blocks + NUM_SUPER_BLOCKS) * MY_BLK_SIZE;
+	int zeroed = fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && ftruncate(fd, size) == 0;
+	if (zeroed && (flags & VOL_PREALLOCATE) && posix_fallocate(fd, 0, size) != 0)
+		perror("mkfs: space not preallocated\n");
+	/* the inode bitmap and the free space bitmap follow the inode array, then come the summary of the free space bitmap
+	 * and the journal. data blocks follow the journal */
+	block_no_t ibitmap_start = NUM_SUPER_BLOCKS + inode_array_blocks, bitmap_start = ibitmap_start + ibitmap_blocks, summary_start = bitmap_start + bitmap_blocks;
+	block_no_t journal_start = summary_start + summary_blocks, first_data_block = journal_start + JOURNAL_BLOCKS;
+	/* the table blocks not made now are made by ialloc */
+	block_no_t itable_blocks = inode_array_blocks;
+	inode_no_t last = number_of_inodes;
+	if ((flags & VOL_LAZY_ITABLE) && itable_blocks > ITABLE_LAZY_BLOCKS)
+		itable_blocks = ITABLE_LAZY_BLOCKS, last = ITABLE_LAZY_BLOCKS * INODES_PER_BLOCK;
+	int ret = create_itable(fd, itable_blocks);
+	if (ret == 0)
+		ret = create_root(fd, first_data_block);
+	/* inode 1 is the root. the inode bitmap covers the whole table, made or not */
+	if (ret == 0)
+		ret = create_bitmap(fd, ibitmap_start, 2, number_of_inodes + 1, zeroed);
+	/* replay of the new journal starts at its first slot with transaction 1. a disk that is not zeroed has that slot
+	 * cleared too, so nothing left there is taken for a descriptor */
+	block_t journal_blocks[2] = {{.b = {0}}, {.b = {0}}}, *journalp[2] = {journal_blocks, journal_blocks + 1};
+	journal_header_t header = {.magic = JOURNAL_MAGIC, .tail = 1, .seq = 1};
+	memcpy(journal_blocks[0].b, &header, sizeof(header));
+	if (ret == 0 && JOURNAL_BLOCKS >= 2 && disk_write(fd, journal_start, journalp, zeroed ? 1 : 2) != (zeroed ? 1 : 2))
+		ret = -1;
+	if (ret == 0)
+		ret = create_bitmap(fd, bitmap_start, first_data_block + ROOT_BLOCKS, number_of_blocks + NUM_SUPER_BLOCKS, zeroed);
+	if (ret == 0)
+		ret = create_summary(fd, summary_start, first_data_block + ROOT_BLOCKS, number_of_blocks + NUM_SUPER_BLOCKS);
+	/* groups split the bitmap at bitmap block boundaries. the inodes are split between as many groups, a table block
+	 * never spanning two */
+	u_int32_t groups = (bitmap_blocks + GROUP_BITMAP_BLOCKS - 1) / GROUP_BITMAP_BLOCKS;
+	u_int32_t group_inodes = ((number_of_inodes + groups - 1) / groups + INODES_PER_BLOCK - 1) / INODES_PER_BLOCK * INODES_PER_BLOCK;
+	super_block_t sup = {
+		.bfreecount = number_of_blocks + NUM_SUPER_BLOCKS - first_data_block - ROOT_BLOCKS, .group_blocks = GROUP_BITMAP_BLOCKS * BITS_PER_BITMAP_BLOCK, .group_inodes = group_inodes, .bitmap_start = bitmap_start, .journal_start = journal_start, .journal_blocks = JOURNAL_BLOCKS, .ibitmap_start = ibitmap_start, .num_blocks = number_of_blocks + NUM_SUPER_BLOCKS, .num_inodes = number_of_inodes, .root = 1, .magic = SUPER_MAGIC, .clean = 1, .summary_start = summary_start, .num_free_inodes = number_of_inodes - 1, .ilazy = last < number_of_inodes ? last + 1 : 0};
+	/* a new volume counts as cleanly unmounted: its summary is right */
+	if (ret == 0)
+		ret = super_write(fd, &sup) == 0 && fsync(fd) == 0 ? 0 : -1;
+	close(fd);
+	return ret;
+}
+
+int mymount(const char *name)
+{
+	if (disk_fd >= 0)
 	{
-		memcpy(default_inode_array_block.b + off, &model_unused_inode, DISK_INODE_SIZE);
-		off += DISK_INODE_SIZE;
+		perror("mount: a volume is mounted already\n");
+		return -1;
 	}
-	for (block_no_t i = NUM_SUPER_BLOCKS, lim = NUM_SUPER_BLOCKS + inode_array_blocks; i < lim; i++)
+	int fd = open(name, O_RDWR);
+	if (fd < 0)
 	{
-		lseek(fd, i * MY_BLK_SIZE, SEEK_SET);
-		write(fd, default_inode_array_block.b, MY_BLK_SIZE);
+		perror("mount: cannot open volume\n");
+		return -1;
 	}
-	block_no_t to = number_of_blocks, from = inode_array_blocks + 1;
-	struct bfreelist bfreelist = create_bfreelist(fd, from, to);
-	struct ifreelist ifreelist = create_ifreelist(fd, 2, number_of_inodes);
-	super_block_t sup = {
-		.bfreecount = bfreelist.freecount, .bfreeptr = bfreelist.freeptr, .ifreecount = ifreelist.freecount, .ifreeptr = ifreelist.freeptr, .num_blocks = number_of_blocks + NUM_SUPER_BLOCKS, .num_inodes = number_of_inodes, .root = 1};
-	
-	close(fd);
+	super_block_t sup;
+	if (super_read(fd, &sup) != 0)
+	{
+		perror("mount: not a volume\n");
+		close(fd);
+		return -1;
+	}
+	int clean = sup.clean;
+	disk_set_backend(fd, DISK_BACKEND_PREAD, 0); /* a new volume starts with plain reads */
+	disk_fd = fd;
+	super_block = sup;
+	/* replay brings back the super block committed with the last transaction */
+	if ((!clean && (jrecover() != 0 || super_read(fd, &super_block) != 0)) || bmount(clean) != 0 || imount() != 0)
+	{
+		perror("mount: cannot recover volume\n");
+		jclose();
+		disk_fd = -1;
+		close(fd);
+		return -1;
+	}
+	super_block.clean = 0;
+	if (super_write(fd, &super_block) != 0 || fdatasync(fd) != 0)
+	{
+		perror("mount: cannot write super block\n");
+		bumount();
+		jclose();
+		disk_fd = -1;
+		close(fd);
+		return -1;
+	}
+	return 0;
+}
+
+/* writes everything back, empties the journal and marks the volume clean. no file may be open */
+int myumount()
+{
+	if (disk_fd < 0)
+		return -1;
+	bstopflusher();
+	/* the first flush picks blocks for delayed writes, which changes metadata. once that is committed every
+	 * buffer can go home. the checkpoint leaves the journal empty */
+	if (iclearcache() != 0 || bflush() != 0 || jcommit() != 0 || bflush() != 0 || jclose() != 0)
+	{
+		perror("umount: cannot write back volume\n");
+		return -1;
+	}
+	dcache_clear();
+	bclearcache();
+	iumount();
+	int ret = bumount();
+	super_block.clean = ret == 0;
+	/* no mapping or ring may outlive the volume */
+	disk_set_backend(disk_fd, DISK_BACKEND_PREAD, 0);
+	if (super_write(disk_fd, &super_block) != 0 || fsync(disk_fd) != 0)
+		ret = -1;
+	close(disk_fd);
+	disk_fd = -1;
+	return ret;
 }
\ No newline at end of file
@@ -1,58 +1,151 @@
 #include "myfs.h"
 #include "inode.h"
 #include "buffer_cache.h"
-inode_t inode_table[MAX_ACTIVE_INODES];
-
-/* if found, gives index.
- ! if found but locked, error (-1)
- * if not found, -(2+inactive)
- */
-int find_in_inode_table(inode_no_t inode_no)
-{
-	int h1 = inode_no % MAX_ACTIVE_INODES;
-	int h2 = 1;
-	int i = h1;
-	int inactive = MAX_ACTIVE_INODES;
-	do
-	{												   /* exhaustive search is done on the table */
-		if (INO_IS_SET(inode_table + i, INODE_ACTIVE)) /* if table entry is active */
-		{
-			inactive--;
-			if (inode_table[i].inode_no == inode_no)
-			{
-				if (inode_table[i].status & INODE_LOCKED)
-				{
-					/* 					sprintf(err, "needed inode (%u) is locked\n", inode_no);
-										perror(err); */
-					return -1;
-				}
-				return i;
-			}
-		}
-		i = (i + h2) % MAX_ACTIVE_INODES;
-	} while (i != h1);
-	return -2 - inactive;
+#include "disk.h"
+/* inode cache: cached inodes hashed by inode number. unreferenced ones stay cached on an lru list until their memory is needed */
+inode_t **inode_hash = NULL;
+u_int32_t inode_hash_size = 0; /* number of hash queues. a power of 2 */
+u_int32_t num_cached_inodes = 0;
+/* unreferenced cached inodes. least recently used at head. pinned inodes are never on it */
+inode_t inode_lru = {.lru_next = &inode_lru, .lru_prev = &inode_lru};
+/* guards the hash queues, the lru list and reference counts. an inode's own fields are guarded by its lock (see ilock) */
+pthread_mutex_t icache_lock = PTHREAD_MUTEX_INITIALIZER;
+/* broadcast when an inode stops being busy. icache_lock is not held across disk i/o: see INODE_BUSY */
+pthread_cond_t icache_wait = PTHREAD_COND_INITIALIZER;
+/* free inodes are a bitmap on disk after the inode table: bit set if the inode is in use. bit 0 stands for no inode.
+ * imap is a copy of it in which inodes held in the allocation cache of a thread are set too. the inodes are split into
+ * allocation groups of super_block.group_inodes, each with its own lock guarding its bits of imap and its free count */
+typedef struct
+{
+	pthread_mutex_t lock;
+	u_int32_t free; /* clear bits of the group in imap. full groups are skipped */
+} igroup_t;
+u_int64_t *imap = NULL;
+igroup_t *igroups = NULL;
+u_int32_t num_igroups = 0, igroup_size = 0;
+/* changed by imount and iumount. cached inodes of an older generation belong to another mount and are dropped */
+u_int32_t imap_generation = 0;
+/* guards loading imap and making the table blocks of a lazily made inode table */
+pthread_mutex_t ialloc_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_key_t ialloc_cache_key;
+pthread_once_t ialloc_cache_once = PTHREAD_ONCE_INIT;
+
+offset_t siz_index[] = {SIZ_0DEG_INDEX, SIZ_1DEG_INDEX, SIZ_2DEG_INDEX, SIZ_3DEG_INDEX};
+
+#define INODE_HASH(inode_no) ((inode_no) & (inode_hash_size - 1))
+
+static inode_t *icache_find(inode_no_t inode_no)
+{
+	if (inode_hash == NULL)
+		return NULL;
+	inode_t *inode = inode_hash[INODE_HASH(inode_no)];
+	while (inode != NULL && inode->inode_no != inode_no)
+		inode = inode->hash_next;
+	return inode;
 }
 
-int init_table_entry(inode_no_t inode_no)
+/* doubles the hash queues once there are more than two inodes per queue */
+static int icache_grow()
 {
-	int h1 = inode_no % MAX_ACTIVE_INODES;
-	int h2 = 1;
-	int i = h1;
-	do
+	u_int32_t old_size = inode_hash_size, size = old_size == 0 ? INODE_HASH_MIN : old_size * 2;
+	inode_t **old_hash = inode_hash, **hash = calloc(size, sizeof(inode_t *));
+	if (hash == NULL)
+		return -1;
+	inode_hash = hash;
+	inode_hash_size = size;
+	for (u_int32_t i = 0; i < old_size; i++)
 	{
-		if (!INO_IS_SET(inode_table + i, INODE_ACTIVE))
+		while (old_hash[i] != NULL)
 		{
-			inode_table[i].inode_no = inode_no;
-			inode_table[i].status = INODE_DEFAULT_STATUS | INODE_ACTIVE;
-			return i;
+			inode_t *inode = old_hash[i];
+			old_hash[i] = inode->hash_next;
+			inode->hash_next = inode_hash[INODE_HASH(inode->inode_no)];
+			inode_hash[INODE_HASH(inode->inode_no)] = inode;
 		}
-	} while (i != h1);
-	return -1;
+	}
+	free(old_hash);
+	return 0;
 }
 
-offset_t siz_index[] = {SIZ_0DEG_INDEX, SIZ_1DEG_INDEX, SIZ_2DEG_INDEX, SIZ_3DEG_INDEX};
+static int icache_insert(inode_t *inode)
+{
+	if (inode_hash == NULL || num_cached_inodes >= 2 * inode_hash_size)
+	{
+		/* if growing fails, queues only get longer */
+		if (icache_grow() != 0 && inode_hash == NULL)
+			return -1;
+	}
+	inode_t **head = inode_hash + INODE_HASH(inode->inode_no);
+	inode->hash_next = *head;
+	*head = inode;
+	num_cached_inodes++;
+	return 0;
+}
+
+static void icache_remove(inode_t *inode)
+{
+	inode_t **link = inode_hash + INODE_HASH(inode->inode_no);
+	while (*link != inode)
+		link = &((*link)->hash_next);
+	*link = inode->hash_next;
+	num_cached_inodes--;
+}
+
+static void inode_lru_remove(inode_t *inode)
+{
+	inode->lru_prev->lru_next = inode->lru_next;
+	inode->lru_next->lru_prev = inode->lru_prev;
+	inode->lru_next = inode->lru_prev = NULL;
+}
 
+static void inode_lru_append(inode_t *inode)
+{
+	inode->lru_prev = inode_lru.lru_prev;
+	inode->lru_next = &inode_lru;
+	inode->lru_prev->lru_next = inode;
+	inode->lru_next->lru_prev = inode;
+}
+
+/* writes a cached inode to its inode block. the caller holds its lock, or it is not referenced */
+int iwrite(inode_t *inode)
+{
+	buffer_t buffer;
+	if (bread(INODE_NO_TO_BLOCK_NO(inode->inode_no), &buffer) != 0)
+		return -1;
+	memcpy(buffer.data->b + INODE_NO_TO_BYTE_OFF(inode->inode_no), &(inode->disk_inode), DISK_INODE_SIZE);
+	BUFF_SET_FIELD(buffer, BUFF_MODIFIED | BUFF_JOURNAL);
+	brelse(&buffer);
+	INO_REM_FIELD(inode, INODE_MODIFIED);
+	return 0;
+}
+
+/* throws an unreferenced inode out of the cache. its delayed blocks are mapped and it is written back first.
+ * called with icache_lock held. it is let go while the disk is written; a thread getting the inode meanwhile waits */
+static int icache_evict(inode_t *inode)
+{
+	inode_lru_remove(inode);
+	INO_SET_FIELD(inode, INODE_BUSY);
+	pthread_mutex_unlock(&icache_lock);
+	ilock(inode); /* flushers skip it */
+	dalloc_inode(inode);
+	int ret = INO_IS_SET(inode, INODE_MODIFIED) ? iwrite(inode) : 0;
+	iunlock(inode);
+	pthread_mutex_lock(&icache_lock);
+	pthread_cond_broadcast(&icache_wait);
+	if (ret != 0)
+	{
+		INO_REM_FIELD(inode, INODE_BUSY);
+		inode_lru_append(inode);
+		return -1;
+	}
+	icache_remove(inode);
+	bmcache_invalidate(inode);
+	pthread_rwlock_destroy(&inode->lock);
+	free(inode);
+	return 0;
+}
+
+/* gives a referenced in-core inode. it is not locked: callers take ilock or ilock_shared around using its fields */
 int iget(inode_no_t inode_no, inode_t **inode)
 {
 	if (inode_no > super_block.num_inodes || inode_no == 0)
@@ -60,85 +153,255 @@ int iget(inode_no_t inode_no, inode_t **inode)
 		// perror("iget: invalid inode number\n");
 		return -1;
 	}
-	int i = find_in_inode_table(inode_no);
-	inode_t *inode_ptr = NULL;
-	if (i >= 0) /* if in active inodes */
+	pthread_mutex_lock(&icache_lock);
+	inode_t *inode_ptr;
+	while ((inode_ptr = icache_find(inode_no)) != NULL || num_cached_inodes >= MAX_CACHED_INODES)
 	{
-		inode_ptr = inode_table + i;
-		inode_ptr->status |= INODE_LOCKED;
-		inode_ptr->reference_count++;
-		*inode = inode_ptr;
-		return 0;
+		if (inode_ptr != NULL && !INO_IS_SET(inode_ptr, INODE_BUSY)) /* if cached */
+		{
+			if (inode_ptr->reference_count == 0 && !INO_IS_SET(inode_ptr, INODE_PINNED))
+				inode_lru_remove(inode_ptr); /* revived without reading the disk */
+			inode_ptr->reference_count++;
+			pthread_mutex_unlock(&icache_lock);
+			*inode = inode_ptr;
+			return 0;
+		}
+		if (inode_ptr != NULL)
+		{
+			/* being read in or thrown out. look again once that is done */
+			pthread_cond_wait(&icache_wait, &icache_lock);
+		}
+		else if (inode_lru.lru_next == &inode_lru || icache_evict(inode_lru.lru_next) != 0)
+		{
+			/* make room by evicting the least recently used unreferenced inode */
+			/* 		perror("iget: no free space in inode cache\n"); */
+			pthread_mutex_unlock(&icache_lock);
+			return -1;
+		}
 	}
-	else if (i == -2) /* not in table and no free space */
+	/* inode should be read from the disk. it is cached busy first, so a thread getting it meanwhile waits */
+	inode_ptr = calloc(1, sizeof(inode_t));
+	if (inode_ptr == NULL)
 	{
-		/* 		perror("iget: no free space in inode table\n"); */
+		pthread_mutex_unlock(&icache_lock);
 		return -1;
 	}
-	else if (i == -1) /* other errors */
+	inode_ptr->inode_no = inode_no;
+	inode_ptr->status = INODE_BUSY;
+	inode_ptr->reference_count = 1;
+	pthread_rwlock_init(&inode_ptr->lock, NULL);
+	if (icache_insert(inode_ptr) != 0)
 	{
-		/* 		perror("iget: error\n"); */
+		pthread_mutex_unlock(&icache_lock);
+		pthread_rwlock_destroy(&inode_ptr->lock);
+		free(inode_ptr);
 		return -1;
 	}
-	/* inode should be read from the disk */
-	block_no_t block_no = INODE_NO_TO_BLOCK_NO(inode_no);
+	pthread_mutex_unlock(&icache_lock);
 	buffer_t buffer;
-	bread(block_no, &buffer);
-	i = init_table_entry(inode_no);
-	inode_ptr = *inode = inode_table + i;
-	offset_t inode_byte_offset = INODE_NO_TO_BYTE_OFF(inode_no);
-	memcpy(&(inode_ptr->disk_inode), buffer.data->b + inode_byte_offset, DISK_INODE_SIZE);
-	brelse(&buffer);
-	INO_SET_FIELD(inode_ptr, INODE_LOCKED); /* lock the inode */
-	inode_ptr->reference_count++;			/* increase reference count */
-	memset(inode_ptr->key, 0, KEY_SIZE);
+	int ret = bread(INODE_NO_TO_BLOCK_NO(inode_no), &buffer);
+	if (ret == 0)
+	{
+		memcpy(&(inode_ptr->disk_inode), buffer.data->b + INODE_NO_TO_BYTE_OFF(inode_no), DISK_INODE_SIZE);
+		brelse(&buffer);
+	}
+	pthread_mutex_lock(&icache_lock);
+	if (ret != 0)
+		icache_remove(inode_ptr);
+	else if (inode_no == super_block.root)
+		INO_SET_FIELD(inode_ptr, INODE_ACTIVE | INODE_PINNED); /* root is looked up by every path. it stays cached */
+	else
+		INO_SET_FIELD(inode_ptr, INODE_ACTIVE);
+	INO_REM_FIELD(inode_ptr, INODE_BUSY);
+	pthread_cond_broadcast(&icache_wait);
+	pthread_mutex_unlock(&icache_lock);
+	if (ret != 0)
+	{
+		pthread_rwlock_destroy(&inode_ptr->lock);
+		free(inode_ptr);
+		return -1;
+	}
+	*inode = inode_ptr;
 	return 0;
 }
 
+/* drops a reference. the caller must not hold the inode's lock */
 int iput(inode_t *inode)
 {
-	if (!INO_IS_SET(inode, INODE_LOCKED))
-		INO_SET_FIELD(inode, INODE_LOCKED);
+	pthread_mutex_lock(&icache_lock);
 	inode->reference_count--;
-	if (inode->reference_count == 0)
+	if (inode->reference_count == 0 && (inode->disk_inode.links == 0 || INO_IS_SET(inode, INODE_MODIFIED)))
 	{
-		block_no_t block_no = INODE_NO_TO_BLOCK_NO(inode->inode_no);
-		offset_t inode_byte_offset = INODE_NO_TO_BYTE_OFF(inode->inode_no);
-		buffer_t buffer;
-		if (inode->disk_inode.links == 0)
+		/* the disk is written without icache_lock. a thread getting the inode meanwhile waits */
+		INO_SET_FIELD(inode, INODE_BUSY);
+		pthread_mutex_unlock(&icache_lock);
+		int freed = inode->disk_inode.links == 0;
+		ilock(inode); /* flushers skip it */
+		if (freed)
 		{
+			buffer_t buffer;
 			free_all_blocks(inode);
+			if (bread(INODE_NO_TO_BLOCK_NO(inode->inode_no), &buffer) == 0)
+			{
+				memcpy(buffer.data->b + INODE_NO_TO_BYTE_OFF(inode->inode_no), &model_unused_inode, DISK_INODE_SIZE);
+				BUFF_SET_FIELD(buffer, BUFF_MODIFIED | BUFF_JOURNAL);
+				brelse(&buffer);
+			}
 			ifree(inode->inode_no);
-			bread(block_no, &buffer);
-			memcpy(buffer.data->b + inode_byte_offset, &model_unused_inode, DISK_INODE_SIZE);
-			BUFF_SET_FIELD(buffer, BUFF_MODIFIED);
-			brelse(&buffer);
+		}
+		else
+			iwrite(inode);
+		iunlock(inode);
+		pthread_mutex_lock(&icache_lock);
+		INO_REM_FIELD(inode, INODE_BUSY);
+		pthread_cond_broadcast(&icache_wait);
+		if (freed)
+		{
+			icache_remove(inode);
+			pthread_mutex_unlock(&icache_lock);
+			pthread_rwlock_destroy(&inode->lock);
+			free(inode);
 			return 0;
 		}
-		else if (inode->status & INODE_MODIFIED)
+	}
+	/* inode stays cached. delayed blocks are mapped by writeback or when the inode is evicted */
+	if (inode->reference_count == 0 && !INO_IS_SET(inode, INODE_PINNED))
+		inode_lru_append(inode);
+	pthread_mutex_unlock(&icache_lock);
+	return 0;
+}
+
+/* writes every modified cached inode back to its inode block. inodes stay cached.
+ * an inode another thread is changing right now is skipped; it is written by a later sync. */
+int isync()
+{
+	dalloc_flush(); /* mapping delayed blocks modifies inodes */
+	pthread_mutex_lock(&icache_lock);
+	for (u_int32_t i = 0; i < inode_hash_size; i++)
+	{
+		for (inode_t *inode = inode_hash[i]; inode != NULL; inode = inode->hash_next)
 		{
-			bread(block_no, &buffer);
-			memcpy(buffer.data->b + inode_byte_offset, &(inode->disk_inode), DISK_INODE_SIZE);
-			BUFF_SET_FIELD(buffer, BUFF_MODIFIED);
-			brelse(&buffer);
+			if (!INO_IS_SET(inode, INODE_MODIFIED) || itrylock(inode, 1) != 0)
+				continue;
+			int ret = inode->disk_inode.links == 0 ? 0 : iwrite(inode); /* links are read under the lock */
+			iunlock(inode);
+			if (ret != 0)
+			{
+				pthread_mutex_unlock(&icache_lock);
+				return -1;
+			}
 		}
-		inode->status = INODE_DEFAULT_STATUS;
-		inode->inode_no = 0;
-		inode->reference_count = 0;
 	}
-	INO_REM_FIELD(inode, INODE_LOCKED);
+	pthread_mutex_unlock(&icache_lock);
 	return 0;
 }
 
+/* writes back and drops every cached inode, for an unmount. fails if one is still referenced */
+int iclearcache()
+{
+	if (isync() != 0)
+		return -1;
+	pthread_mutex_lock(&icache_lock);
+	for (u_int32_t i = 0; i < inode_hash_size; i++)
+	{
+		for (inode_t *inode = inode_hash[i]; inode != NULL; inode = inode->hash_next)
+		{
+			if (inode->reference_count > 0)
+			{
+				pthread_mutex_unlock(&icache_lock);
+				return -1;
+			}
+		}
+	}
+	for (u_int32_t i = 0; i < inode_hash_size; i++)
+	{
+		while (inode_hash[i] != NULL)
+		{
+			inode_t *inode = inode_hash[i];
+			if (INO_IS_SET(inode, INODE_PINNED))
+			{
+				/* a pinned inode is not on the lru list */
+				INO_REM_FIELD(inode, INODE_PINNED);
+				inode_lru_append(inode);
+			}
+			if (icache_evict(inode) != 0)
+			{
+				pthread_mutex_unlock(&icache_lock);
+				return -1;
+			}
+		}
+	}
+	pthread_mutex_unlock(&icache_lock);
+	return 0;
+}
+
+/* inode locks: many threads may read an inode and its blocks together, a thread changing them excludes all others.
+ * the writer may take its lock again, shared or not, so helpers that lock do not deadlock under it. */
+static int iowned(inode_t *inode)
+{
+	return INO_IS_SET(inode, INODE_LOCKED) && pthread_equal(__atomic_load_n(&inode->writer, __ATOMIC_RELAXED), pthread_self());
+}
+
+void ilock(inode_t *inode)
+{
+	if (iowned(inode))
+	{
+		inode->lock_depth++;
+		return;
+	}
+	pthread_rwlock_wrlock(&inode->lock);
+	__atomic_store_n(&inode->writer, pthread_self(), __ATOMIC_RELAXED);
+	INO_SET_FIELD(inode, INODE_LOCKED);
+}
+
+void ilock_shared(inode_t *inode)
+{
+	if (iowned(inode))
+	{
+		inode->lock_depth++;
+		return;
+	}
+	pthread_rwlock_rdlock(&inode->lock);
+}
+
+/* takes the lock, shared or exclusive, without waiting. returns 0 if it is held now */
+int itrylock(inode_t *inode, int shared)
+{
+	if (iowned(inode))
+	{
+		inode->lock_depth++;
+		return 0;
+	}
+	if (shared)
+		return pthread_rwlock_tryrdlock(&inode->lock) == 0 ? 0 : -1;
+	if (pthread_rwlock_trywrlock(&inode->lock) != 0)
+		return -1;
+	__atomic_store_n(&inode->writer, pthread_self(), __ATOMIC_RELAXED);
+	INO_SET_FIELD(inode, INODE_LOCKED);
+	return 0;
+}
+
+void iunlock(inode_t *inode)
+{
+	if (iowned(inode))
+	{
+		if (inode->lock_depth > 0)
+		{
+			inode->lock_depth--;
+			return;
+		}
+		INO_REM_FIELD(inode, INODE_LOCKED);
+	}
+	pthread_rwlock_unlock(&inode->lock);
+}
+
 /* maps byte offset to block number. tells at what byte offset in the block does the offset lie. tells number of bytes of file in the block from the offset. */
 int bmap(inode_t *inode, offset_t offset, block_no_t *block_no, offset_t *byte_offset, size_t *num_bytes_in_block)
 {
 	// inode is locked
 	/* offset has a limit */
-	int indirection_lvl = -1;
-	block_no_t index_block;
 	offset_t fsz = inode->disk_inode.size;
-	if (offset >= MAX_FILE_SIZE || offset < 0)
+	if (offset >= INODE_MAX_SIZE(inode) || offset < 0)
 	{
 		return -1;
 	}
@@ -159,48 +422,10 @@ int bmap(inode_t *inode, offset_t offset, block_no_t *block_no, offset_t *byte_o
 		*num_bytes_in_block = 0;			 /* as offset is beyond EOF, no bytes of file in the block */
 		return 0;
 	}
-	if (offset < CAP_0DEG_INDEX)
-	{
-		indirection_lvl = 0;
-		/* handle direct block address */
-	}
-	else if ((offset -= CAP_0DEG_INDEX) < CAP_1DEG_INDEX)
-	{
-		indirection_lvl = 1;
-		/* handle 1 degree index */
-		int index = offset / siz_index[1];
-		index_block = inode->disk_inode.index.deg1[index];
-		offset = offset % siz_index[1];
-		fsz = fsz - index * siz_index[1];
-	}
-	else if ((offset -= CAP_1DEG_INDEX) < CAP_2DEG_INDEX)
-	{
-		indirection_lvl = 2;
-		/* handle 2 degree index */
-	}
-	else if ((offset -= CAP_2DEG_INDEX) < CAP_3DEG_INDEX)
-	{
-		indirection_lvl = 3;
-		/* handle 3 degree index */
-	}
-	buffer_t buffer;
-	while (index_block != 0 && indirection_lvl != 0)
-	{
-		int index = offset / siz_index[indirection_lvl - 1];
-		/* logical index entry number in index */
-		int loc_of_index; /* actual index entry number */
-		if (inode->disk_inode.type == FT_FIL)
-			loc_of_index = encode(index, inode->key);
-		else
-			loc_of_index = index;
-		bread(index_block, &buffer);
-		memcpy(&index_block, buffer.data->b + (loc_of_index * sizeof(block_no_t)), sizeof(block_no_t));
-		brelse(&buffer);
-		offset = offset % siz_index[indirection_lvl - 1];
-		fsz -= index * siz_index[indirection_lvl - 1];
-		indirection_lvl--;
-	}
-	*block_no = index_block;
+	/* the translation comes from the inode's bmap cache. an index block is read only when a chunk is filled */
+	if (bmcache_lookup(inode, offset / MY_BLK_SIZE, block_no, NULL) != 0)
+		return -1;
+	*byte_offset = offset % MY_BLK_SIZE;
 	if ((fsz - 1) / MY_BLK_SIZE == offset / MY_BLK_SIZE)
 	{
 		*num_bytes_in_block = fsz - offset;
@@ -212,6 +437,27 @@ int bmap(inode_t *inode, offset_t offset, block_no_t *block_no, offset_t *byte_o
 	return 0;
 }
 
+/* maps a logical block to its physical block and tells how many blocks from it on are mapped contiguously.
+ * if the block is not mapped, *physical is 0 and *run tells how many blocks from it on are unmapped too.
+ * a run does not go past the end of a bmap cache chunk. the size of the file is not considered. */
+int bmap_run(inode_t *inode, block_no_t logical_block_no, block_no_t *physical, u_int32_t *run)
+{
+	if ((offset_t)logical_block_no * MY_BLK_SIZE >= INODE_MAX_SIZE(inode))
+		return -1;
+	return bmcache_lookup(inode, logical_block_no, physical, run);
+}
+
+/* where a new block for a logical block of a file should go: right after the block mapped before it.
+ * gives the cursor of the allocation group of the inode if there is no such block. */
+block_no_t alloc_goal(inode_t *inode, block_no_t logical_block_no)
+{
+	block_no_t physical;
+	u_int32_t run;
+	if (logical_block_no > 0 && bmap_run(inode, logical_block_no - 1, &physical, &run) == 0 && physical != 0)
+		return physical + 1;
+	return bgroup_goal(inode->inode_no);
+}
+
 int extract_name(const char *p, char *dest)
 {
 	if (p[0] != '/')
@@ -262,95 +508,417 @@ int namei(const char *path, inode_t **inode)
 	*inode = cur;
 	return 0;
 }
-int ialloc(inode_t **inode)
+/* fills an inode table block with unused inodes */
+void itable_fill(block_t *block)
 {
-	if (super_block.ifreeptr == 0)
+	for (int i = 0; i < INODES_PER_BLOCK; i++)
+		memcpy(block->b + i * DISK_INODE_SIZE, &model_unused_inode, DISK_INODE_SIZE);
+}
+
+/* makes the next ITABLE_LAZY_BLOCKS blocks of a lazily made inode table, so their inodes can be allocated.
+ * the blocks were never written, so they are not read: the cache gives them zeroed. ialloc_lock is held */
+static int itable_extend()
+{
+	inode_no_t from = super_block.ilazy, to = from + ITABLE_LAZY_BLOCKS * INODES_PER_BLOCK - 1;
+	if (to > super_block.num_inodes)
+		to = super_block.num_inodes;
+	for (block_no_t block_no = INODE_NO_TO_BLOCK_NO(from); block_no <= INODE_NO_TO_BLOCK_NO(to); block_no++)
+	{
+		buffer_t buffer;
+		if (bnew(block_no, &buffer) != 0)
+			return -1;
+		itable_fill(buffer.data);
+		BUFF_SET_FIELD(buffer, BUFF_JOURNAL);
+		brelse(&buffer);
+	}
+	/* last: allocations look at it without the lock */
+	__atomic_store_n(&super_block.ilazy, to < super_block.num_inodes ? to + 1 : 0, __ATOMIC_RELEASE);
+	return 0;
+}
+
+#define IMAP_IS_SET(ino) ((__atomic_load_n(imap + (ino) / 64, __ATOMIC_RELAXED) >> ((ino) % 64)) & 1)
+#define IGROUP_OF(ino) (((ino) - 1) / igroup_size)
+
+/* reads the inode bitmap into imap and counts the free inodes of each group. the bitmap is read past the cache: no
+ * bitmap block has been changed since the volume was mounted, so the disk has them as they are. ialloc_lock is held */
+static int imap_load()
+{
+	u_int32_t n = IBITMAP_BLOCKS(super_block.num_inodes);
+	igroup_size = super_block.group_inodes != 0 ? super_block.group_inodes : super_block.num_inodes;
+	num_igroups = (super_block.num_inodes + igroup_size - 1) / igroup_size;
+	u_int64_t *map = malloc(n * sizeof(block_t));
+	igroup_t *groups = calloc(num_igroups, sizeof(igroup_t));
+	int ret = map != NULL && groups != NULL ? 0 : -1;
+	for (u_int32_t i = 0, k; ret == 0 && i < n; i += k)
+	{
+		block_t *blockp[DISK_MAX_IOV];
+		k = n - i < DISK_MAX_IOV ? n - i : DISK_MAX_IOV;
+		for (u_int32_t j = 0; j < k; j++)
+			blockp[j] = (block_t *)map + i + j;
+		if (disk_read(disk_fd, super_block.ibitmap_start + i, blockp, k) != (int)k)
+			ret = -1;
+	}
+	if (ret != 0)
+	{
+		free(map);
+		free(groups);
 		return -1;
-	block_no_t block_no;
-	offset_t offset;
-	inode_no_t inode_no;
-	/* get location of inode on disk */
-	block_no = INODE_NO_TO_BLOCK_NO(super_block.ifreeptr);
-	offset = INODE_NO_TO_BYTE_OFF(super_block.ifreeptr);
+	}
+	/* inode 0 and those past the table are never free, whatever the disk says */
+	map[0] |= 1;
+	for (u_int64_t ino = (u_int64_t)super_block.num_inodes + 1; ino < (u_int64_t)n * BITS_PER_BITMAP_BLOCK; ino++)
+		map[ino / 64] |= (u_int64_t)1 << (ino % 64);
+	super_block.num_free_inodes = 0;
+	for (inode_no_t ino = 1; ino <= super_block.num_inodes; ino++)
+	{
+		if (!((map[ino / 64] >> (ino % 64)) & 1))
+			groups[IGROUP_OF(ino)].free++;
+	}
+	for (u_int32_t g = 0; g < num_igroups; g++)
+	{
+		pthread_mutex_init(&groups[g].lock, NULL);
+		super_block.num_free_inodes += groups[g].free;
+	}
+	imap = map;
+	/* last: ialloc_enter looks at it without the lock */
+	__atomic_store_n(&igroups, groups, __ATOMIC_RELEASE);
+	return 0;
+}
+
+/* forgets imap. ialloc_lock is held and no allocation is running */
+static void imap_drop()
+{
+	igroup_t *groups = igroups;
+	__atomic_store_n(&igroups, NULL, __ATOMIC_RELEASE);
+	for (u_int32_t g = 0; groups != NULL && g < num_igroups; g++)
+		pthread_mutex_destroy(&groups[g].lock);
+	free(groups);
+	free(imap);
+	imap = NULL;
+	__atomic_fetch_add(&imap_generation, 1, __ATOMIC_RELEASE);
+}
+
+/* reads the inode bitmap the first time */
+static int ialloc_enter()
+{
+	if (__atomic_load_n(&igroups, __ATOMIC_ACQUIRE) != NULL)
+		return 0;
+	pthread_mutex_lock(&ialloc_lock);
+	int ret = igroups == NULL ? imap_load() : 0;
+	pthread_mutex_unlock(&ialloc_lock);
+	if (ret != 0)
+		perror("ialloc: cannot read inode bitmap\n");
+	return ret;
+}
+
+/* first inode in [from, to) clear in imap. to if there is none. the lock of the group holding the range is held */
+static inode_no_t imap_find(inode_no_t from, inode_no_t to)
+{
+	while (from < to)
+	{
+		/* a word can hold bits of two groups. the other group may change its bits meanwhile */
+		u_int64_t word = ~__atomic_load_n(imap + from / 64, __ATOMIC_RELAXED) & ~(u_int64_t)0 << (from % 64);
+		if (word != 0)
+		{
+			inode_no_t ino = from - from % 64 + __builtin_ctzll(word);
+			return ino < to ? ino : to;
+		}
+		from = from - from % 64 + 64;
+	}
+	return to;
+}
+
+/* the lock of the group of ino is held */
+static void imap_set(inode_no_t ino, int value)
+{
+	if (value)
+	{
+		__atomic_fetch_or(imap + ino / 64, (u_int64_t)1 << (ino % 64), __ATOMIC_RELAXED);
+		__atomic_fetch_sub(&igroups[IGROUP_OF(ino)].free, 1, __ATOMIC_RELAXED);
+	}
+	else
+	{
+		__atomic_fetch_and(imap + ino / 64, ~((u_int64_t)1 << (ino % 64)), __ATOMIC_RELAXED);
+		__atomic_fetch_add(&igroups[IGROUP_OF(ino)].free, 1, __ATOMIC_RELAXED);
+	}
+}
+
+/* takes the first inode of [from, to) clear in imap, in group g. 0 if there is none */
+static inode_no_t igroup_take(u_int32_t g, inode_no_t from, inode_no_t to)
+{
+	if (from >= to || __atomic_load_n(&igroups[g].free, __ATOMIC_RELAXED) == 0)
+		return 0;
+	pthread_mutex_lock(&igroups[g].lock);
+	inode_no_t ino = imap_find(from, to);
+	if (ino != to)
+		imap_set(ino, 1);
+	pthread_mutex_unlock(&igroups[g].lock);
+	return ino != to ? ino : 0;
+}
+
+/* takes a free inode from imap: in the group of goal from the start of its inode table block, then in the groups
+ * after it, at last in the part of its group before it. only made table blocks are searched until none of them has
+ * a free inode. 0 if there is none */
+static inode_no_t imap_take(inode_no_t goal)
+{
+	for (;;)
+	{
+		inode_no_t lazy = __atomic_load_n(&super_block.ilazy, __ATOMIC_ACQUIRE);
+		inode_no_t limit = lazy != 0 ? lazy : super_block.num_inodes + 1, ino = 0;
+		if (goal == 0 || goal >= limit)
+			goal = 1;
+		u_int32_t start = IGROUP_OF(goal);
+		inode_no_t from = goal - (goal - 1) % INODES_PER_BLOCK;
+		for (u_int32_t k = 0; k <= num_igroups && ino == 0; k++)
+		{
+			u_int32_t g = (start + k) % num_igroups;
+			inode_no_t first = g * igroup_size + 1, end = first + igroup_size < limit ? first + igroup_size : limit;
+			if (k == 0)
+				ino = igroup_take(g, from, end);
+			else if (k == num_igroups)
+				ino = igroup_take(g, first, from);
+			else
+				ino = igroup_take(g, first, end);
+		}
+		if (ino != 0 || lazy == 0)
+			return ino;
+		pthread_mutex_lock(&ialloc_lock);
+		int ret = super_block.ilazy == lazy ? itable_extend() : 0; /* else another thread made the next blocks */
+		pthread_mutex_unlock(&ialloc_lock);
+		if (ret != 0)
+			return 0;
+	}
+}
+
+/* gives the inodes of a thread's cache back to imap */
+static void icache_return(ialloc_cache_t *cache)
+{
+	u_int32_t generation = __atomic_load_n(&imap_generation, __ATOMIC_ACQUIRE);
+	for (int i = 0; i < cache->count && cache->generation == generation; i++)
+	{
+		pthread_mutex_lock(&igroups[IGROUP_OF(cache->inodes[i])].lock);
+		imap_set(cache->inodes[i], 0);
+		pthread_mutex_unlock(&igroups[IGROUP_OF(cache->inodes[i])].lock);
+	}
+	cache->count = 0;
+	cache->generation = generation;
+}
+
+/* runs when a thread with an allocation cache exits */
+static void icache_destroy(void *arg)
+{
+	icache_return(arg);
+	free(arg);
+}
+
+static void icache_key_init()
+{
+	pthread_key_create(&ialloc_cache_key, icache_destroy);
+}
+
+/* the allocation cache of the calling thread. NULL if it cannot be made */
+static ialloc_cache_t *icache_get()
+{
+	pthread_once(&ialloc_cache_once, icache_key_init);
+	ialloc_cache_t *cache = pthread_getspecific(ialloc_cache_key);
+	if (cache == NULL && (cache = calloc(1, sizeof(ialloc_cache_t))) != NULL)
+	{
+		cache->generation = __atomic_load_n(&imap_generation, __ATOMIC_ACQUIRE);
+		if (pthread_setspecific(ialloc_cache_key, cache) != 0)
+		{
+			free(cache);
+			cache = NULL;
+		}
+	}
+	return cache;
+}
+
+/* 1 if no inode of the inode table block of ino is free */
+static int itable_block_full(inode_no_t ino)
+{
+	inode_no_t first = ino - (ino - 1) % INODES_PER_BLOCK;
+	for (inode_no_t i = first; i < first + INODES_PER_BLOCK && i <= super_block.num_inodes; i++)
+		if (!IMAP_IS_SET(i))
+			return 0;
+	return 1;
+}
+
+/* takes an inode from the cache without a lock: one in the table block of goal, or any if goal is 0 or its block
+ * has no free inodes left. 0 if the cache has no such inode */
+static inode_no_t icache_take(ialloc_cache_t *cache, inode_no_t goal)
+{
+	if (cache->count == 0 || __atomic_load_n(&imap_generation, __ATOMIC_ACQUIRE) != cache->generation)
+		return 0;
+	int pick = -1;
+	for (int i = 0; i < cache->count && goal != 0 && pick < 0; i++)
+		if (INODE_NO_TO_BLOCK_NO(cache->inodes[i]) == INODE_NO_TO_BLOCK_NO(goal))
+			pick = i;
+	if (pick < 0 && (goal == 0 || itable_block_full(goal)))
+		pick = 0;
+	if (pick < 0)
+		return 0;
+	inode_no_t ino = cache->inodes[pick];
+	cache->inodes[pick] = cache->inodes[--cache->count];
+	return ino;
+}
+
+/* sets or clears the bit of an inode in the bitmap on disk */
+static int ibitmap_set(inode_no_t ino, int value)
+{
 	buffer_t buffer;
-	bread(block_no, &buffer);
-	/* calculate offset of list element in the inode */
-	offset += offsetof(disk_inode_t, index) + sizeof(inode_no_t) * (INODE_INDEX_COUNT - super_block.ifreecount);
-	memcpy(&inode_no, buffer.data->b + offset, sizeof(inode_no_t));
-	memset(buffer.data->b + offset, 0, sizeof(inode_no_t));
-	BUFF_SET_FIELD(buffer, BUFF_MODIFIED);
-	brelse(&buffer);
-	if (super_block.ifreecount == 1)
+	if (bread(super_block.ibitmap_start + ino / BITS_PER_BITMAP_BLOCK, &buffer) != 0)
+		return -1;
+	int bit = ino % BITS_PER_BITMAP_BLOCK;
+	if (((buffer.data->b[bit / 8] >> (bit % 8)) & 1) == value)
 	{
-		inode_no_t t = inode_no;
-		inode_no = super_block.ifreeptr;
-		super_block.ifreeptr = t;
-		super_block.ifreecount = INODE_INDEX_COUNT;
+		brelse(&buffer);
+		return -1;
 	}
+	if (value)
+		buffer.data->b[bit / 8] |= 1 << (bit % 8);
 	else
+		buffer.data->b[bit / 8] &= ~(1 << (bit % 8));
+	BUFF_SET_FIELD(buffer, BUFF_MODIFIED | BUFF_JOURNAL);
+	brelse(&buffer);
+	if (value)
+		__atomic_fetch_sub(&super_block.num_free_inodes, 1, __ATOMIC_RELAXED);
+	else
+		__atomic_fetch_add(&super_block.num_free_inodes, 1, __ATOMIC_RELAXED);
+	return 0;
+}
+
+/* allocates an inode, preferably in the same inode table block as goal (the parent directory), so related
+ * inodes are read together. a goal of 0 means no preference. each thread takes IALLOC_BATCH free inodes at a time
+ * into a cache of its own, so threads allocating at once rarely wait for each other. */
+int ialloc_near(inode_no_t goal, inode_t **inode)
+{
+	ialloc_cache_t *cache = icache_get();
+	inode_no_t inode_no = cache != NULL ? icache_take(cache, goal) : 0;
+	if (inode_no == 0)
 	{
-		super_block.ifreecount--;
+		if (ialloc_enter() != 0)
+			return -1;
+		if (cache != NULL)
+		{
+			/* inodes cached far from goal are given back, and the cache is filled near it */
+			icache_return(cache);
+			for (inode_no_t ino = goal; cache->count < IALLOC_BATCH && (ino = imap_take(ino)) != 0;)
+				cache->inodes[cache->count++] = ino;
+			inode_no = icache_take(cache, 0);
+		}
+		else
+			inode_no = imap_take(goal);
+	}
+	if (inode_no == 0)
+	{
+		perror("ialloc: no free inodes\n");
+		return -1;
+	}
+	if (ibitmap_set(inode_no, 1) != 0)
+	{
+		perror("ialloc: inode bitmap is wrong\n");
+		return -1;
 	}
 	if (iget(inode_no, inode) != 0)
 	{
 		perror("ialloc: could not get free inode\n");
+		ifree(inode_no);
 		return -1;
 	}
-	//? check if there is some fields to be set for new inodes
 	return 0;
 }
-int ifree(inode_no_t inode_no)
+
+int ialloc(inode_t **inode)
 {
-	block_no_t block_no;
-	offset_t offset;
-	buffer_t buffer;
-	disk_inode_t disk_inode;
-	if (super_block.ifreecount == INODE_INDEX_COUNT)
+	return ialloc_near(0, inode);
+}
+
+/* first inode of the group a new directory should go in: among the made groups with at least the average number of
+ * free inodes, the one with the most free blocks. spreads directories, and the files that go in them, over the groups.
+ * 0 if no group has a free inode */
+inode_no_t igroup_pick()
+{
+	if (ialloc_enter() != 0)
+		return 0;
+	inode_no_t lazy = __atomic_load_n(&super_block.ilazy, __ATOMIC_ACQUIRE);
+	u_int32_t made = lazy != 0 ? IGROUP_OF(lazy - 1) + 1 : num_igroups;
+	u_int64_t total = 0;
+	for (u_int32_t g = 0; g < made; g++)
+		total += __atomic_load_n(&igroups[g].free, __ATOMIC_RELAXED);
+	int best = -1;
+	u_int32_t best_free = 0;
+	for (u_int32_t g = 0; g < made; g++)
 	{
-		block_no = INODE_NO_TO_BLOCK_NO(inode_no);
-		offset = INODE_NO_TO_BYTE_OFF(inode_no);
-		if (bread(block_no, &buffer) != 0)
+		u_int64_t free_inodes = __atomic_load_n(&igroups[g].free, __ATOMIC_RELAXED);
+		if (free_inodes == 0 || free_inodes * made < total)
+			continue;
+		if (best < 0 || bgroup_free(g) > best_free)
 		{
-			perror("ifree: cannot access free inode\n");
-			return -1;
+			best = g;
+			best_free = bgroup_free(g);
 		}
-		memcpy(&disk_inode, buffer.data->b + offset, DISK_INODE_SIZE);
-		clear_inode(&disk_inode);
-		*((block_no_t *)(&disk_inode.index) + INODE_INDEX_COUNT - 1) = super_block.ifreeptr;
-		memcpy(buffer.data->b + offset, &disk_inode, DISK_INODE_SIZE);
-		BUFF_SET_FIELD(buffer, BUFF_MODIFIED);
-		brelse(&buffer);
-		super_block.ifreeptr = inode_no;
-		super_block.ifreecount = 1;
 	}
-	else
+	return best < 0 ? 0 : best * igroup_size + 1;
+}
+
+/* frees an inode. it goes to the cache of the calling thread if there is room, else back to imap */
+int ifree(inode_no_t inode_no)
+{
+	if (inode_no == 0 || inode_no > super_block.num_inodes)
 	{
-		block_no = INODE_NO_TO_BLOCK_NO(inode_no);
-		offset = INODE_NO_TO_BYTE_OFF(inode_no);
-		bread(block_no, &buffer);
-		memcpy(&disk_inode, buffer.data->b + offset, DISK_INODE_SIZE);
-		clear_inode(&disk_inode);
-		memcpy(buffer.data->b + offset, &disk_inode, DISK_INODE_SIZE);
-		BUFF_SET_FIELD(buffer, BUFF_MODIFIED);
-		brelse(&buffer);
-		block_no = INODE_NO_TO_BLOCK_NO(super_block.ifreeptr);
-		offset = INODE_NO_TO_BYTE_OFF(super_block.ifreeptr);
-		bread(block_no, &buffer);
-		memcpy(&disk_inode, buffer.data->b + offset, DISK_INODE_SIZE);
-		super_block.ifreecount++;
-		*((block_no_t *)(&disk_inode.index) + INODE_INDEX_COUNT - super_block.ifreecount) = inode_no;
-		memcpy(buffer.data->b + offset, &disk_inode, DISK_INODE_SIZE);
-		BUFF_SET_FIELD(buffer, BUFF_MODIFIED);
-		brelse(&buffer);
+		perror("ifree: inode out of range\n");
+		return -1;
+	}
+	if (ialloc_enter() != 0)
+		return -1;
+	if (ibitmap_set(inode_no, 0) != 0)
+	{
+		// ! inode is freed twice
+		perror("ifree: inode is already free\n");
+		return -1;
 	}
+	ialloc_cache_t *cache = icache_get();
+	if (cache != NULL && cache->count < IALLOC_BATCH && __atomic_load_n(&imap_generation, __ATOMIC_ACQUIRE) == cache->generation)
+	{
+		cache->inodes[cache->count++] = inode_no;
+		return 0;
+	}
+	pthread_mutex_lock(&igroups[IGROUP_OF(inode_no)].lock);
+	imap_set(inode_no, 0);
+	pthread_mutex_unlock(&igroups[IGROUP_OF(inode_no)].lock);
 	return 0;
 }
 
+/* reads the inode bitmap of a volume being mounted. caches of threads are dropped */
+int imount()
+{
+	pthread_mutex_lock(&ialloc_lock);
+	imap_drop();
+	int ret = imap_load();
+	pthread_mutex_unlock(&ialloc_lock);
+	return ret;
+}
+
+/* forgets the inode bitmap of a volume being unmounted */
+void iumount()
+{
+	pthread_mutex_lock(&ialloc_lock);
+	imap_drop();
+	pthread_mutex_unlock(&ialloc_lock);
+}
+
 int add_physical_block(inode_t *inode, block_no_t logical_block_no, block_no_t physical_block_no)
 {
+	if (INO_USES_EXTENTS(inode))
+	{
+		if (extent_map(inode, logical_block_no, physical_block_no, 1) != 0)
+			return -1;
+		bmcache_update(inode, logical_block_no, physical_block_no);
+		return 0;
+	}
 	buffer_t buffer;
-	offset_t offset = logical_block_no * MY_BLK_SIZE;
-	block_no_t index_block;
+	offset_t offset = (offset_t)logical_block_no * MY_BLK_SIZE;
+	block_no_t index_block = 0;
 	int indirection_lvl = 1;
 	if (offset < CAP_0DEG_INDEX)
 	{
@@ -365,11 +933,14 @@ int add_physical_block(inode_t *inode, block_no_t logical_block_no, block_no_t p
 		index_block = inode->disk_inode.index.deg1[index];
 		if (index_block == 0)
 		{
-			balloc(&buffer);
+			/* index block goes next to the data it maps */
+			if (balloc_near(physical_block_no, &buffer) != 0)
+				return -1;
 			index_block = inode->disk_inode.index.deg1[index] = buffer.header->block_no;
 			INO_SET_FIELD(inode, INODE_MODIFIED);
 			brelse(&buffer);
 		}
+		offset = offset % siz_index[1];
 	}
 	else if ((offset -= CAP_1DEG_INDEX) < CAP_2DEG_INDEX)
 	{
@@ -381,6 +952,8 @@ int add_physical_block(inode_t *inode, block_no_t logical_block_no, block_no_t p
 		indirection_lvl = 3;
 		/* handle 3 degree index */
 	}
+	else
+		return -1; /* past the largest file */
 	while (indirection_lvl != 1)
 	{
 		int index = offset / siz_index[indirection_lvl - 1];
@@ -396,13 +969,14 @@ int add_physical_block(inode_t *inode, block_no_t logical_block_no, block_no_t p
 		brelse(&buffer);
 		if (entry == 0)
 		{
-			balloc(&buffer);
+			if (balloc_near(physical_block_no, &buffer) != 0)
+				return -1;
 			entry = buffer.header->block_no;
 			INO_SET_FIELD(inode, INODE_MODIFIED);
 			brelse(&buffer);
 			bread(index_block, &buffer);
 			memcpy(buffer.data->b + (loc_of_index * sizeof(block_no_t)), &entry, sizeof(block_no_t));
-			BUFF_SET_FIELD(buffer, BUFF_MODIFIED);
+			BUFF_SET_FIELD(buffer, BUFF_MODIFIED | BUFF_JOURNAL);
 			brelse(&buffer);
 		}
 		offset = offset % siz_index[indirection_lvl - 1];
@@ -419,44 +993,46 @@ int add_physical_block(inode_t *inode, block_no_t logical_block_no, block_no_t p
 	bread(index_block, &buffer);
 	memcpy(&entry, buffer.data->b + (loc_of_index * sizeof(block_no_t)), sizeof(block_no_t));
 	memcpy(buffer.data->b + (loc_of_index * sizeof(block_no_t)), &physical_block_no, sizeof(block_no_t));
-	BUFF_SET_FIELD(buffer, BUFF_MODIFIED);
+	BUFF_SET_FIELD(buffer, BUFF_MODIFIED | BUFF_JOURNAL);
 	brelse(&buffer);
+	bmcache_update(inode, logical_block_no, physical_block_no);
 	if (entry != 0)
 		bfree(entry);
 	return 0;
 }
 
+/* frees the blocks an index block points to. entries of a degree 1 index are data blocks */
 void free_index(block_t *index, int degree)
 {
-	if (degree == 1)
-	{
-		for (offset_t offset = 0; offset < MY_BLK_SIZE; offset += sizeof(block_t))
-		{
-			block_no_t block_no = 0;
-			memcpy(&block_no, index + offset, sizeof(block_no_t));
-			if (block_no != 0)
-				bfree(block_no);
-		}
-	}
-	for (offset_t offset = 0; offset < MY_BLK_SIZE; offset += sizeof(block_t))
+	for (offset_t offset = 0; offset < MY_BLK_SIZE; offset += sizeof(block_no_t))
 	{
 		block_no_t block_no = 0;
-		memcpy(&block_no, index + offset, sizeof(block_no_t));
+		memcpy(&block_no, index->b + offset, sizeof(block_no_t));
 		if (block_no == 0)
 			continue;
-		block_t index_block;
-		buffer_t buffer;
-		bread(block_no, &buffer);
-		memcpy(&index_block, buffer.data, MY_BLK_SIZE);
-		brelse(&buffer);
-		free_index(&index_block, degree - 1);
+		if (degree > 1)
+		{
+			block_t index_block;
+			buffer_t buffer;
+			bread(block_no, &buffer);
+			memcpy(&index_block, buffer.data, MY_BLK_SIZE);
+			brelse(&buffer);
+			free_index(&index_block, degree - 1);
+		}
 		bfree(block_no);
 	}
 }
 
 int free_all_blocks(inode_t *inode)
 {
-	block_no_t *index = &(inode->disk_inode.index);
+	dalloc_discard(inode);
+	bmcache_invalidate(inode);
+	if (INO_USES_EXTENTS(inode))
+	{
+		inode->disk_inode.size_on_disk = 0;
+		return extent_free_all(inode);
+	}
+	block_no_t *index = inode->disk_inode.index.deg1;
 	for (int i = 0; i < NUM_0DEG_INDEX; i++)
 	{
 		if (*index != 0)
@@ -475,7 +1051,7 @@ int free_all_blocks(inode_t *inode)
 		{
 			bread(*index, &buffer);
 			memcpy(&index_block, buffer.data, MY_BLK_SIZE);
-			brelse(*index);
+			brelse(&buffer);
 			free_index(&index_block, 1);
 			bfree(*index);
 			INO_SET_FIELD(inode, INODE_MODIFIED);
@@ -483,4 +1059,6 @@ int free_all_blocks(inode_t *inode)
 		*index = 0;
 		index++;
 	}
+	inode->disk_inode.size_on_disk = 0;
+	return 0;
 }
\ No newline at end of file
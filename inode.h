@@ -2,16 +2,25 @@
 #ifndef INODE_H
 #define INODE_H
 
-#define MAX_ACTIVE_INODES 16
+/* most inodes kept in core, referenced or not. can be overridden at compile time. */
+#ifndef MAX_CACHED_INODES
+#define MAX_CACHED_INODES 1024
+#endif
+/* hash queues of the inode cache to start with. doubled as the cache grows. must be a power of 2. */
+#define INODE_HASH_MIN 64
 #define INODE_DEFAULT_STATUS 0b0
 #define INODE_ACTIVE 0b1
-#define INODE_LOCKED 0b10
+#define INODE_LOCKED 0b10 /* held exclusively. see ilock */
 #define INODE_MODIFIED 0b100
+#define INODE_PINNED 0b1000 /* never evicted from the inode cache */
+#define INODE_BUSY 0b10000 /* being read in, written back or thrown out of the inode cache. iget waits for it */
 #define FT_NONE 0b0
 #define FT_DIR 0b1
 #define FT_FIL 0b10
+#define INODE_FL_EXTENTS 0b1 /* blocks are mapped by extents instead of deg1 index blocks */
+#define INODE_FL_HTREE 0b10 /* directory entries are found through a hash index. see dir.h */
 
-const disk_inode_t model_unused_inode = {.index = {.deg1 = {0}}, .links = 0, .permission = {.permissions = 0}, .protection = 0, .size = 0, .size_on_disk = 0, .type = FT_NONE};
+const disk_inode_t model_unused_inode = {.index = {.deg1 = {0}}, .links = 0, .permission = {.permissions = 0}, .protection = 0, .size = 0, .size_on_disk = 0, .type = FT_NONE, .flags = 0};
 
 #define SIZ_0DEG_INDEX ((offset_t)MY_BLK_SIZE)
 #define SIZ_1DEG_INDEX (INDEX_SIZE * SIZ_0DEG_INDEX)
@@ -23,13 +32,72 @@ const disk_inode_t model_unused_inode = {.index = {.deg1 = {0}}, .links = 0, .pe
 #define CAP_3DEG_INDEX (SIZ_3DEG_INDEX * NUM_3DEG_INDEX)
 
 #define MAX_FILE_SIZE (CAP_0DEG_INDEX + CAP_1DEG_INDEX + CAP_2DEG_INDEX + CAP_3DEG_INDEX)
+/* extent block: a u16 count and u16 depth (always 0: leaf), 4 unused bytes, then sorted extents */
+#define EXTENT_BLOCK_HEADER_SIZE 8
+#define EXTENTS_PER_BLOCK ((int)((MY_BLK_SIZE - EXTENT_BLOCK_HEADER_SIZE) / sizeof(extent_t)))
+/* size_on_disk counts bytes in 32 bits */
+#define MAX_EXTENT_FILE_SIZE ((offset_t)UINT32_MAX + 1 - MY_BLK_SIZE)
+/* in extent length: blocks are allocated but were never written. they read as zeros */
+#define EXTENT_UNWRITTEN 0x80000000u
+#define EXTENT_LEN(ext) ((ext).length & ~EXTENT_UNWRITTEN)
+#define EXTENT_IS_UNWRITTEN(ext) (((ext).length & EXTENT_UNWRITTEN) != 0)
+#define INO_USES_EXTENTS(inoptr) (((inoptr)->disk_inode.flags & INODE_FL_EXTENTS) != 0)
+#define INO_USES_HTREE(inoptr) (((inoptr)->disk_inode.flags & INODE_FL_HTREE) != 0)
+#define INODE_MAX_SIZE(inoptr) (INO_USES_EXTENTS(inoptr) ? MAX_EXTENT_FILE_SIZE : MAX_FILE_SIZE)
+
+/* logical blocks per chunk of the block map translation cache. a chunk covers one deg1 index block */
+#define BMAP_CHUNK_SIZE INDEX_SIZE
+/* chunks shared by all inodes. bounds the memory of the cache. can be overridden at compile time. */
+#ifndef BMAP_CACHE_CHUNKS
+#define BMAP_CACHE_CHUNKS 32
+#endif
+
+/* most blocks waiting for delayed allocation at a time. writeback runs once that many are waiting */
+#define DALLOC_MAX (NUM_BUFFERS / 2)
 
 #define INODE_NO_TO_BLOCK_NO(ino) (NUM_SUPER_BLOCKS + ((ino)-1) / INODES_PER_BLOCK)
 #define INODE_NO_TO_BYTE_OFF(ino) (((ino)-1) % INODES_PER_BLOCK * DISK_INODE_SIZE)
+/* inode table blocks made at once on a volume whose table is made lazily. see itable_extend */
+#ifndef ITABLE_LAZY_BLOCKS
+#define ITABLE_LAZY_BLOCKS 16
+#endif
+/* free inodes a thread takes from the inode bitmap at once. see ialloc_near */
+#ifndef IALLOC_BATCH
+#define IALLOC_BATCH 8
+#endif
+
+/* free inodes set aside for one thread. they are set in imap, but not in the bitmap on disk */
+typedef struct
+{
+	u_int32_t generation; /* imap_generation when the inodes were taken */
+	int count;
+	inode_no_t inodes[IALLOC_BATCH];
+} ialloc_cache_t;
 
-#define INO_SET_FIELD(inoptr, field) ((inoptr)->status |= (field))
-#define INO_REM_FIELD(inoptr, field) ((inoptr)->status &= (~field))
-#define INO_IS_SET(inoptr, field) (((inoptr)->status & (field)) == (field))
+#define INO_SET_FIELD(inoptr, field) __atomic_fetch_or(&(inoptr)->status, (field), __ATOMIC_SEQ_CST)
+#define INO_REM_FIELD(inoptr, field) __atomic_fetch_and(&(inoptr)->status, ~(field), __ATOMIC_SEQ_CST)
+#define INO_IS_SET(inoptr, field) ((__atomic_load_n(&(inoptr)->status, __ATOMIC_SEQ_CST) & (field)) == (field))
 
 extern void clear_inode(disk_inode_t *);
+extern void ilock(inode_t *);
+extern void ilock_shared(inode_t *);
+extern int itrylock(inode_t *, int);
+extern void iunlock(inode_t *);
+extern int iwrite(inode_t *);
+extern int iclearcache();
+extern void itable_fill(block_t *);
+extern int extent_load(inode_t *, extent_t *);
+extern int extent_store(inode_t *, extent_t *, int);
+extern int extent_lookup(inode_t *, block_no_t, block_no_t *, u_int32_t *);
+extern int extent_map(inode_t *, block_no_t, block_no_t, u_int32_t);
+extern int extent_free_all(inode_t *);
+extern int extent_written(inode_t *, block_no_t, u_int32_t);
+extern int extent_enable(inode_t *);
+extern int bmcache_lookup(inode_t *, block_no_t, block_no_t *, u_int32_t *);
+extern void bmcache_update(inode_t *, block_no_t, block_no_t);
+extern void bmcache_invalidate(inode_t *);
+extern int dalloc_block(inode_t *, block_no_t, buffer_t *);
+extern void dalloc_fill(inode_t *, block_no_t, block_no_t *, u_int32_t);
+extern int dalloc_inode(inode_t *);
+extern void dalloc_discard(inode_t *);
 #endif
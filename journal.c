@@ -0,0 +1,749 @@
+#include "myfs.h"
+#include "journal.h"
+#include "buffer_cache.h"
+#include "disk.h"
+#include <time.h>
+
+/* metadata journal. a modified metadata block is logged when its buffer is released: its image is copied into the
+ * running transaction, and the buffer is not written home before that transaction is committed.
+ * committing writes the transaction's images after the last one in the journal region with one write, and syncs.
+ * everything logged meanwhile by any thread goes with it, so concurrent syncs share one commit.
+ * images are written home later by the buffer cache and, once the region fills, by a checkpoint, which writes the
+ * latest committed image of every block home and starts the region over. after a crash, committed transactions
+ * still in the region are replayed by jrecover.
+ * a freed block with a committed image is not reused until its release is committed, so replay never writes over
+ * data in a reused block. */
+
+/* where a block stands in the journal */
+typedef struct
+{
+	block_no_t block_no; /* JMAP_EMPTY if the slot is unused */
+	int running;		 /* its entry in the running transaction. -1 if it has none */
+	block_no_t live;	 /* journal block of its latest committed image. 0 if it has none */
+} jmap_t;
+#define JMAP_EMPTY (~(block_no_t)0)
+/* live of a block whose first image is in a transaction being written. it is freed as if it had a committed one */
+#define JMAP_WRITING (~(block_no_t)0)
+
+typedef struct
+{
+	u_int64_t seq;
+	block_no_t *block_nos; /* home block of each entry, or JOURNAL_REVOKE | block no */
+	block_t *images;	   /* image of each entry. unused for revokes */
+	int count, size;
+	time_t started; /* when the first entry was logged */
+} jtxn_t;
+
+jmap_t *jmap = NULL;
+u_int32_t jmap_size = 0, jmap_used = 0;
+jtxn_t jrunning = {.seq = 1};
+u_int64_t jdone = 0; /* last transaction committed */
+block_no_t jhead = 1; /* block of the region where the next transaction goes */
+int jbusy = 0;		  /* a transaction or a checkpoint is being written */
+int jupdates = 0;	  /* operations in progress */
+int jpending = 0;	  /* commits waiting for operations in progress to end. no new operation starts meanwhile */
+/* blocks released by committed transactions, waiting to be freed */
+block_no_t *jdeferred = NULL;
+int jdeferred_count = 0, jdeferred_size = 0;
+/* syncs of the disk started and done. a sync covers every write made before it started */
+u_int64_t jsync_started = 0, jsync_done = 0, jsync_failed = 0;
+int jready = 0, jinit_ret = 0;
+/* jlock guards everything above. it is taken last, after buffers and every other lock */
+pthread_mutex_t jlock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t jdrained = PTHREAD_COND_INITIALIZER; /* operations in progress ended */
+pthread_cond_t jopen = PTHREAD_COND_INITIALIZER;	/* operations may start again */
+pthread_cond_t jturn = PTHREAD_COND_INITIALIZER;	/* a transaction or checkpoint was written */
+pthread_cond_t jsynced = PTHREAD_COND_INITIALIZER;
+pthread_mutex_t jinit_lock = PTHREAD_MUTEX_INITIALIZER; /* guards jready. taken before jlock */
+/* operations the thread is nested in. only the outermost one is counted */
+__thread int jdepth = 0, jcounted = 0;
+
+
+/* the volume has a journal. a mapped image is written in place, so nothing could be held back for it */
+static int jactive()
+{
+	if (super_block.journal_blocks < 2 || DISK_IS_MAPPED())
+		return 0;
+	if (!__atomic_load_n(&jready, __ATOMIC_ACQUIRE))
+		jrecover();
+	return jinit_ret == 0;
+}
+
+static u_int64_t jsum(u_int64_t sum, const void *data, size_t n)
+{
+	const u_int64_t *word = data;
+	for (size_t i = 0; i < n / sizeof(u_int64_t); i++)
+		sum = (sum ^ word[i]) * 0x100000001b3ull;
+	return sum;
+}
+
+static jmap_t *jmap_slot(jmap_t *map, u_int32_t size, block_no_t block_no)
+{
+	u_int32_t i = (block_no * 2654435761u) & (size - 1);
+	while (map[i].block_no != JMAP_EMPTY && map[i].block_no != block_no)
+		i = (i + 1) & (size - 1);
+	return map + i;
+}
+
+/* map entries without a running entry or a committed image are dropped. size is a power of 2 */
+static int jmap_rebuild(u_int32_t size)
+{
+	jmap_t *map = malloc(size * sizeof(jmap_t));
+	if (map == NULL)
+		return -1;
+	for (u_int32_t i = 0; i < size; i++)
+		map[i].block_no = JMAP_EMPTY;
+	u_int32_t used = 0;
+	for (u_int32_t i = 0; i < jmap_size; i++)
+	{
+		if (jmap[i].block_no == JMAP_EMPTY || (jmap[i].running < 0 && jmap[i].live == 0))
+			continue;
+		*jmap_slot(map, size, jmap[i].block_no) = jmap[i];
+		used++;
+	}
+	/* jrevoke looks at the count without the lock */
+	__atomic_store_n(&jmap_used, used, __ATOMIC_RELAXED);
+	free(jmap);
+	jmap = map;
+	jmap_size = size;
+	return 0;
+}
+
+/* where a block stands. with add set, an entry is made for a block that has none */
+static jmap_t *jmap_get(block_no_t block_no, int add)
+{
+	jmap_t *entry = jmap_size == 0 ? NULL : jmap_slot(jmap, jmap_size, block_no);
+	if (entry != NULL && entry->block_no == block_no)
+		return entry;
+	if (!add)
+		return NULL;
+	if ((jmap_used + 1) * 2 > jmap_size)
+	{
+		if (jmap_rebuild(jmap_size == 0 ? 1024 : jmap_size * 2) != 0)
+			return NULL;
+		entry = jmap_slot(jmap, jmap_size, block_no);
+	}
+	entry->block_no = block_no;
+	entry->running = -1;
+	entry->live = 0;
+	__atomic_fetch_add(&jmap_used, 1, __ATOMIC_RELAXED);
+	return entry;
+}
+
+/* adds an entry to the running transaction. returns its index, or -1 if there is no memory for it */
+static int jtxn_add(block_no_t entry)
+{
+	if (jrunning.count == jrunning.size)
+	{
+		int size = jrunning.size == 0 ? JOURNAL_TXN_BLOCKS : jrunning.size * 2;
+		block_no_t *block_nos = realloc(jrunning.block_nos, size * sizeof(block_no_t));
+		if (block_nos == NULL)
+			return -1;
+		jrunning.block_nos = block_nos;
+		block_t *images = realloc(jrunning.images, size * sizeof(block_t));
+		if (images == NULL)
+			return -1;
+		jrunning.images = images;
+		jrunning.size = size;
+	}
+	if (jrunning.count == 0)
+		jrunning.started = time(NULL);
+	jrunning.block_nos[jrunning.count] = entry;
+	return jrunning.count++;
+}
+
+/* takes an entry out of the running transaction. the last entry takes its place */
+static void jtxn_drop(int i)
+{
+	int last = --jrunning.count;
+	if (i == last)
+		return;
+	jrunning.block_nos[i] = jrunning.block_nos[last];
+	memcpy(jrunning.images + i, jrunning.images + last, MY_BLK_SIZE);
+	jmap_get(jrunning.block_nos[i] & ~JOURNAL_REVOKE, 0)->running = i;
+}
+
+/* makes sure a sync of the disk that started at generation need or later has completed. jlock is held */
+static int jsync(u_int64_t need)
+{
+	int ret = 0;
+	while (jsync_done < need)
+	{
+		if (jsync_started >= need)
+		{
+			/* one that covers the caller is running already */
+			pthread_cond_wait(&jsynced, &jlock);
+			continue;
+		}
+		u_int64_t gen = ++jsync_started;
+		pthread_mutex_unlock(&jlock);
+		ret = fdatasync(disk_fd);
+		pthread_mutex_lock(&jlock);
+		if (ret != 0 && gen > jsync_failed)
+			jsync_failed = gen;
+		if (gen > jsync_done)
+			jsync_done = gen;
+		pthread_cond_broadcast(&jsynced);
+	}
+	return jsync_failed >= need ? -1 : ret;
+}
+
+/* an image to copy home at a checkpoint */
+typedef struct
+{
+	block_no_t home, slot;
+	block_t *image;
+} jcopy_t;
+
+static int cmp_slot(const void *a, const void *b)
+{
+	block_no_t x = ((jcopy_t *)a)->slot, y = ((jcopy_t *)b)->slot;
+	return (x > y) - (x < y);
+}
+
+static int cmp_home(const void *a, const void *b)
+{
+	block_no_t x = ((jcopy_t *)a)->home, y = ((jcopy_t *)b)->home;
+	return (x > y) - (x < y);
+}
+
+/* copies count images between the journal or home blocks and memory. images with consecutive blocks are moved with one call */
+static int jcopy(jcopy_t *copy, int count, int home)
+{
+	block_t *blocks[DISK_MAX_IOV];
+	for (int i = 0, len; i < count; i += len)
+	{
+		block_no_t first = home ? copy[i].home : copy[i].slot;
+		for (len = 0; i + len < count && len < DISK_MAX_IOV && (home ? copy[i + len].home : copy[i + len].slot) == first + len; len++)
+			blocks[len] = copy[i + len].image;
+		int done = home ? disk_write(disk_fd, first, blocks, len) : disk_read(disk_fd, super_block.journal_start + first, blocks, len);
+		if (done != len)
+			return -1;
+	}
+	return 0;
+}
+
+/* writes the latest committed image of every block home, then starts the region over.
+ * the caller holds jlock and has set jbusy, so no transaction is written meanwhile. jlock is let go during io */
+static int jcheckpoint_locked()
+{
+	int n = 0, ret = 0;
+	jcopy_t *copy = malloc(jmap_used * sizeof(jcopy_t) + 1);
+	block_t *images = malloc(jmap_used * sizeof(block_t) + 1);
+	if (copy == NULL || images == NULL)
+	{
+		free(copy);
+		free(images);
+		return -1;
+	}
+	for (u_int32_t i = 0; i < jmap_size; i++)
+	{
+		if (jmap[i].block_no != JMAP_EMPTY && jmap[i].live != 0 && jmap[i].live != JMAP_WRITING)
+		{
+			copy[n] = (jcopy_t){jmap[i].block_no, jmap[i].live, images + n};
+			n++;
+		}
+	}
+	block_t block = {.b = {0}}, *blockp = &block;
+	journal_header_t header = {.magic = JOURNAL_MAGIC, .tail = 1, .seq = jdone + 1};
+	memcpy(block.b, &header, sizeof(header));
+	pthread_mutex_unlock(&jlock);
+	/* read in journal order, write in home order */
+	qsort(copy, n, sizeof(jcopy_t), cmp_slot);
+	if (jcopy(copy, n, 0) != 0)
+		ret = -1;
+	qsort(copy, n, sizeof(jcopy_t), cmp_home);
+	if (ret == 0 && jcopy(copy, n, 1) != 0)
+		ret = -1;
+	pthread_mutex_lock(&jlock);
+	if (ret == 0 && n > 0)
+		ret = jsync(jsync_started + 1);
+	/* the images are home. replay starts over at the transaction written next */
+	if (ret == 0)
+	{
+		pthread_mutex_unlock(&jlock);
+		ret = disk_write(disk_fd, super_block.journal_start, &blockp, 1) == 1 ? 0 : -1;
+		pthread_mutex_lock(&jlock);
+	}
+	if (ret == 0)
+		ret = jsync(jsync_started + 1);
+	if (ret == 0)
+	{
+		for (u_int32_t i = 0; i < jmap_size; i++)
+		{
+			if (jmap[i].live != JMAP_WRITING)
+				jmap[i].live = 0;
+		}
+		jmap_rebuild(jmap_size);
+		jhead = 1;
+	}
+	else
+		perror("journal: checkpoint failed\n");
+	free(copy);
+	free(images);
+	return ret;
+}
+
+/* writes a detached transaction after the last one in the region and syncs. the journal block of each image is
+ * given in slots. jlock is held and jbusy is set. jlock is let go during io */
+static int jwrite(jtxn_t *txn, block_no_t *slots)
+{
+	int images = 0, groups = (txn->count + JOURNAL_DESC_ENTRIES - 1) / JOURNAL_DESC_ENTRIES;
+	for (int i = 0; i < txn->count; i++)
+	{
+		if (!(txn->block_nos[i] & JOURNAL_REVOKE))
+			images++;
+	}
+	u_int32_t need = groups + images;
+	if (need >= super_block.journal_blocks)
+	{
+		perror("journal: transaction is larger than the journal\n");
+		return -1;
+	}
+	if (jhead + need > super_block.journal_blocks && jcheckpoint_locked() != 0)
+		return -1;
+	block_t *desc = calloc(groups, sizeof(block_t)), **blocks = malloc(need * sizeof(block_t *));
+	if (desc == NULL || blocks == NULL)
+	{
+		free(desc);
+		free(blocks);
+		return -1;
+	}
+	block_no_t start = jhead;
+	pthread_mutex_unlock(&jlock);
+	int k = 0;
+	for (int g = 0; g < groups; g++)
+	{
+		int first = g * JOURNAL_DESC_ENTRIES, count = txn->count - first < JOURNAL_DESC_ENTRIES ? txn->count - first : JOURNAL_DESC_ENTRIES;
+		journal_desc_t header = {.magic = JOURNAL_MAGIC, .count = count, .seq = txn->seq, .last = g == groups - 1};
+		memcpy(desc[g].b, &header, sizeof(header));
+		memcpy(desc[g].b + sizeof(header), txn->block_nos + first, count * sizeof(block_no_t));
+		blocks[k++] = desc + g;
+		u_int64_t sum = jsum(0xcbf29ce484222325ull, desc + g, MY_BLK_SIZE);
+		for (int i = first; i < first + count; i++)
+		{
+			if (txn->block_nos[i] & JOURNAL_REVOKE)
+				continue;
+			slots[i] = start + k;
+			blocks[k++] = txn->images + i;
+			sum = jsum(sum, txn->images + i, MY_BLK_SIZE);
+		}
+		memcpy(desc[g].b + offsetof(journal_desc_t, checksum), &sum, sizeof(sum));
+	}
+	int ret = disk_write(disk_fd, super_block.journal_start + start, blocks, need) == (int)need ? 0 : -1;
+	free(desc);
+	free(blocks);
+	pthread_mutex_lock(&jlock);
+	if (ret == 0)
+	{
+		jhead = start + need;
+		ret = jsync(jsync_started + 1);
+	}
+	return ret;
+}
+
+/* frees the blocks whose release has been committed */
+static void jfree_deferred()
+{
+	pthread_mutex_lock(&jlock);
+	block_no_t *blocks = jdeferred;
+	int count = jdeferred_count;
+	jdeferred = NULL;
+	jdeferred_count = jdeferred_size = 0;
+	pthread_mutex_unlock(&jlock);
+	for (int i = 0; i < count; i++)
+		bfree_range(blocks[i], 1);
+	free(blocks);
+}
+
+static void jdefer(block_no_t block_no)
+{
+	if (jdeferred_count == jdeferred_size)
+	{
+		int size = jdeferred_size == 0 ? 64 : jdeferred_size * 2;
+		block_no_t *blocks = realloc(jdeferred, size * sizeof(block_no_t));
+		if (blocks == NULL)
+			return; /* the block stays in use */
+		jdeferred = blocks;
+		jdeferred_size = size;
+	}
+	jdeferred[jdeferred_count++] = block_no;
+}
+
+/* jlog with jlock held */
+static u_int64_t jlog_locked(block_no_t block_no, block_t *image)
+{
+	jmap_t *entry = jmap_get(block_no, 1);
+	int i = entry == NULL ? -1 : entry->running;
+	if (entry != NULL && i < 0 && (i = jtxn_add(block_no)) >= 0)
+		entry->running = i;
+	u_int64_t seq = 0;
+	if (i >= 0)
+	{
+		jrunning.block_nos[i] = block_no;
+		memcpy(jrunning.images + i, image, MY_BLK_SIZE);
+		seq = jrunning.seq;
+	}
+	else
+		perror("journal: cannot log block\n");
+	return seq;
+}
+
+/* commits everything logged so far. with drain set, operations in progress are waited for, so none is split
+ * between two transactions. returns when a sync that began after the call has completed */
+static int commit(int drain)
+{
+	if (!jactive())
+		return fdatasync(disk_fd);
+	pthread_mutex_lock(&jlock);
+	u_int64_t need = jsync_started + 1;
+	if (drain && jdepth == 0)
+	{
+		jpending++;
+		while (jupdates > 0)
+			pthread_cond_wait(&jdrained, &jlock);
+		if (--jpending == 0)
+			pthread_cond_broadcast(&jopen);
+	}
+	int ret = 0;
+	if (jrunning.count > 0)
+	{
+		/* the super block (block 0) goes with every transaction, so its free inode list and counts match the
+		 * blocks replayed with it */
+		block_t super = {.b = {0}};
+		memcpy(super.b, &super_block, sizeof(super_block_t));
+		jlog_locked(0, &super);
+		jtxn_t txn = jrunning;
+		jrunning = (jtxn_t){.seq = txn.seq + 1};
+		for (int i = 0; i < txn.count; i++)
+		{
+			jmap_t *entry = jmap_get(txn.block_nos[i] & ~JOURNAL_REVOKE, 0);
+			entry->running = -1;
+			if (entry->live == 0 && !(txn.block_nos[i] & JOURNAL_REVOKE))
+				entry->live = JMAP_WRITING;
+		}
+		/* transactions are written in order, one at a time */
+		while (jbusy || jdone != txn.seq - 1)
+			pthread_cond_wait(&jturn, &jlock);
+		jbusy = 1;
+		block_no_t *slots = malloc(txn.count * sizeof(block_no_t));
+		ret = slots == NULL ? -1 : jwrite(&txn, slots);
+		if (ret != 0)
+			perror("journal: commit failed\n");
+		for (int i = 0; i < txn.count; i++)
+		{
+			block_no_t home = txn.block_nos[i] & ~JOURNAL_REVOKE;
+			jmap_t *entry = jmap_get(home, 1);
+			if (txn.block_nos[i] & JOURNAL_REVOKE)
+			{
+				if (entry != NULL)
+					entry->live = 0;
+				jdefer(home);
+			}
+			else if (ret == 0 && entry != NULL)
+				entry->live = slots[i];
+			else if (entry != NULL && entry->live == JMAP_WRITING)
+				entry->live = 0;
+		}
+		/* the logged buffers may go home now */
+		__atomic_store_n(&jdone, txn.seq, __ATOMIC_RELEASE);
+		jbusy = 0;
+		pthread_cond_broadcast(&jturn);
+		free(slots);
+		free(txn.block_nos);
+		free(txn.images);
+	}
+	else
+	{
+		/* nothing new is logged. a transaction still being written is waited for */
+		while (jdone != jrunning.seq - 1)
+			pthread_cond_wait(&jturn, &jlock);
+	}
+	if (ret == 0)
+		ret = jsync(need);
+	pthread_mutex_unlock(&jlock);
+	if (drain && jdepth == 0)
+		jfree_deferred();
+	return ret;
+}
+
+/* makes everything logged so far durable, and every block written before the call */
+int jcommit()
+{
+	return commit(1);
+}
+
+/* commits without waiting for operations in progress. their changes may end up in two transactions.
+ * used when logged buffers fill the cache and nothing else can be written */
+int jforce()
+{
+	return commit(0);
+}
+
+/* a buffer logged by transaction seq may be written home */
+int jcommitted(u_int64_t seq)
+{
+	return seq <= __atomic_load_n(&jdone, __ATOMIC_ACQUIRE);
+}
+
+/* copies the image of a modified metadata block into the running transaction. a block logged again replaces its
+ * image. returns the transaction, or 0 if the block is not journaled */
+u_int64_t jlog(block_no_t block_no, block_t *image)
+{
+	if (!jactive())
+		return 0;
+	pthread_mutex_lock(&jlock);
+	u_int64_t seq = jlog_locked(block_no, image);
+	pthread_mutex_unlock(&jlock);
+	return seq;
+}
+
+/* a block is being freed. returns 1 if a committed image of it is in the journal: then the block must stay in use
+ * until the release is committed, and is freed after that by the journal */
+int jrevoke(block_no_t block_no)
+{
+	if (!jactive() || __atomic_load_n(&jmap_used, __ATOMIC_RELAXED) == 0)
+		return 0;
+	pthread_mutex_lock(&jlock);
+	jmap_t *entry = jmap_get(block_no, 0);
+	int deferred = 0;
+	if (entry != NULL && entry->live != 0)
+	{
+		if (entry->running >= 0)
+			jrunning.block_nos[entry->running] = JOURNAL_REVOKE | block_no;
+		else
+			entry->running = jtxn_add(JOURNAL_REVOKE | block_no);
+		deferred = entry->running >= 0;
+	}
+	else if (entry != NULL && entry->running >= 0)
+	{
+		/* never committed. its image is just dropped */
+		jtxn_drop(entry->running);
+		entry->running = -1;
+	}
+	pthread_mutex_unlock(&jlock);
+	return deferred;
+}
+
+/* an operation that changes metadata begins. its changes go into one transaction */
+void jbegin()
+{
+	if (jdepth++ > 0)
+		return;
+	jcounted = jactive();
+	if (!jcounted)
+		return;
+	pthread_mutex_lock(&jlock);
+	while (jpending > 0)
+		pthread_cond_wait(&jopen, &jlock);
+	jupdates++;
+	pthread_mutex_unlock(&jlock);
+}
+
+/* the operation ends. the running transaction is committed if it is large or old. the caller holds no lock */
+void jend()
+{
+	if (--jdepth > 0 || !jcounted)
+		return;
+	pthread_mutex_lock(&jlock);
+	if (--jupdates == 0)
+		pthread_cond_broadcast(&jdrained);
+	int due = jrunning.count >= JOURNAL_TXN_BLOCKS || (jrunning.count > 0 && time(NULL) - jrunning.started >= JOURNAL_COMMIT_INTERVAL);
+	int deferred = jdeferred_count;
+	pthread_mutex_unlock(&jlock);
+	if (due)
+		commit(1);
+	else if (deferred > 0)
+		jfree_deferred();
+}
+
+/* writes committed images home and starts the region over */
+int jcheckpoint()
+{
+	if (!jactive())
+		return 0;
+	pthread_mutex_lock(&jlock);
+	while (jbusy)
+		pthread_cond_wait(&jturn, &jlock);
+	jbusy = 1;
+	int ret = jcheckpoint_locked();
+	jbusy = 0;
+	pthread_cond_broadcast(&jturn);
+	pthread_mutex_unlock(&jlock);
+	return ret;
+}
+
+/* run by the background flusher: commits an old transaction and checkpoints a filling journal */
+void jbackground()
+{
+	if (!jactive())
+		return;
+	pthread_mutex_lock(&jlock);
+	int due = jrunning.count > 0 && time(NULL) - jrunning.started >= JOURNAL_COMMIT_INTERVAL;
+	int full = (jhead - 1) * 100 >= (super_block.journal_blocks - 1) * JOURNAL_CHECKPOINT_RATIO;
+	pthread_mutex_unlock(&jlock);
+	if (due)
+		commit(1);
+	if (full)
+		jcheckpoint();
+}
+
+/* reads the transactions of one group after another from slot on, and puts the images of those that are complete
+ * and intact into the map. returns the slot after the last complete transaction */
+static block_no_t jscan(block_no_t slot, u_int64_t *seq)
+{
+	block_t block, *blockp = &block, *images = malloc(DISK_MAX_IOV * sizeof(block_t)), *blocks[DISK_MAX_IOV];
+	block_no_t *entries = malloc(JOURNAL_DESC_ENTRIES * sizeof(block_no_t)), *pending = NULL, *pending_slots = NULL;
+	int num_pending = 0;
+	if (images == NULL || entries == NULL)
+		goto out;
+	for (int i = 0; i < DISK_MAX_IOV; i++)
+		blocks[i] = images + i;
+	for (block_no_t at = slot;;)
+	{
+		journal_desc_t desc;
+		if (at >= super_block.journal_blocks || disk_read(disk_fd, super_block.journal_start + at, &blockp, 1) != 1)
+			break;
+		memcpy(&desc, block.b, sizeof(desc));
+		if (desc.magic != JOURNAL_MAGIC || desc.seq != *seq || desc.count == 0 || desc.count > JOURNAL_DESC_ENTRIES)
+			break;
+		memcpy(entries, block.b + sizeof(desc), desc.count * sizeof(block_no_t));
+		int count = 0;
+		for (u_int32_t i = 0; i < desc.count; i++)
+		{
+			if (!(entries[i] & JOURNAL_REVOKE))
+				count++;
+		}
+		if (at + 1 + count > super_block.journal_blocks)
+			break;
+		memset(block.b + offsetof(journal_desc_t, checksum), 0, sizeof(desc.checksum));
+		u_int64_t sum = jsum(0xcbf29ce484222325ull, &block, MY_BLK_SIZE);
+		for (int i = 0, len; i < count; i += len)
+		{
+			len = count - i < DISK_MAX_IOV ? count - i : DISK_MAX_IOV;
+			if (disk_read(disk_fd, super_block.journal_start + at + 1 + i, blocks, len) != len)
+				goto out;
+			for (int j = 0; j < len; j++)
+				sum = jsum(sum, images + j, MY_BLK_SIZE);
+		}
+		if (sum != desc.checksum)
+			break;
+		block_no_t *more = realloc(pending, (num_pending + desc.count) * sizeof(block_no_t));
+		if (more == NULL)
+			break;
+		pending = more;
+		if ((more = realloc(pending_slots, (num_pending + desc.count) * sizeof(block_no_t))) == NULL)
+			break;
+		pending_slots = more;
+		block_no_t image_slot = at + 1;
+		for (u_int32_t i = 0; i < desc.count; i++)
+		{
+			pending[num_pending] = entries[i];
+			pending_slots[num_pending++] = entries[i] & JOURNAL_REVOKE ? 0 : image_slot++;
+		}
+		at = image_slot;
+		if (!desc.last)
+			continue;
+		/* the transaction is complete. a revoke hides older images of its block */
+		for (int i = 0; i < num_pending; i++)
+		{
+			jmap_t *entry = jmap_get(pending[i] & ~JOURNAL_REVOKE, !(pending[i] & JOURNAL_REVOKE));
+			if (entry != NULL)
+				entry->live = pending_slots[i];
+		}
+		num_pending = 0;
+		slot = at;
+		(*seq)++;
+	}
+out:
+	free(images);
+	free(entries);
+	free(pending);
+	free(pending_slots);
+	return slot;
+}
+
+/* replays the committed transactions left in the journal by a crash: their images are written home. then the
+ * region starts over. cached copies of replayed blocks are dropped */
+static int jreplay()
+{
+	block_t block, *blockp = &block;
+	journal_header_t header;
+	if (disk_read(disk_fd, super_block.journal_start, &blockp, 1) != 1)
+		return -1;
+	memcpy(&header, block.b, sizeof(header));
+	pthread_mutex_lock(&jlock);
+	u_int64_t seq = 1;
+	block_no_t slot = 1;
+	if (header.magic == JOURNAL_MAGIC && header.tail >= 1)
+	{
+		seq = header.seq;
+		slot = jscan(header.tail, &seq);
+	}
+	jdone = seq - 1;
+	jrunning.seq = seq;
+	jhead = slot;
+	int n = 0;
+	block_no_t *replayed = malloc(jmap_used * sizeof(block_no_t) + 1);
+	for (u_int32_t i = 0; replayed != NULL && i < jmap_size; i++)
+	{
+		if (jmap[i].block_no != JMAP_EMPTY && jmap[i].live != 0)
+			replayed[n++] = jmap[i].block_no;
+	}
+	/* nothing to replay after a clean unmount. the region is used on from where it is */
+	int ret = 0;
+	if (n > 0)
+	{
+		jbusy = 1;
+		ret = jcheckpoint_locked();
+		jbusy = 0;
+	}
+	pthread_mutex_unlock(&jlock);
+	for (int i = 0; i < n; i++)
+		binvalidate(replayed[i], 1);
+	free(replayed);
+	return ret;
+}
+
+/* brings the journal to use on a mounted volume, replaying what a crash left in it. called before the volume's
+ * blocks are used; it is also done by the first journaled change */
+int jrecover()
+{
+	if (super_block.journal_blocks < 2 || DISK_IS_MAPPED())
+		return 0;
+	pthread_mutex_lock(&jinit_lock);
+	if (!jready)
+	{
+		jinit_ret = jreplay();
+		__atomic_store_n(&jready, 1, __ATOMIC_RELEASE);
+	}
+	int ret = jinit_ret;
+	pthread_mutex_unlock(&jinit_lock);
+	return ret;
+}
+
+/* commits and checkpoints the journal of a volume being unmounted, so it is left empty, and forgets it.
+ * no operation may be in progress. the next jrecover reads the journal of whatever volume is mounted then */
+int jclose()
+{
+	if (!__atomic_load_n(&jready, __ATOMIC_ACQUIRE))
+		return 0;
+	int ret = 0;
+	if (jactive() && (jcommit() != 0 || jcheckpoint() != 0))
+		ret = -1;
+	pthread_mutex_lock(&jinit_lock);
+	pthread_mutex_lock(&jlock);
+	free(jmap);
+	jmap = NULL;
+	jmap_size = jmap_used = 0;
+	free(jrunning.block_nos);
+	free(jrunning.images);
+	jrunning = (jtxn_t){.seq = 1};
+	jdone = 0;
+	jhead = 1;
+	jinit_ret = 0;
+	__atomic_store_n(&jready, 0, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&jlock);
+	pthread_mutex_unlock(&jinit_lock);
+	return ret;
+}
@@ -0,0 +1,55 @@
+#include "myfs.h"
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+/* blocks of the journal region made by create_volume. can be overridden at compile time. */
+#ifndef JOURNAL_BLOCKS
+#define JOURNAL_BLOCKS 1024
+#endif
+/* a transaction that has logged this many blocks is committed when the operation adding to it ends.
+ * logged blocks stay in the buffer cache until committed, so it must be well below NUM_BUFFERS. */
+#ifndef JOURNAL_TXN_BLOCKS
+#define JOURNAL_TXN_BLOCKS (NUM_BUFFERS / 4)
+#endif
+/* a transaction older than this many seconds is committed when the operation adding to it ends */
+#define JOURNAL_COMMIT_INTERVAL 5
+/* the background flusher checkpoints the journal once this percentage of it is used */
+#define JOURNAL_CHECKPOINT_RATIO 50
+
+#define JOURNAL_MAGIC 0x4a4e4c4du
+/* in a descriptor entry: the block was freed. older images of it are not replayed */
+#define JOURNAL_REVOKE 0x80000000u
+
+/* first block of the journal region. tells where replay starts */
+typedef struct
+{
+	u_int32_t magic;
+	u_int32_t tail; /* block of the region holding the first descriptor to replay */
+	u_int64_t seq;	/* sequence number of the transaction at tail */
+} journal_header_t;
+
+/* heads each group of logged blocks. the images of the entries that are not revokes follow it, in order.
+ * a transaction is one or more groups with the same seq, the last one flagged */
+typedef struct
+{
+	u_int32_t magic;
+	u_int32_t count; /* entries */
+	u_int64_t seq;
+	u_int32_t last;		/* 1 on the last group of the transaction */
+	u_int32_t unused;
+	u_int64_t checksum; /* of the descriptor with this field 0 and the images that follow */
+} journal_desc_t;
+#define JOURNAL_DESC_ENTRIES ((int)((MY_BLK_SIZE - sizeof(journal_desc_t)) / sizeof(block_no_t)))
+
+extern int jrecover();
+extern int jclose();
+extern void jbegin();
+extern void jend();
+extern u_int64_t jlog(block_no_t, block_t *);
+extern int jrevoke(block_no_t);
+extern int jcommitted(u_int64_t);
+extern int jcommit();
+extern int jforce();
+extern int jcheckpoint();
+extern void jbackground();
+#endif
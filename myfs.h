@@ -5,6 +5,8 @@
 #include <stdlib.h>
 #include <stddef.h>
 #include <memory.h>
+#include <stdint.h>
+#include <pthread.h>
 
 #ifndef MYFS_H
 #define MYFS_H
@@ -25,20 +27,38 @@ typedef struct
 	u_int32_t num_blocks;
 	u_int32_t num_inodes;
 	inode_no_t root;
-	inode_no_t ifreeptr;
-	u_int32_t ifreecount;
-	block_no_t bfreeptr;
-	u_int32_t bfreecount;
+	block_no_t ibitmap_start; /* first block of the inode bitmap. see ialloc_near */
+	u_int32_t group_blocks; /* blocks of each allocation group. a whole number of bitmap blocks. see block.c */
+	u_int32_t group_inodes; /* inodes of each allocation group. the inodes of group g have their data in block group g */
+	u_int32_t bfreecount;  /* number of free blocks */
+	block_no_t bitmap_start; /* first block of the free space bitmap */
+	block_no_t journal_start; /* first block of the metadata journal. see journal.c */
+	u_int32_t journal_blocks; /* 0 if the volume has no journal */
+	u_int32_t magic;		  /* SUPER_MAGIC on a volume made by create_volume */
+	u_int32_t clean;		  /* 1 on disk after a clean unmount, 0 while mounted. see mymount */
+	block_no_t summary_start; /* free blocks covered by each bitmap block. valid only after a clean unmount */
+	u_int32_t num_free_inodes;
+	inode_no_t ilazy; /* first inode whose table block was never made. 0 once the whole table is made */
 } super_block_t;
+#define SUPER_MAGIC 0x5346594du
+/* create_volume_flags flags */
+#define VOL_LAZY_ITABLE 0b1 /* the inode table is made as inodes are allocated */
+#define VOL_PREALLOCATE 0b10 /* the file holding the volume gets all its space at once */
 extern super_block_t super_block;
 typedef struct
 {
 	byte_t b[MY_BLK_SIZE];
 } block_t;
-typedef struct
+typedef struct buffer_header
 {
 	block_no_t block_no;
 	int status;
+	block_t *data;
+	struct buffer_header *hash_next, *hash_prev; /* chain of buffers with same hash */
+	struct buffer_header *free_next, *free_prev; /* free list (clean unoccupied buffers) or dirty list */
+	time_t dirtied;								 /* when the buffer was first modified since last written */
+	int waiters;								 /* threads sleeping until the buffer is released */
+	u_int64_t jtid;								 /* journal transaction that last logged the block. it is not written before that commits */
 } buffer_header_t;
 typedef struct
 {
@@ -51,8 +71,19 @@ typedef int64_t offset_t;
 #define NUM_1DEG_INDEX 8
 #define NUM_2DEG_INDEX 0
 #define NUM_3DEG_INDEX 0
-#define INDEX_SIZE (MY_BLK_SIZE / sizeof(block_no_t))
+#define INDEX_SIZE ((int)(MY_BLK_SIZE / sizeof(block_no_t)))
 #define KEY_SIZE 20
+/* block numbers from DALLOC_BASE on name blocks of delayed allocation. their physical block is not chosen yet, they live only in the buffer cache */
+#define DALLOC_BASE 0x80000000u
+#define IS_DELAYED_BLOCK(block_no) ((block_no) >= DALLOC_BASE)
+#define BITS_PER_BITMAP_BLOCK (MY_BLK_SIZE * 8)
+#define BITMAP_BLOCKS(num_blocks) (((num_blocks) + BITS_PER_BITMAP_BLOCK - 1) / BITS_PER_BITMAP_BLOCK)
+#define IBITMAP_BLOCKS(num_inodes) BITMAP_BLOCKS((num_inodes) + 1)
+/* bitmap blocks of each allocation group of a new volume. can be overridden at compile time */
+#ifndef GROUP_BITMAP_BLOCKS
+#define GROUP_BITMAP_BLOCKS 4
+#endif
+#define SUMMARY_BLOCKS(num_blocks) ((BITMAP_BLOCKS(num_blocks) * sizeof(u_int32_t) + MY_BLK_SIZE - 1) / MY_BLK_SIZE)
 extern char err[100];
 typedef union
 {
@@ -63,25 +94,49 @@ typedef union
 	} ugo;
 } permission_t;
 typedef struct
+{
+	block_no_t logical;	 /* first logical block of the run */
+	block_no_t physical; /* first physical block of the run */
+	u_int32_t length;	 /* number of blocks in the run */
+} extent_t;
+#define NUM_INLINE_EXTENTS 2
+typedef struct
 {
 	offset_t size;
 	u_int32_t size_on_disk;
-	struct
+	union
 	{
 		block_no_t deg1[NUM_1DEG_INDEX];
+		struct
+		{
+			u_int16_t count; /* extents in use */
+			u_int16_t depth; /* 0: extents are inline. 1: extents are in block 'tree' */
+			block_no_t tree;
+			extent_t extent[NUM_INLINE_EXTENTS];
+		} extents; /* used when INODE_FL_EXTENTS is set in flags */
 	} index;
 	u_int16_t links;
 	u_int16_t type;
 	permission_t permission;
 	u_int16_t protection;
+	u_int16_t flags;
 } disk_inode_t;
-typedef struct
+typedef struct inode
 {
 	inode_no_t inode_no;
 	int status;
 	u_int16_t reference_count;
 	byte_t key[KEY_SIZE];
 	disk_inode_t disk_inode;
+	struct bmap_chunk *bmap_cache; /* cached block translations. see bmap_cache.c */
+	u_int32_t bmap_gen;			   /* bumped when a cached translation of the inode changes. see bmap_cache.c */
+	u_int32_t num_delayed;		   /* blocks of delayed allocation. see dalloc.c */
+	offset_t dir_free;			   /* linear directory: no free entry slot below this offset. see dir_add */
+	struct inode *hash_next;			   /* chain of cached inodes with same hash */
+	struct inode *lru_next, *lru_prev;   /* lru list of unreferenced cached inodes */
+	pthread_rwlock_t lock;				   /* many readers or one writer. see ilock */
+	pthread_t writer;					   /* holder of the exclusive lock while INODE_LOCKED is set */
+	u_int32_t lock_depth;				   /* times the writer took the lock again */
 } inode_t;
 typedef struct
 {
@@ -89,41 +144,90 @@ typedef struct
 	u_int16_t type;
 	char name[10];
 } dir_entry_t;
+typedef struct
+{
+	dir_entry_t dir_entry;
+	disk_inode_t disk_inode; /* inode the entry names, as read by myreaddirplus */
+} dir_entry_plus_t;
 
 typedef struct
 {
 	inode_t *inode;
 	offset_t offset;
 	int mode;
+	offset_t ra_next;	  /* offset at which next read is sequential */
+	block_no_t ra_end;	  /* logical block up to which read-ahead has been issued */
+	u_int32_t ra_window; /* current read-ahead window in blocks. 0 if access is random */
+	u_int32_t refs;		  /* fds sharing this open file, and calls using it right now. 0 if unused */
+	pthread_mutex_t pos_lock; /* held by a read, write or seek for the offset and read-ahead state */
 } open_file_info_t;
 
 #define DISK_INODE_SIZE sizeof(disk_inode_t)
-#define INODES_PER_BLOCK (MY_BLK_SIZE) / (DISK_INODE_SIZE)
+#define INODES_PER_BLOCK ((int)((MY_BLK_SIZE) / (DISK_INODE_SIZE)))
 
 /*  */extern int getblk(block_no_t, buffer_t *);
 /*  */extern int brelse(buffer_t *);
 /*  */extern int bread(block_no_t, buffer_t *);
 /*  */extern int bwrite(buffer_t *);
+/*  */extern int breadv(block_no_t, int, buffer_t *);
+/*  */extern int bwritev(buffer_t *, int);
+/*  */extern int bprefetch(block_no_t, u_int32_t);
+/*  */extern int bprefetchv(const block_no_t *, int);
 /*  */extern int bclearcache();
+/*  */extern int bflush();
+/*  */extern int bflushrange(block_no_t, u_int32_t);
+/*  */extern int binvalidate(block_no_t, u_int32_t);
+/*  */extern int isync();
+/*  */extern int mysync();
+/*  */extern int myfsync(int);
+/*  */extern int create_volume(const char *, block_no_t, inode_no_t);
+/*  */extern int create_volume_flags(const char *, block_no_t, inode_no_t, int);
+/*  */extern int mymount(const char *);
+/*  */extern int myumount();
 /*  */extern int iget(inode_no_t, inode_t **);
 /*  */extern int iput(inode_t *);
 /*  */extern int bmap(inode_t *, offset_t, block_no_t *, offset_t *, size_t *);
+/*  */extern int bmap_run(inode_t *, block_no_t, block_no_t *, u_int32_t *);
+/*  */extern block_no_t alloc_goal(inode_t *, block_no_t);
 /*  */extern int namei(const char *, inode_t **);
 /*  */extern int ialloc(inode_t **);
+/*  */extern int ialloc_near(inode_no_t, inode_t **);
+/*  */extern inode_no_t igroup_pick();
 /*  */extern int ifree(inode_no_t);
+/*  */extern int imount();
+/*  */extern void iumount();
 /*  */extern int balloc(buffer_t *);
 /*  */extern int bfree(block_no_t);
+/*  */extern int balloc_near(block_no_t, buffer_t *);
+/*  */extern int balloc_range(block_no_t, u_int32_t, u_int32_t, block_no_t *);
+/*  */extern int bfree_range(block_no_t, u_int32_t);
+/*  */extern int bnew(block_no_t, buffer_t *);
+/*  */extern int brename(block_no_t, block_no_t);
+/*  */extern int breserve(u_int32_t);
+/*  */extern void bunreserve(u_int32_t);
+/*  */extern int balloc_reserved(block_no_t, u_int32_t, u_int32_t, block_no_t *);
+/*  */extern block_no_t bgroup_goal(inode_no_t);
+/*  */extern u_int32_t bgroup_free(u_int32_t);
+/*  */extern int bmount(int);
+/*  */extern int bumount();
+/*  */extern int dalloc_flush();
 /*  */extern int free_all_blocks(inode_t *);
 /*  */extern int myopen(const char *, int, ...);
 /*  */extern ssize_t myread(int, byte_t *, size_t);
 /*  */extern ssize_t mywrite(int, byte_t *, size_t);
 /*  */extern offset_t mylseek(int, offset_t , int);
 /*  */extern int myclose(int);
+/*  */extern int mydup(int);
+/*  */extern int myfallocate(int, offset_t, offset_t, int);
 /*  */extern int mycreat(const char *, permission_t);
 /*  */extern int mymkdir(const char *, const char *);
 /*  */extern int myrmdir(const char *);
 /*  */extern int mylink(const char *, const char *);
 /*  */extern int myunlink(const char *);
+/*  */extern int myopendir(const char *);
+/*  */extern int myreaddir(int, dir_entry_t *, int);
+/*  */extern int myreaddirplus(int, dir_entry_plus_t *, int);
+/*  */extern int myclosedir(int);
 /*  */extern int encode(index_entry_no_t, byte_t[KEY_SIZE],...);
 /*  */extern int add_physical_block(inode_t*,block_no_t, block_no_t);
 /*  */extern dir_entry_t dir_lookup(inode_t *, const char *, offset_t*);